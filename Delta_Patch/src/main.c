@@ -0,0 +1,203 @@
+/*
+ ============================================================================
+ Name        : Boot File Delta Generator
+ Version     : v1.0.0
+ Description : Making a delta between two Zynq-7000 boot files, which is
+ 	 	 	   uploaded to the TFTP server as BOOT.BIN.patch and applied
+ 	 	 	   against the boot file on the SD card.
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define DELTA_MAGIC		"TDL1"
+
+#define DELTA_END		0
+#define DELTA_COPY		1
+#define DELTA_ADD		2
+#define DELTA_DATA		3
+
+/* bytes hashed to find a match, and the shortest match worth a COPY */
+#define MATCH_LEN		32
+
+static uint8_t *oldData, *newData;
+static long oldSize, newSize;
+static uint32_t *hashTable;
+static uint32_t hashBits;
+static FILE *out;
+
+static uint8_t *read_file(const char *filename, long *size)
+{
+	FILE *file = fopen(filename, "rb");
+	uint8_t *data;
+
+	if (!file) {
+		printf("Unable to open %s\r\n", filename);
+		exit(1);
+	}
+
+	fseek(file, 0, SEEK_END);
+	*size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	data = malloc(*size + 1);
+	if (!data || (fread(data, 1, *size, file) != (size_t)*size)) {
+		printf("Unable to read %s\r\n", filename);
+		exit(1);
+	}
+	fclose(file);
+
+	return data;
+}
+
+static void put32(uint32_t value)
+{
+	uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+
+	fwrite(bytes, 1, 4, out);
+}
+
+static uint32_t crc32(const uint8_t *data, long len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	int i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 1) ? (0xEDB88320 ^ (crc >> 1)) : (crc >> 1);
+	}
+
+	return ~crc;
+}
+
+static uint32_t hash(const uint8_t *data)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < MATCH_LEN; i++)
+		h = (h ^ data[i]) * 16777619u;
+
+	return h >> (32 - hashBits);
+}
+
+/*
+ * Bytes of the new file between two matches are sent as an ADD against
+ * the old file after the previous match when most of them are the same
+ * (a changed address or constant in otherwise equal code), so that the
+ * delta is mostly zeros. Otherwise they are sent as they are.
+ */
+static void emit_literal(long newPos, long len, long oldPos)
+{
+	long same = 0, i;
+
+	if (!len)
+		return;
+
+	if ((oldPos >= 0) && (oldPos + len <= oldSize)) {
+		for (i = 0; i < len; i++)
+			same += (oldData[oldPos + i] == newData[newPos + i]);
+	}
+
+	if (same * 2 > len) {
+		fputc(DELTA_ADD, out);
+		put32(oldPos);
+		put32(len);
+		for (i = 0; i < len; i++)
+			fputc((uint8_t)(newData[newPos + i] - oldData[oldPos + i]), out);
+	}
+	else {
+		fputc(DELTA_DATA, out);
+		put32(len);
+		fwrite(newData + newPos, 1, len, out);
+	}
+}
+
+static void make_delta(void)
+{
+	long pos = 0, literal = 0, lastOld = 0, oldPos, len, i;
+	uint32_t entry;
+
+	/* every position of the old file is indexed, the last one wins */
+	for (hashBits = 16; ((1L << hashBits) < oldSize) && (hashBits < 26); hashBits++);
+	hashTable = calloc(1UL << hashBits, sizeof *hashTable);
+	if (!hashTable) {
+		printf("Not enough memory\r\n");
+		exit(1);
+	}
+	for (i = 0; i + MATCH_LEN <= oldSize; i++)
+		hashTable[hash(oldData + i)] = i + 1;
+
+	fwrite(DELTA_MAGIC, 1, 4, out);
+	put32(oldSize);
+	put32(newSize);
+	put32(crc32(newData, newSize));
+
+	while (pos + MATCH_LEN <= newSize) {
+		/* the old file after the previous match is tried first */
+		oldPos = lastOld;
+		if ((oldPos + MATCH_LEN > oldSize) ||
+				memcmp(oldData + oldPos, newData + pos, MATCH_LEN)) {
+			entry = hashTable[hash(newData + pos)];
+			oldPos = entry - 1;
+			if (!entry || memcmp(oldData + oldPos, newData + pos, MATCH_LEN)) {
+				pos++;
+				lastOld++;
+				continue;
+			}
+		}
+
+		len = MATCH_LEN;
+		while ((pos + len < newSize) && (oldPos + len < oldSize) &&
+				(newData[pos + len] == oldData[oldPos + len]))
+			len++;
+
+		emit_literal(literal, pos - literal, lastOld - (pos - literal));
+
+		fputc(DELTA_COPY, out);
+		put32(oldPos);
+		put32(len);
+
+		pos += len;
+		literal = pos;
+		lastOld = oldPos + len;
+	}
+
+	emit_literal(literal, newSize - literal, lastOld - (pos - literal));
+	fputc(DELTA_END, out);
+}
+
+int main(int argc, char *argv[])
+{
+	long deltaSize;
+
+	printf("=============== Zynq-7000 TFTP Server ===============\r\n");
+	printf("========== Boot File Delta Generator v1.0.0 =========\r\n\n");
+
+	if (argc != 4) {
+		printf("Usage: %s <current BOOT.BIN> <new BOOT.BIN> <BOOT.BIN.patch>\r\n", argv[0]);
+		return 1;
+	}
+
+	oldData = read_file(argv[1], &oldSize);
+	newData = read_file(argv[2], &newSize);
+
+	out = fopen(argv[3], "wb");
+	if (!out) {
+		printf("Unable to create %s\r\n", argv[3]);
+		return 1;
+	}
+
+	make_delta();
+	deltaSize = ftell(out);
+	fclose(out);
+
+	printf("Delta of %ld bytes made for a boot file of %ld bytes.\r\n", deltaSize, newSize);
+	printf("Upload it to the server as BOOT.BIN.patch.\r\n");
+
+	return 0;
+}
@@ -8,6 +8,11 @@
 #include "aes.h"
 #include "string.h"
 
+/* the key and IV the boot images are encrypted with by AES_Encryption */
+uint8_t key[] 	= { 0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+					0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4 };
+uint8_t iv[]  	= { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+
 static void KeyExpansion(uint8_t *RoundKey, const uint8_t *Key)
 {
 	unsigned i, j, k;
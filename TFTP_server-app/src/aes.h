@@ -85,6 +85,9 @@ struct AES_ctx {
   uint8_t Iv[AES_BLOCKLEN];
 };
 
+extern uint8_t key[AES_KEYLEN];
+extern uint8_t iv[AES_BLOCKLEN];
+
 void aes_init_ctx_iv(struct AES_ctx *ctx, const uint8_t *key, const uint8_t *iv);
 void decrypt_aes(struct AES_ctx *ctx, uint8_t *buf, size_t length);
 
@@ -0,0 +1,384 @@
+/*
+ * file_cache.c
+ */
+
+#include "file_cache.h"
+
+#include <string.h>
+#include <strings.h>
+
+#include "xil_printf.h"
+#include "lwip/sys.h"
+
+static FILE_CACHE_ENTRY cacheEntries[FILE_CACHE_MAX_ENTRIES];
+
+/* next page of every page in its chain, and the chain of the free pages */
+static u16 pageNext[FILE_CACHE_PAGES];
+static u16 freePages;
+static u32 freePageCount;
+
+/* counter of the lookups, used as the time of the last use */
+static u32 useClock;
+
+/* This function skips the drive and the leading '/' of a path */
+static const char *fileCacheKey(const char *path)
+{
+	if (!strncmp(path, "0:", 2))
+		path += 2;
+	while (*path == '/')
+		path++;
+
+	return path;
+}
+
+/* This function gives the pages of an entry back and empties it */
+static void fileCacheDrop(FILE_CACHE_ENTRY *entry)
+{
+	u16 page = entry->firstPage;
+	u16 next;
+
+	while (page != FILE_CACHE_NO_PAGE) {
+		next = pageNext[page];
+		pageNext[page] = freePages;
+		freePages = page;
+		freePageCount++;
+		page = next;
+	}
+
+	entry->used = 0;
+	entry->firstPage = FILE_CACHE_NO_PAGE;
+}
+
+/*
+ * This function drops the entries which are stale (or were never
+ * completed) as soon as nobody reads them. Returns the number of
+ * entries dropped.
+ */
+static int fileCacheReap(void)
+{
+	FILE_CACHE_ENTRY *entry;
+	int i, dropped = 0;
+
+	for (i = 0; i < FILE_CACHE_MAX_ENTRIES; i++) {
+		entry = &cacheEntries[i];
+		if (entry->used && !entry->refs && (entry->stale || !entry->complete)) {
+			fileCacheDrop(entry);
+			dropped++;
+		}
+	}
+
+	return dropped;
+}
+
+/*
+ * This function drops the least recently used entry which nobody
+ * reads. Returns 0 if an entry is dropped or -1 if all are in use.
+ */
+static int fileCacheEvict(void)
+{
+	FILE_CACHE_ENTRY *entry, *victim = NULL;
+	int i;
+
+	for (i = 0; i < FILE_CACHE_MAX_ENTRIES; i++) {
+		entry = &cacheEntries[i];
+		if (!entry->used || entry->refs)
+			continue;
+		if (!victim || ((s32)(entry->lastUse - victim->lastUse) < 0))
+			victim = entry;
+	}
+
+	if (!victim)
+		return -1;
+
+	fileCacheDrop(victim);
+
+	return 0;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function empties the cache and puts all pages on the free list.
+*
+* @param	None.
+*
+* @return	None.
+*
+* @note		None.
+*
+******************************************************************************/
+void fileCacheInit(void)
+{
+	int i;
+
+	memset(cacheEntries, 0, sizeof cacheEntries);
+
+	freePages = FILE_CACHE_NO_PAGE;
+	for (i = FILE_CACHE_PAGES - 1; i >= 0; i--) {
+		pageNext[i] = freePages;
+		freePages = i;
+	}
+	freePageCount = FILE_CACHE_PAGES;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function looks up a completely cached file and takes a reference
+* to its entry.
+*
+* @param	path is a pointer to the path of the file.
+* @param	info is a pointer to the attributes of the file (see f_stat).
+*
+* @return	The entry of the file, or NULL if the file is not cached
+*			or it has changed since it was cached.
+*
+* @note		The reference must be given back with fileCacheRelease.
+*
+******************************************************************************/
+FILE_CACHE_ENTRY *fileCacheLookup(const char *path, FILINFO *info)
+{
+	FILE_CACHE_ENTRY *entry;
+	int i;
+	SYS_ARCH_DECL_PROTECT(lev);
+
+	path = fileCacheKey(path);
+
+	for (i = 0; i < FILE_CACHE_MAX_ENTRIES; i++) {
+		entry = &cacheEntries[i];
+		if (!entry->used || !entry->complete || entry->stale || strcasecmp(entry->path, path))
+			continue;
+
+		/* the file is changed on the SD card */
+		if ((entry->size != info->fsize) || (entry->fdate != info->fdate) ||
+			(entry->ftime != info->ftime)) {
+			entry->stale = 1;
+			continue;
+		}
+
+		SYS_ARCH_PROTECT(lev);
+		entry->refs++;
+		SYS_ARCH_UNPROTECT(lev);
+
+		entry->lastUse = ++useClock;
+		return entry;
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function creates an empty entry for a file, with the pages for
+* all of it. Unused entries are evicted, least recently used first,
+* until there is room for the file.
+*
+* @param	path is a pointer to the path of the file.
+* @param	info is a pointer to the attributes of the file (see f_stat).
+*
+* @return	The entry, with a reference taken, or NULL if the file
+*			does not fit into the cache right now.
+*
+* @note		The file must be read into the entry with fileCacheData,
+*			and the entry must be completed with fileCacheComplete
+*			before anybody else can find it.
+*
+******************************************************************************/
+FILE_CACHE_ENTRY *fileCacheCreate(const char *path, FILINFO *info)
+{
+	FILE_CACHE_ENTRY *entry = NULL;
+	u32 pages = (info->fsize + FILE_CACHE_PAGE_SIZE - 1) / FILE_CACHE_PAGE_SIZE;
+	u16 page;
+	u32 i;
+
+	path = fileCacheKey(path);
+
+	if ((pages > FILE_CACHE_PAGES) || (strlen(path) >= FILE_CACHE_MAX_PATH))
+		return NULL;
+
+	/* a file which is being cached by another reader is not cached twice */
+	for (i = 0; i < FILE_CACHE_MAX_ENTRIES; i++) {
+		if (cacheEntries[i].used && !cacheEntries[i].stale &&
+			!strcasecmp(cacheEntries[i].path, path))
+			return NULL;
+	}
+
+	fileCacheReap();
+
+	while (freePageCount < pages) {
+		if (fileCacheEvict())
+			return NULL;
+	}
+
+	for (i = 0; !entry; i++) {
+		if (i == FILE_CACHE_MAX_ENTRIES) {
+			if (fileCacheEvict())
+				return NULL;
+			i = 0;
+		}
+		if (!cacheEntries[i].used)
+			entry = &cacheEntries[i];
+	}
+
+	memset(entry, 0, sizeof *entry);
+	strcpy(entry->path, path);
+	entry->size = info->fsize;
+	entry->fdate = info->fdate;
+	entry->ftime = info->ftime;
+	entry->pages = pages;
+	entry->used = 1;
+	entry->refs = 1;
+	entry->lastUse = ++useClock;
+
+	/* taking the pages from the free list, in the order of the file */
+	entry->firstPage = FILE_CACHE_NO_PAGE;
+	for (i = 0; i < pages; i++) {
+		page = freePages;
+		freePages = pageNext[page];
+		freePageCount--;
+
+		pageNext[page] = entry->firstPage;
+		entry->firstPage = page;
+	}
+
+	/* the pages are taken in reverse, so the chain is turned around */
+	page = entry->firstPage;
+	entry->firstPage = FILE_CACHE_NO_PAGE;
+	while (page != FILE_CACHE_NO_PAGE) {
+		u16 next = pageNext[page];
+
+		pageNext[page] = entry->firstPage;
+		entry->firstPage = page;
+		page = next;
+	}
+
+	return entry;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function marks an entry as completely read, so it can be found
+* by fileCacheLookup.
+*
+* @param	entry is a pointer to the entry.
+*
+* @return	None.
+*
+* @note		None.
+*
+******************************************************************************/
+void fileCacheComplete(FILE_CACHE_ENTRY *entry)
+{
+	entry->complete = 1;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function gives back a reference to an entry.
+*
+* @param	entry is a pointer to the entry, it may be NULL.
+*
+* @return	None.
+*
+* @note		This function may be called from an interrupt, so it only
+*			counts the reference. Entries which are no longer used
+*			are dropped later by the other functions.
+*
+******************************************************************************/
+void fileCacheRelease(FILE_CACHE_ENTRY *entry)
+{
+	SYS_ARCH_DECL_PROTECT(lev);
+
+	if (!entry)
+		return;
+
+	SYS_ARCH_PROTECT(lev);
+	entry->refs--;
+	SYS_ARCH_UNPROTECT(lev);
+}
+
+/*****************************************************************************/
+/**
+*
+* This function invalidates the entry of a file which is written.
+*
+* @param	path is a pointer to the path of the file.
+*
+* @return	None.
+*
+* @note		An entry which is still read is dropped when its last
+*			reader is done.
+*
+******************************************************************************/
+void fileCacheInvalidate(const char *path)
+{
+	int i;
+
+	path = fileCacheKey(path);
+
+	for (i = 0; i < FILE_CACHE_MAX_ENTRIES; i++) {
+		if (cacheEntries[i].used && !strcasecmp(cacheEntries[i].path, path))
+			cacheEntries[i].stale = 1;
+	}
+
+	fileCacheReap();
+}
+
+/*****************************************************************************/
+/**
+*
+* This function sets a cursor to the start of an entry.
+*
+* @param	cursor is a pointer to the cursor.
+* @param	entry is a pointer to the entry.
+*
+* @return	None.
+*
+* @note		None.
+*
+******************************************************************************/
+void fileCacheInitCursor(FILE_CACHE_CURSOR *cursor, FILE_CACHE_ENTRY *entry)
+{
+	cursor->entry = entry;
+	cursor->pageNo = 0;
+	cursor->page = entry->firstPage;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function returns the address of the given offset of a cached file.
+*
+* @param	cursor is a pointer to the cursor of the reader.
+* @param	offset is the offset in the file, it must be less than its size.
+* @param	len is a pointer which receives the number of bytes which
+*			are contiguous from the returned address (up to the end
+*			of the page).
+*
+* @return	The address of the data.
+*
+* @note		Pages are found by walking the chain from the cursor, so
+*			moving forward is cheap. Moving back starts over from the
+*			first page.
+*
+******************************************************************************/
+char *fileCacheData(FILE_CACHE_CURSOR *cursor, FSIZE_t offset, u32 *len)
+{
+	u32 pageNo = offset / FILE_CACHE_PAGE_SIZE;
+	u32 inPage = offset % FILE_CACHE_PAGE_SIZE;
+
+	if (pageNo < cursor->pageNo)
+		fileCacheInitCursor(cursor, cursor->entry);
+
+	while (cursor->pageNo < pageNo) {
+		cursor->page = pageNext[cursor->page];
+		cursor->pageNo++;
+	}
+
+	*len = FILE_CACHE_PAGE_SIZE - inPage;
+
+	return (char *)FILE_CACHE_ADDR + ((u32)cursor->page * FILE_CACHE_PAGE_SIZE) + inPage;
+}
@@ -0,0 +1,73 @@
+/*
+ * file_cache.h
+ */
+
+#ifndef SRC_FILE_CACHE_H_
+#define SRC_FILE_CACHE_H_
+
+#include "ff.h"
+#include "xil_types.h"
+
+/*
+ * The cache keeps recently read files in a fixed area of the DDR,
+ * which is not used by the program (below FILE_DATA_ADDR_TX of the
+ * QSPI functions). The area is divided into pages, and a file takes
+ * a chain of pages, so the cache does not get fragmented.
+ */
+#ifndef FILE_CACHE_ADDR
+#define FILE_CACHE_ADDR			0x10000000
+#endif
+#ifndef FILE_CACHE_SIZE
+#define FILE_CACHE_SIZE			0x10000000
+#endif
+#define FILE_CACHE_PAGE_SIZE	(64 * 1024)
+#define FILE_CACHE_PAGES		(FILE_CACHE_SIZE / FILE_CACHE_PAGE_SIZE)
+#define FILE_CACHE_NO_PAGE		0xFFFF
+
+#define FILE_CACHE_MAX_ENTRIES	32
+#define FILE_CACHE_MAX_PATH		(FF_MAX_LFN + 1)
+
+typedef struct {
+	/* path of the file, without the drive and the leading '/' */
+	char path[FILE_CACHE_MAX_PATH];
+
+	/* the file is cached as long as these attributes are unchanged */
+	FSIZE_t size;
+	WORD fdate;
+	WORD ftime;
+
+	/* chain of the pages holding the file */
+	u16 firstPage;
+	u32 pages;
+
+	/* the entry holds a file, and all of it is read */
+	u8 used;
+	u8 complete;
+
+	/* the file has changed, the entry is dropped when it is unused */
+	u8 stale;
+
+	/* readers of the entry, they may be dropped from an interrupt */
+	volatile u32 refs;
+
+	/* last time the entry is looked up, for the LRU eviction */
+	u32 lastUse;
+} FILE_CACHE_ENTRY;
+
+/* position of a reader in the page chain of an entry */
+typedef struct {
+	FILE_CACHE_ENTRY *entry;
+	u32 pageNo;
+	u16 page;
+} FILE_CACHE_CURSOR;
+
+void fileCacheInit(void);
+FILE_CACHE_ENTRY *fileCacheLookup(const char *path, FILINFO *info);
+FILE_CACHE_ENTRY *fileCacheCreate(const char *path, FILINFO *info);
+void fileCacheComplete(FILE_CACHE_ENTRY *entry);
+void fileCacheRelease(FILE_CACHE_ENTRY *entry);
+void fileCacheInvalidate(const char *path);
+void fileCacheInitCursor(FILE_CACHE_CURSOR *cursor, FILE_CACHE_ENTRY *entry);
+char *fileCacheData(FILE_CACHE_CURSOR *cursor, FSIZE_t offset, u32 *len);
+
+#endif /* SRC_FILE_CACHE_H_ */
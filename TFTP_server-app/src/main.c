@@ -16,15 +16,18 @@
 #include "lwip/priv/tcp_priv.h"
 #include "lwip/init.h"
 #include "lwip/inet.h"
+#include "lwip/igmp.h"
 
 #include "tftp_server.h"
+#include "tftp_work.h"
+#include "tftp_event.h"
+#include "tftp_flash.h"
+#include "tftp_amp.h"
 #include "web_utils.h"
 
 void tcp_fasttmr(void);
 void tcp_slowtmr(void);
 
-extern volatile int TcpFastTmrFlag;
-extern volatile int TcpSlowTmrFlag;
 struct netif server_netif;
 TCHAR *Path = "0:";
 
@@ -32,6 +35,9 @@ int main()
 {
 	/* The MAC address of the board */
 	u8 ethernetMACAddress[] = { 0x00, 0x0a, 0x35, 0x00, 0x01, 0x02 };
+	u32 events;
+	int rxPending = 0;
+	int busy;
 
 	/* The '\033\143' sequence resets the terminal window */
 	xil_printf("\033\143---------- TFTP Server ----------\r\n\r\n");
@@ -57,9 +63,21 @@ int main()
 
 	netif_set_default(&server_netif);
 
+	/* the interrupts of the Ethernet controller wake the main loop up */
+	if (TFTP_eventAttachEmac(&server_netif))
+		xil_printf("Unable to attach the network events, packets are handled at every tick\r\n");
+
 	/* enabling interrupts */
 	platform_enable_interrupts();
 
+#if TFTP_AMP
+	/* core 1 decrypts and programs the boot images */
+	if (TFTP_ampStart())
+		xil_printf("Core 1 does not answer, the boot images are not flashed\r\n");
+	else
+		xil_printf("Core 1 started...\r\n");
+#endif
+
 	/* specifying the network if it is up */
 	netif_set_up(&server_netif);
 
@@ -78,17 +96,52 @@ int main()
 	/* creating the index.html file with file tree in it */
 	createIndexFileTree(Path);
 
-	/* receiving and process packages */
+	/*
+	 * Handling the events set by the interrupts in the order of their
+	 * priority, and sleeping until the next interrupt when idle.
+	 */
 	while (1) {
-		if (TcpFastTmrFlag) {
+		events = TFTP_eventTake();
+
+		/*
+		 * The received packets are handed to lwIP first, one per pass,
+		 * so that the answer to each of them is sent right away.
+		 */
+		if (events & (TFTP_EVENT_RX | TFTP_EVENT_TICK))
+			rxPending = 1;
+		if (rxPending)
+			rxPending = xemacif_input(&server_netif);
+
+		if (events & TFTP_EVENT_TCP_FAST) {
 			tcp_fasttmr();
-			TcpFastTmrFlag = 0;
+#if LWIP_IGMP
+			/* IGMP counts in 100 ms ticks, a slower tick only delays its reports */
+			igmp_tmr();
+#endif
 		}
-		if (TcpSlowTmrFlag) {
+		if (events & TFTP_EVENT_TCP_SLOW)
 			tcp_slowtmr();
-			TcpSlowTmrFlag = 0;
-		}
-		xemacif_input(&server_netif);
+
+		/* retransmitting lost TFTP packets and expiring dead sessions */
+		if (events & TFTP_EVENT_TICK)
+			TFTP_processTimers();
+
+		/* sending the windows and ACKs of the sessions in turn */
+		TFTP_processSchedule();
+
+		/* the packets are handled before the background work */
+		if (rxPending || TFTP_eventPending())
+			continue;
+
+		/*
+		 * reading downloads ahead, writing uploads behind and doing
+		 * the work of the received files, a slice each
+		 */
+		busy = TFTP_processStorage();
+		busy |= TFTP_processWork();
+
+		if (!busy && !TFTP_flashPolling())
+			TFTP_eventWait();
 	}
 
 	/* program never reaches here */
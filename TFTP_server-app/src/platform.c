@@ -56,6 +56,7 @@
 #include "xil_printf.h"
 #include "platform_config.h"
 #include "netif/xadapter.h"
+#include "tftp_event.h"
 #ifdef PLATFORM_ZYNQ
 #include "xscutimer.h"
 
@@ -77,9 +78,6 @@ static int ResetRxCntr = 0;
 extern struct netif server_netif;
 #endif
 
-volatile int TcpFastTmrFlag = 0;
-volatile int TcpSlowTmrFlag = 0;
-
 #if LWIP_DHCP==1
 volatile int dhcp_timoutcntr = 24;
 void dhcp_fine_tmr();
@@ -93,10 +91,22 @@ timer_callback(XScuTimer * TimerInstance)
 	 * by lwIP. It is not important that the timing is absoluetly accurate.
 	 */
 	static int odd = 1;
+	static int ticks = 0;
 #if LWIP_DHCP==1
     static int dhcp_timer = 0;
 #endif
-	 TcpFastTmrFlag = 1;
+	/*
+	 * The timer ticks every TFTP_EVENT_TICK_MS for the retransmission
+	 * timers of the TFTP sessions, the timers of lwIP run every 250 ms.
+	 */
+	TFTP_eventSet(TFTP_EVENT_TICK);
+	if (++ticks < TFTP_EVENT_TCP_TICKS) {
+		XScuTimer_ClearInterruptStatus(TimerInstance);
+		return;
+	}
+	ticks = 0;
+
+	TFTP_eventSet(TFTP_EVENT_TCP_FAST);
 
 	odd = !odd;
 #ifndef USE_SOFTETH_ON_ZYNQ
@@ -107,7 +117,7 @@ timer_callback(XScuTimer * TimerInstance)
 		dhcp_timer++;
 		dhcp_timoutcntr--;
 #endif
-		TcpSlowTmrFlag = 1;
+		TFTP_eventSet(TFTP_EVENT_TCP_SLOW);
 #if LWIP_DHCP==1
 		dhcp_fine_tmr();
 		if (dhcp_timer >= 120) {
@@ -160,9 +170,10 @@ void platform_setup_timer(void)
 
 	XScuTimer_EnableAutoReload(&TimerInstance);
 	/*
-	 * Set for 250 milli seconds timeout.
+	 * Set for a TFTP_EVENT_TICK_MS timeout, the timer runs at half
+	 * of the CPU clock.
 	 */
-	TimerLoadValue = XPAR_CPU_CORTEXA9_0_CPU_CLK_FREQ_HZ / 8;
+	TimerLoadValue = XPAR_CPU_CORTEXA9_0_CPU_CLK_FREQ_HZ / 2 / 1000 * TFTP_EVENT_TICK_MS;
 
 	XScuTimer_LoadTimer(&TimerInstance, TimerLoadValue);
 	return;
@@ -8,10 +8,6 @@
 #include "qspi.h"
 #include "aes.h"
 
-uint8_t key[] 	= { 0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
-					0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4 };
-uint8_t iv[]  	= { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
-
 static int FlashReadID(XQspiPs *QspiPtr);
 static int FlashWrite(XQspiPs *QspiPtr, u32 Address, u32 ByteCount, u8 Command);
 static int FlashRead(XQspiPs *QspiPtr, u32 Address, u32 ByteCount, u8 Command);
@@ -762,6 +758,144 @@ static int FlashErase(XQspiPs *QspiPtr, u32 Address, u32 ByteCount)
 	return XST_SUCCESS;
 }
 
+/*
+ * The functions below only start an erase or a program operation and
+ * return, so the TFTP server can go on while the flash is busy. The end
+ * of the operation is checked with qspiIsBusy.
+ */
+static XQspiPs StreamInstance;
+
+/*****************************************************************************/
+/**
+*
+* This function initializes the QSPI driver used by the functions
+* which do not wait for the flash.
+*
+* @param	None.
+*
+* @return	XST_SUCCESS if successful, else XST_FAILURE.
+*
+* @note		None.
+*
+******************************************************************************/
+int qspiOpen(void)
+{
+	return QspiFlashInit(&StreamInstance, QSPI_DEVICE_ID);
+}
+
+/*****************************************************************************/
+/**
+*
+* This function starts erasing the sector at the given address.
+*
+* @param	Address is the address of the sector.
+*
+* @return	XST_SUCCESS if the erase is started, else XST_FAILURE.
+*
+* @note		None.
+*
+******************************************************************************/
+int qspiStartErase(u32 Address)
+{
+	u8 WriteEnableCmd = { WRITE_ENABLE_CMD };
+	int status;
+
+	status = XQspiPs_PolledTransfer(&StreamInstance, &WriteEnableCmd, NULL, sizeof(WriteEnableCmd));
+	if (status != XST_SUCCESS)
+		return status;
+
+	WriteBuffer[COMMAND_OFFSET]		= SEC_ERASE_CMD;
+	WriteBuffer[ADDRESS_1_OFFSET]	= (u8)(Address >> 16);
+	WriteBuffer[ADDRESS_2_OFFSET]	= (u8)(Address >> 8);
+	WriteBuffer[ADDRESS_3_OFFSET]	= (u8)(Address & 0xFF);
+
+	return XQspiPs_PolledTransfer(&StreamInstance, WriteBuffer, NULL, SEC_ERASE_SIZE);
+}
+
+/*****************************************************************************/
+/**
+*
+* This function starts programming a page of the flash.
+*
+* @param	Address is the address of the page.
+* @param	Data is a pointer to the data which will be written.
+* @param	ByteCount is the number of bytes, at most PAGE_SIZE.
+*
+* @return	XST_SUCCESS if the program is started, else XST_FAILURE.
+*
+* @note		None.
+*
+******************************************************************************/
+int qspiStartWrite(u32 Address, const u8 *Data, u32 ByteCount)
+{
+	u8 WriteEnableCmd = { WRITE_ENABLE_CMD };
+	int status;
+
+	status = XQspiPs_PolledTransfer(&StreamInstance, &WriteEnableCmd, NULL, sizeof(WriteEnableCmd));
+	if (status != XST_SUCCESS)
+		return status;
+
+	WriteBuffer[COMMAND_OFFSET]		= WRITE_CMD;
+	WriteBuffer[ADDRESS_1_OFFSET]	= (u8)((Address & 0xFF0000) >> 16);
+	WriteBuffer[ADDRESS_2_OFFSET]	= (u8)((Address & 0xFF00) >> 8);
+	WriteBuffer[ADDRESS_3_OFFSET]	= (u8)(Address & 0xFF);
+	memcpy(&WriteBuffer[DATA_OFFSET], Data, ByteCount);
+
+	return XQspiPs_PolledTransfer(&StreamInstance, WriteBuffer, NULL, ByteCount + OVERHEAD_SIZE);
+}
+
+/*****************************************************************************/
+/**
+*
+* This function checks if the flash is still erasing or programming.
+*
+* @param	None.
+*
+* @return	1 if the flash is busy, 0 if it is ready, or -1 on error.
+*
+* @note		None.
+*
+******************************************************************************/
+int qspiIsBusy(void)
+{
+	u8 ReadStatusCmd[] = { READ_STATUS_CMD, 0 };
+	u8 FlashStatus[2];
+
+	if (XQspiPs_PolledTransfer(&StreamInstance, ReadStatusCmd, FlashStatus, sizeof(ReadStatusCmd)) != XST_SUCCESS)
+		return -1;
+
+	FlashStatus[1] |= FlashStatus[0];
+
+	return FlashStatus[1] & 0x01;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function reads from the flash.
+*
+* @param	Address is the address to read from.
+* @param	Data is a pointer to the buffer the data is copied to.
+* @param	ByteCount is the number of bytes to read.
+*
+* @return	XST_SUCCESS if successful, else XST_FAILURE.
+*
+* @note		None.
+*
+******************************************************************************/
+int qspiRead(u32 Address, u8 *Data, u32 ByteCount)
+{
+	int status;
+
+	status = FlashRead(&StreamInstance, Address, ByteCount, FAST_READ_CMD);
+	if (status != XST_SUCCESS)
+		return status;
+
+	memcpy(Data, &ReadBuffer[DATA_OFFSET + DUMMY_SIZE], ByteCount);
+
+	return XST_SUCCESS;
+}
+
 /*****************************************************************************/
 /**
 *
@@ -59,4 +59,10 @@ u8 WriteBuffer[6000000];
 
 int doQspiFlash(const char *fname);
 
+int qspiOpen(void);
+int qspiStartErase(u32 Address);
+int qspiStartWrite(u32 Address, const u8 *Data, u32 ByteCount);
+int qspiIsBusy(void);
+int qspiRead(u32 Address, u8 *Data, u32 ByteCount);
+
 #endif /* SRC_QSPI_H_ */
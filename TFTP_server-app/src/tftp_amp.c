@@ -0,0 +1,228 @@
+/*
+ * tftp_amp.c
+ */
+
+#include "tftp_amp.h"
+
+#if TFTP_AMP
+
+#include "tftp_hal.h"
+#include "tftp_event.h"
+
+#include <string.h>
+#include "xparameters.h"
+#include "xil_io.h"
+#include "xil_mmu.h"
+#include "xil_cache.h"
+#include "xscugic.h"
+
+/* the flash operation and the decryption waiting for their answers */
+static u8 flashPending = 0;
+static s32 flashStatus = 0;
+static u8 decryptPending = 0;
+static u8 *decryptData;
+static u32 decryptLen;
+static u8 ampReady = 0;
+
+/* This function handles the interrupt of core 1, the answers are taken by the main loop */
+static void TFTP_ampAnswerHandler(void *arg)
+{
+	TFTP_eventSet(TFTP_EVENT_AMP);
+}
+
+/* Takes the answers of core 1 */
+static void TFTP_ampPoll(void)
+{
+	tftp_amp_msg msg;
+
+	while (TFTP_ampPeek(&TFTP_ampShared->answers, &msg)) {
+		TFTP_ampDrop(&TFTP_ampShared->answers);
+
+		if (msg.op == TFTP_AMP_DECRYPT) {
+			/* the lines read while core 1 worked on the data are dropped */
+			Xil_DCacheInvalidateRange((INTPTR)decryptData, decryptLen);
+			decryptPending = 0;
+		} else {
+			flashPending = 0;
+			flashStatus = msg.status;
+		}
+	}
+}
+
+/* Posts a request to core 1 and interrupts it */
+static int TFTP_ampRequest(u32 op, u32 addr, u32 data, u32 len)
+{
+	tftp_amp_msg msg = { op, addr, data, len, 0 };
+
+	if (!ampReady || TFTP_ampPut(&TFTP_ampShared->requests, &msg))
+		return -1;
+
+	XScuGic_WriteReg(XPAR_SCUGIC_0_DIST_BASEADDR, XSCUGIC_SFI_TRIG_OFFSET,
+			(XSCUGIC_SPI_CPU1_MASK << 16) | TFTP_AMP_SGI_REQUEST);
+
+	return 0;
+}
+
+/* Posts a flash request and waits for its answer, returns 0 or -1 */
+static int TFTP_ampFlashWait(u32 op, u32 addr, u32 data, u32 len)
+{
+	int ret;
+
+	if (flashPending || TFTP_ampRequest(op, addr, data, len))
+		return -1;
+
+	flashPending = 1;
+	while (flashPending)
+		TFTP_ampPoll();
+
+	/* the status is returned here, TFTP_halFlashBusy does not report it again */
+	ret = (flashStatus < 0) ? -1 : 0;
+	flashStatus = 0;
+
+	return ret;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function maps the shared OCM as non-cacheable memory, sets up the
+* interrupt of core 1 and wakes core 1 up, which runs its service from
+* TFTP_AMP_CPU1_ENTRY.
+*
+* @param	None.
+*
+* @return	0 if the service of core 1 answers, else -1.
+*
+* @note		It must be called after the interrupts are set up, and
+* 			before the flash is accessed.
+*
+******************************************************************************/
+int TFTP_ampStart(void)
+{
+	u32 start;
+
+	Xil_SetTlbAttributes(TFTP_AMP_SHARED_ADDR, NORM_NONCACHE);
+	memset(TFTP_ampShared, 0, sizeof(tftp_amp_shared));
+
+	XScuGic_RegisterHandler(XPAR_SCUGIC_0_CPU_BASEADDR, TFTP_AMP_SGI_ANSWER,
+			(Xil_ExceptionHandler)TFTP_ampAnswerHandler, NULL);
+	XScuGic_EnableIntr(XPAR_SCUGIC_0_DIST_BASEADDR, TFTP_AMP_SGI_ANSWER);
+
+	/* core 1 waits in the boot ROM until its start address is written */
+	Xil_Out32(TFTP_AMP_CPU1_START, TFTP_AMP_CPU1_ENTRY);
+	__asm__ __volatile__ ("dsb\n\tsev" : : : "memory");
+
+	start = TFTP_getTimeUs();
+	while (TFTP_ampShared->ready != TFTP_AMP_READY) {
+		if ((TFTP_getTimeUs() - start) > (TFTP_AMP_START_MS * 1000))
+			return -1;
+	}
+
+	ampReady = 1;
+
+	return 0;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function asks core 1 to decrypt a part of a boot image in place.
+*
+* @param	data is a pointer to the encrypted data, aligned to a cache line.
+* @param	len is the number of bytes, a multiple of the AES block size.
+* @param	restart is 1 if the data is the start of an image, which is
+*			decrypted from the IV.
+*
+* @return	0 if the request is posted, else -1.
+*
+* @note		The data must not be touched until TFTP_ampDecryptDone
+* 			returns 1.
+*
+******************************************************************************/
+int TFTP_ampDecrypt(u8 *data, u32 len, u8 restart)
+{
+	if (decryptPending)
+		return -1;
+
+	Xil_DCacheFlushRange((INTPTR)data, len);
+	decryptData = data;
+	decryptLen = len;
+
+	if (TFTP_ampRequest(TFTP_AMP_DECRYPT, restart, (u32)data, len))
+		return -1;
+
+	decryptPending = 1;
+
+	return 0;
+}
+
+/* Returns 1 when the last decryption is done */
+int TFTP_ampDecryptDone(void)
+{
+	TFTP_ampPoll();
+
+	return !decryptPending;
+}
+
+/*
+ * The flash functions of the HAL, which pass the operations to core 1.
+ * Core 1 answers an erase or a program when the flash is ready again.
+ */
+int TFTP_halFlashOpen(void)
+{
+	return TFTP_ampFlashWait(TFTP_AMP_OPEN, 0, 0, 0);
+}
+
+int TFTP_halFlashErase(u32 addr)
+{
+	if (flashPending || TFTP_ampRequest(TFTP_AMP_ERASE, addr, 0, 0))
+		return -1;
+
+	flashPending = 1;
+
+	return 0;
+}
+
+int TFTP_halFlashProgram(u32 addr, const u8 *data, u32 len)
+{
+	if (flashPending || (len > TFTP_AMP_PAGE_SIZE))
+		return -1;
+
+	memcpy(TFTP_ampShared->page, data, len);
+	if (TFTP_ampRequest(TFTP_AMP_PROGRAM, addr, 0, len))
+		return -1;
+
+	flashPending = 1;
+
+	return 0;
+}
+
+int TFTP_halFlashRead(u32 addr, u8 *data, u32 len)
+{
+	int ret;
+
+	/* the lines of the buffer are clean, so none of them is written over the data of core 1 */
+	Xil_DCacheFlushRange((INTPTR)data, len);
+	ret = TFTP_ampFlashWait(TFTP_AMP_READ, addr, (u32)data, len);
+	Xil_DCacheInvalidateRange((INTPTR)data, len);
+
+	return ret;
+}
+
+int TFTP_halFlashBusy(void)
+{
+	int ret;
+
+	TFTP_ampPoll();
+
+	if (flashPending)
+		return 1;
+
+	/* a failed operation is reported once, so the image can be written back */
+	ret = (flashStatus < 0) ? -1 : 0;
+	flashStatus = 0;
+
+	return ret;
+}
+
+#endif /* TFTP_AMP */
@@ -0,0 +1,142 @@
+/*
+ * tftp_amp.h
+ */
+
+#ifndef SRC_TFTP_AMP_H_
+#define SRC_TFTP_AMP_H_
+
+#include "xil_types.h"
+
+/*
+ * In the AMP configuration, the second core of the Zynq runs a service
+ * (TFTP_server-core1) which does the heavy work of programming a boot
+ * image: the AES decryption and all of the QSPI accesses. The first
+ * core keeps lwIP, the TFTP sessions and the SD card, and only posts
+ * requests, so it keeps answering the network while the image is
+ * decrypted and the flash is erased and programmed.
+ *
+ * The cores talk through two rings in the OCM, one for the requests of
+ * core 0 and one for the answers of core 1. Each ring has a single
+ * producer and a single consumer, so it needs no lock: the producer
+ * only writes the head and the consumer only writes the tail. A
+ * software generated interrupt tells the other core that something
+ * is put into a ring.
+ *
+ * The OCM holding the rings is mapped as non-cacheable memory on both
+ * cores. The buffers in the DDR are cacheable, so they are flushed by
+ * the core which wrote them and invalidated by the core which reads
+ * them next.
+ */
+#ifndef TFTP_AMP
+#define TFTP_AMP				0
+#endif
+
+/* the rings, in the high OCM (ps7_ram_1 of the linker scripts) */
+#define TFTP_AMP_SHARED_ADDR	0xFFFF0000
+
+/* address core 1 jumps to when it is woken up, and its entry point */
+#define TFTP_AMP_CPU1_START		0xFFFFFFF0
+#ifndef TFTP_AMP_CPU1_ENTRY
+#define TFTP_AMP_CPU1_ENTRY		0x38000000
+#endif
+
+/* software generated interrupts to core 1 (requests) and to core 0 (answers) */
+#define TFTP_AMP_SGI_REQUEST	14
+#define TFTP_AMP_SGI_ANSWER		15
+
+/* written into the shared area by core 1 when its service runs */
+#define TFTP_AMP_READY			0x54465450
+
+/* time core 0 waits for core 1 to start, in milliseconds */
+#define TFTP_AMP_START_MS		1000
+
+#define TFTP_AMP_RING_LEN		16
+#define TFTP_AMP_PAGE_SIZE		256
+
+/* the DDR buffers passed between the cores are split at cache lines */
+#define TFTP_AMP_CACHE_LINE		32
+
+typedef enum {
+	TFTP_AMP_OPEN,		/* initializing the QSPI */
+	TFTP_AMP_ERASE,		/* erasing the sector at addr */
+	TFTP_AMP_PROGRAM,	/* programming len bytes of the shared page at addr */
+	TFTP_AMP_READ,		/* reading len bytes of the flash at addr into data */
+	TFTP_AMP_DECRYPT	/* decrypting len bytes at data, from the IV if addr is 1 */
+} tftp_amp_op;
+
+typedef struct {
+	u32 op;
+	u32 addr;
+	u32 data;
+	u32 len;
+
+	/* the answer: 0, or -1 on error */
+	s32 status;
+} tftp_amp_msg;
+
+typedef struct {
+	/* written by the producer */
+	volatile u32 head;
+
+	/* written by the consumer */
+	volatile u32 tail;
+
+	tftp_amp_msg slots[TFTP_AMP_RING_LEN];
+} tftp_amp_ring;
+
+typedef struct {
+	volatile u32 ready;
+	tftp_amp_ring requests;
+	tftp_amp_ring answers;
+
+	/* the page being programmed, only one is programmed at a time */
+	u8 page[TFTP_AMP_PAGE_SIZE];
+} tftp_amp_shared;
+
+#define TFTP_ampShared			((tftp_amp_shared *)TFTP_AMP_SHARED_ADDR)
+
+/* Puts a message into a ring, returns 0 or -1 if the ring is full */
+static inline int TFTP_ampPut(tftp_amp_ring *ring, const tftp_amp_msg *msg)
+{
+	u32 head = ring->head;
+
+	if ((head - ring->tail) == TFTP_AMP_RING_LEN)
+		return -1;
+
+	ring->slots[head % TFTP_AMP_RING_LEN] = *msg;
+
+	/* the message is complete before the other core sees the new head */
+	__asm__ __volatile__ ("dmb" : : : "memory");
+	ring->head = head + 1;
+
+	return 0;
+}
+
+/* Copies the oldest message of a ring, returns 1, or 0 if the ring is empty */
+static inline int TFTP_ampPeek(tftp_amp_ring *ring, tftp_amp_msg *msg)
+{
+	u32 tail = ring->tail;
+
+	if (tail == ring->head)
+		return 0;
+
+	__asm__ __volatile__ ("dmb" : : : "memory");
+	*msg = ring->slots[tail % TFTP_AMP_RING_LEN];
+
+	return 1;
+}
+
+/* Removes the oldest message of a ring, after it is peeked */
+static inline void TFTP_ampDrop(tftp_amp_ring *ring)
+{
+	__asm__ __volatile__ ("dmb" : : : "memory");
+	ring->tail = ring->tail + 1;
+}
+
+#if TFTP_AMP
+int TFTP_ampStart(void);
+int TFTP_ampDecrypt(u8 *data, u32 len, u8 restart);
+int TFTP_ampDecryptDone(void);
+#endif
+
+#endif /* SRC_TFTP_AMP_H_ */
@@ -0,0 +1,283 @@
+/*
+ * tftp_delta.c
+ */
+
+#include "tftp_delta.h"
+
+#include <string.h>
+#include "xil_printf.h"
+
+typedef enum {
+	DELTA_HEADER,
+	DELTA_OPCODE,
+	DELTA_ARGS,
+	DELTA_COPY,
+	DELTA_ADD,
+	DELTA_DATA,
+	DELTA_DONE
+} tftp_delta_state;
+
+typedef struct {
+	tftp_filter filter;
+
+	/* the current boot image */
+	FIL base;
+
+	tftp_delta_state state;
+	u8 op;
+
+	/* header or arguments of a command being received */
+	u8 args[TFTP_DELTA_HDR_LEN];
+	u8 argsLen;
+	u8 argsNeed;
+
+	/* part of the old image (COPY, ADD) or of the input (DATA) left */
+	u32 offset;
+	u32 remaining;
+
+	u32 newSize;
+	u32 newCrc;
+	u32 written;
+	u32 crc;
+
+	u8 buf[TFTP_DELTA_BUF_SIZE];
+} tftp_delta;
+
+/* only one boot image is built at a time */
+static tftp_delta delta;
+static u8 deltaBusy = 0;
+
+static u32 TFTP_deltaGet32(const u8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+/* Passes bytes of the new image on, returns 0 or -1 */
+static int TFTP_deltaEmit(tftp_delta *d, const u8 *data, u32 len)
+{
+	if (len > (d->newSize - d->written)) {
+		xil_printf("Delta: image larger than announced\r\n");
+		return -1;
+	}
+
+	d->crc = TFTP_crc32(d->crc, data, len);
+	d->written += len;
+
+	return TFTP_filterOutput(d->filter.next, data, len);
+}
+
+/* Reads len bytes of the old image at the current offset into the buffer */
+static int TFTP_deltaReadBase(tftp_delta *d, u32 len)
+{
+	UINT read;
+
+	if ((f_tell(&d->base) != d->offset) && f_lseek(&d->base, d->offset))
+		return -1;
+
+	if (f_read(&d->base, d->buf, len, &read) || (read != len))
+		return -1;
+
+	d->offset += len;
+
+	return 0;
+}
+
+/* This function handles the arguments of a command when all of them are received */
+static int TFTP_deltaCommand(tftp_delta *d)
+{
+	u32 size = f_size(&d->base);
+
+	if (d->state == DELTA_HEADER) {
+		if (memcmp(d->args, TFTP_DELTA_MAGIC, 4)) {
+			xil_printf("Delta: not a delta file\r\n");
+			return -1;
+		}
+		if (TFTP_deltaGet32(d->args + 4) != size) {
+			xil_printf("Delta: made for another boot image (%lu bytes instead of %lu)\r\n",
+					TFTP_deltaGet32(d->args + 4), size);
+			return -1;
+		}
+		d->newSize = TFTP_deltaGet32(d->args + 8);
+		d->newCrc = TFTP_deltaGet32(d->args + 12);
+		d->state = DELTA_OPCODE;
+		return 0;
+	}
+
+	if (d->op == TFTP_DELTA_DATA) {
+		d->remaining = TFTP_deltaGet32(d->args);
+		d->state = DELTA_DATA;
+	}
+	else {
+		d->offset = TFTP_deltaGet32(d->args);
+		d->remaining = TFTP_deltaGet32(d->args + 4);
+		if ((d->offset > size) || (d->remaining > (size - d->offset))) {
+			xil_printf("Delta: command beyond the end of the boot image\r\n");
+			return -1;
+		}
+		d->state = (d->op == TFTP_DELTA_COPY) ? DELTA_COPY : DELTA_ADD;
+	}
+
+	if (!d->remaining)
+		d->state = DELTA_OPCODE;
+
+	return 0;
+}
+
+/*
+ * This function applies a part of a delta. A COPY command takes no
+ * input, so at most TFTP_DELTA_BUF_SIZE bytes of it are copied per
+ * call, and the input after it is left for the next calls.
+ */
+static int TFTP_deltaWrite(tftp_filter *filter, const u8 *data, u32 len)
+{
+	tftp_delta *d = (tftp_delta *)filter;
+	u32 taken = 0, n, i;
+
+	while (taken < len) {
+		switch (d->state) {
+		case DELTA_HEADER:
+		case DELTA_ARGS:
+			n = d->argsNeed - d->argsLen;
+			if (n > (len - taken))
+				n = len - taken;
+			memcpy(d->args + d->argsLen, data + taken, n);
+			d->argsLen += n;
+			taken += n;
+
+			if ((d->argsLen == d->argsNeed) && TFTP_deltaCommand(d))
+				return -1;
+			break;
+
+		case DELTA_OPCODE:
+			d->op = data[taken++];
+			d->argsLen = 0;
+			d->state = DELTA_ARGS;
+
+			if (d->op == TFTP_DELTA_END)
+				d->state = DELTA_DONE;
+			else if (d->op == TFTP_DELTA_DATA)
+				d->argsNeed = 4;
+			else if ((d->op == TFTP_DELTA_COPY) || (d->op == TFTP_DELTA_ADD))
+				d->argsNeed = 8;
+			else {
+				xil_printf("Delta: unknown command %d\r\n", d->op);
+				return -1;
+			}
+			break;
+
+		case DELTA_COPY:
+			n = (d->remaining < TFTP_DELTA_BUF_SIZE) ? d->remaining : TFTP_DELTA_BUF_SIZE;
+			if (TFTP_deltaReadBase(d, n) || TFTP_deltaEmit(d, d->buf, n))
+				return -1;
+
+			d->remaining -= n;
+			if (!d->remaining)
+				d->state = DELTA_OPCODE;
+			return taken;
+
+		case DELTA_ADD:
+			n = len - taken;
+			if (n > d->remaining)
+				n = d->remaining;
+			if (n > TFTP_DELTA_BUF_SIZE)
+				n = TFTP_DELTA_BUF_SIZE;
+			if (TFTP_deltaReadBase(d, n))
+				return -1;
+
+			for (i = 0; i < n; i++)
+				d->buf[i] += data[taken + i];
+			if (TFTP_deltaEmit(d, d->buf, n))
+				return -1;
+
+			taken += n;
+			d->remaining -= n;
+			if (!d->remaining)
+				d->state = DELTA_OPCODE;
+			break;
+
+		case DELTA_DATA:
+			n = len - taken;
+			if (n > d->remaining)
+				n = d->remaining;
+			if (TFTP_deltaEmit(d, data + taken, n))
+				return -1;
+
+			taken += n;
+			d->remaining -= n;
+			if (!d->remaining)
+				d->state = DELTA_OPCODE;
+			break;
+
+		case DELTA_DONE:
+			xil_printf("Delta: data after the end\r\n");
+			return -1;
+		}
+	}
+
+	return taken;
+}
+
+/* The new image must be complete and have the CRC-32 given in the header */
+static int TFTP_deltaFinish(tftp_filter *filter)
+{
+	tftp_delta *d = (tftp_delta *)filter;
+
+	if (d->state != DELTA_DONE) {
+		xil_printf("Delta: incomplete\r\n");
+		return -1;
+	}
+
+	if ((d->written != d->newSize) || (d->crc != d->newCrc)) {
+		xil_printf("Delta: the built image does not match (CRC %08lx instead of %08lx)\r\n",
+				d->crc, d->newCrc);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void TFTP_deltaClose(tftp_filter *filter)
+{
+	tftp_delta *d = (tftp_delta *)filter;
+
+	f_close(&d->base);
+	deltaBusy = 0;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function starts applying a delta against a boot image.
+*
+* @param	base is a pointer to the path of the current boot image.
+* @param	next is a pointer to the filter the new image is passed to.
+*
+* @return	A pointer to the filter of the delta, or NULL if the boot
+*			image cannot be opened or another delta is being applied.
+*
+******************************************************************************/
+tftp_filter *TFTP_deltaOpen(const char *base, tftp_filter *next)
+{
+	tftp_delta *d = &delta;
+
+	if (deltaBusy)
+		return NULL;
+
+	if (f_open(&d->base, base, FA_READ))
+		return NULL;
+
+	d->filter.write = TFTP_deltaWrite;
+	d->filter.finish = TFTP_deltaFinish;
+	d->filter.close = TFTP_deltaClose;
+	d->filter.next = next;
+
+	d->state = DELTA_HEADER;
+	d->argsLen = 0;
+	d->argsNeed = TFTP_DELTA_HDR_LEN;
+	d->newSize = 0;
+	d->written = 0;
+	d->crc = 0;
+	deltaBusy = 1;
+
+	return &d->filter;
+}
@@ -0,0 +1,42 @@
+/*
+ * tftp_delta.h
+ */
+
+#ifndef SRC_TFTP_DELTA_H_
+#define SRC_TFTP_DELTA_H_
+
+#include "tftp_filter.h"
+
+/*
+ * A new boot image can be uploaded as a delta against the current one,
+ * made by the Delta_Patch tool. The delta is applied while it is being
+ * received, so the new image is written into the temporary boot file
+ * and flashed just like an uploaded image.
+ *
+ * A delta is a header followed by commands. Numbers are 32 bits long
+ * and little endian:
+ *
+ *   header  "TDL1", size of the old image, size and CRC-32 of the new image
+ *   COPY    offset, length          the bytes of the old image at offset
+ *   ADD     offset, length, bytes   the bytes added to the ones of the old
+ *                                   image at offset (as in bsdiff)
+ *   DATA    length, bytes           new bytes
+ *   END
+ */
+#define TFTP_DELTA_MAGIC		"TDL1"
+#define TFTP_DELTA_HDR_LEN		16
+
+#define TFTP_DELTA_END			0
+#define TFTP_DELTA_COPY			1
+#define TFTP_DELTA_ADD			2
+#define TFTP_DELTA_DATA			3
+
+/* name of an uploaded delta of the boot image */
+#define TFTP_DELTA_FILE_NAME	"BOOT.BIN.patch"
+
+/* most bytes of the old image copied in one step */
+#define TFTP_DELTA_BUF_SIZE		(32 * 1024)
+
+tftp_filter *TFTP_deltaOpen(const char *base, tftp_filter *next);
+
+#endif /* SRC_TFTP_DELTA_H_ */
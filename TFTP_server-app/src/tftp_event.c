@@ -0,0 +1,121 @@
+/*
+ * tftp_event.c
+ */
+
+#include "tftp_event.h"
+#include "tftp_hal.h"
+#include "tftp_stats.h"
+
+#include "xparameters.h"
+#include "xil_exception.h"
+#include "xscugic.h"
+#include "xemacps.h"
+#include "netif/xadapter.h"
+#include "netif/xemacpsif.h"
+#include "netif/xtopology.h"
+
+/* set by the interrupt handlers, taken by the main loop */
+static volatile u32 events = 0;
+
+/* time of the first packet received since the events were taken */
+static volatile u32 rxStampUs;
+
+/* This function sets event bits, it can be called from an interrupt handler */
+void TFTP_eventSet(u32 bits)
+{
+	if ((bits & TFTP_EVENT_RX) && !(events & TFTP_EVENT_RX))
+		rxStampUs = TFTP_getTimeUs();
+
+	events |= bits;
+}
+
+/*
+ * This function returns the events set since the last call and clears
+ * them. The time a received packet waited for the main loop is counted.
+ */
+u32 TFTP_eventTake(void)
+{
+	u32 bits;
+
+	Xil_ExceptionDisableMask(XIL_EXCEPTION_IRQ);
+	bits = events;
+	events = 0;
+	Xil_ExceptionEnableMask(XIL_EXCEPTION_IRQ);
+
+	if (bits & TFTP_EVENT_RX)
+		TFTP_statsWake(TFTP_getTimeUs() - rxStampUs);
+
+	return bits;
+}
+
+/* Returns 1 if an event is waiting to be taken */
+int TFTP_eventPending(void)
+{
+	return events != 0;
+}
+
+/*
+ * This function sleeps until the next interrupt, unless an event is
+ * already set. The interrupts are masked while the events are checked,
+ * so one which comes just before WFI still wakes the core up, and it is
+ * handled after they are unmasked again.
+ */
+void TFTP_eventWait(void)
+{
+	u32 start;
+
+	Xil_ExceptionDisableMask(XIL_EXCEPTION_IRQ);
+	if (!events) {
+		start = TFTP_getTimeUs();
+		__asm__ __volatile__ ("dsb\n\twfi" : : : "memory");
+		TFTP_statsIdle(TFTP_getTimeUs() - start);
+	}
+	Xil_ExceptionEnableMask(XIL_EXCEPTION_IRQ);
+}
+
+/* The handler of the Ethernet controller, followed by the events it causes */
+static void TFTP_eventEmacHandler(void *arg)
+{
+	XEmacPs *emacps = (XEmacPs *)arg;
+	u32 status = XEmacPs_ReadReg(emacps->Config.BaseAddress, XEMACPS_ISR_OFFSET);
+
+	XEmacPs_IntrHandler(arg);
+
+	/* errors are handled like received packets, the loop checks the queue */
+	if (status & ~XEMACPS_IXR_TXCOMPL_MASK)
+		TFTP_eventSet(TFTP_EVENT_RX);
+	if (status & XEMACPS_IXR_TXCOMPL_MASK)
+		TFTP_eventSet(TFTP_EVENT_TX);
+}
+
+/*****************************************************************************/
+/**
+*
+* This function puts a handler in front of the interrupt handler of the
+* Ethernet controller, which sets the network events.
+*
+* @param	netif is a pointer to the network interface of the controller.
+*
+* @return	0 if successful, else -1.
+*
+* @note		It must be called after xemac_add, which connects the
+* 			handler of the driver.
+*
+******************************************************************************/
+int TFTP_eventAttachEmac(struct netif *netif)
+{
+	struct xemac_s *xemac = (struct xemac_s *)netif->state;
+	xemacpsif_s *xemacpsif;
+
+	if (!xemac || (xemac->type != xemac_type_emacps))
+		return -1;
+
+	xemacpsif = (xemacpsif_s *)xemac->state;
+
+	XScuGic_RegisterHandler(XPAR_SCUGIC_0_CPU_BASEADDR,
+			xtopology[xemac->topology_index].scugic_emac_intr,
+			(Xil_ExceptionHandler)TFTP_eventEmacHandler,
+			(void *)&xemacpsif->emacps);
+
+	return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * tftp_event.h
+ */
+
+#ifndef SRC_TFTP_EVENT_H_
+#define SRC_TFTP_EVENT_H_
+
+#include "xil_types.h"
+#include "lwip/netif.h"
+
+/*
+ * The interrupts of the Ethernet controller and of the timer set event
+ * bits, and the main loop handles the events in the order of their
+ * priority: the received packets, the timers, the packets to send and
+ * then a slice of the background work (the storage, the flash and the
+ * queued work). When there is nothing to do, the core sleeps with WFI
+ * until the next interrupt. The time spent sleeping is counted, so the
+ * totals of the server show the load of the core.
+ */
+#define TFTP_EVENT_RX			0x01	/* a packet is received */
+#define TFTP_EVENT_TX			0x02	/* a packet is sent, its buffer is free */
+#define TFTP_EVENT_TICK			0x04	/* the retransmission timers are due a check */
+#define TFTP_EVENT_TCP_FAST		0x08	/* the 250 ms timers of lwIP */
+#define TFTP_EVENT_TCP_SLOW		0x10	/* the 500 ms timers of lwIP */
+#define TFTP_EVENT_AMP			0x20	/* core 1 answered a request (see tftp_amp.h) */
+
+/*
+ * Period of the tick. The retransmission deadlines and the rate caps
+ * are checked at every tick, so it bounds their accuracy while the core
+ * is sleeping.
+ */
+#define TFTP_EVENT_TICK_MS		1
+
+/* ticks per period of the fast timers of lwIP */
+#define TFTP_EVENT_TCP_TICKS	(250 / TFTP_EVENT_TICK_MS)
+
+void TFTP_eventSet(u32 events);
+u32 TFTP_eventTake(void);
+int TFTP_eventPending(void);
+void TFTP_eventWait(void);
+int TFTP_eventAttachEmac(struct netif *netif);
+
+#endif /* SRC_TFTP_EVENT_H_ */
@@ -0,0 +1,97 @@
+/*
+ * tftp_filter.c
+ */
+
+#include "tftp_filter.h"
+
+/* CRC-32 (IEEE 802.3) of a buffer, continuing from crc */
+u32 TFTP_crc32(u32 crc, const void *data, u32 len)
+{
+	static u32 table[256];
+	const u8 *buf = data;
+	u32 c;
+	int i, j;
+
+	if (!table[1]) {
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len--)
+		crc = table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static int TFTP_fileSinkWrite(tftp_filter *filter, const u8 *data, u32 len)
+{
+	tftp_file_sink *sink = (tftp_file_sink *)filter;
+	UINT written;
+
+	if (f_write(sink->file, data, len, &written) || (written != len))
+		return -1;
+
+	return len;
+}
+
+void TFTP_fileSinkInit(tftp_file_sink *sink, FIL *file)
+{
+	sink->filter.write = TFTP_fileSinkWrite;
+	sink->filter.finish = NULL;
+	sink->filter.close = NULL;
+	sink->filter.next = NULL;
+	sink->file = file;
+}
+
+/* Passes data to a filter, returns the number of bytes taken or -1 */
+int TFTP_filterWrite(tftp_filter *filter, const void *data, u32 len)
+{
+	return filter->write(filter, data, len);
+}
+
+/*
+ * This function passes the output of a filter to the next one in the
+ * chain, until all of it is taken. Returns 0, or -1 on error.
+ */
+int TFTP_filterOutput(tftp_filter *filter, const void *data, u32 len)
+{
+	const u8 *p = data;
+	int ret;
+
+	while (len) {
+		ret = filter->write(filter, p, len);
+		if (ret < 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Finishes the filters of a chain in order, returns -1 if any of them fails */
+int TFTP_filterFinish(tftp_filter *filter)
+{
+	for (; filter; filter = filter->next) {
+		if (filter->finish && filter->finish(filter))
+			return -1;
+	}
+
+	return 0;
+}
+
+void TFTP_filterClose(tftp_filter *filter)
+{
+	tftp_filter *next;
+
+	for (; filter; filter = next) {
+		next = filter->next;
+		if (filter->close)
+			filter->close(filter);
+	}
+}
@@ -0,0 +1,54 @@
+/*
+ * tftp_filter.h
+ */
+
+#ifndef SRC_TFTP_FILTER_H_
+#define SRC_TFTP_FILTER_H_
+
+#include "xil_types.h"
+#include "ff.h"
+
+/*
+ * The data of an upload can be passed through a chain of filters on
+ * its way from the write-behind ring to the SD card, for example to
+ * build a boot image from a delta against the current one. Each filter
+ * passes its output to the next one, and the chain ends with a sink,
+ * which writes the data into the file of the session.
+ *
+ * A filter may take only a part of its input when it has work of its
+ * own to do, like copying a large part of another file. It is called
+ * again with the rest, so the work is spread over the idle time of
+ * the main loop.
+ */
+typedef struct tftp_filter {
+	/*
+	 * Passes data through the filter. Returns the number of bytes
+	 * taken (possibly 0 if the filter made progress on pending work)
+	 * or -1 on error.
+	 */
+	int (*write)(struct tftp_filter *filter, const u8 *data, u32 len);
+
+	/* Called at the end of the input, returns 0 if the output is complete */
+	int (*finish)(struct tftp_filter *filter);
+
+	/* Releases the resources of the filter, called once for every chain */
+	void (*close)(struct tftp_filter *filter);
+
+	/* the filter the output is passed to, NULL for a sink */
+	struct tftp_filter *next;
+} tftp_filter;
+
+/* a sink writing its input into an open file */
+typedef struct {
+	tftp_filter filter;
+	FIL *file;
+} tftp_file_sink;
+
+u32 TFTP_crc32(u32 crc, const void *data, u32 len);
+void TFTP_fileSinkInit(tftp_file_sink *sink, FIL *file);
+int TFTP_filterWrite(tftp_filter *filter, const void *data, u32 len);
+int TFTP_filterOutput(tftp_filter *filter, const void *data, u32 len);
+int TFTP_filterFinish(tftp_filter *filter);
+void TFTP_filterClose(tftp_filter *filter);
+
+#endif /* SRC_TFTP_FILTER_H_ */
@@ -0,0 +1,756 @@
+/*
+ * tftp_flash.c
+ */
+
+#include "tftp_flash.h"
+#include "tftp_hal.h"
+#include "tftp_amp.h"
+#include "web_utils.h"
+#include "aes.h"
+
+#include <string.h>
+#include "xil_printf.h"
+
+typedef enum {
+	FLASH_IDLE,
+	FLASH_WAIT,			/* waiting for the first bytes of the image */
+	FLASH_MARK,			/* marking the flash as being written */
+	FLASH_WRITE,		/* erasing the sectors and programming the pages */
+	FLASH_VERIFY,		/* comparing the flash with the image */
+	FLASH_UNMARK		/* marking the flash as complete */
+} tftp_flash_state;
+
+typedef struct {
+	tftp_filter filter;
+	tftp_flash_state state;
+
+	/* sub-step of writing the mark: erasing, programming, done */
+	u8 markStep;
+
+	/* an upload passes the image through the filter */
+	u8 open;
+
+	/*
+	 * The flash is erased while the image arrives, which is only done
+	 * when a boot image on the SD card can be written back.
+	 */
+	u8 streaming;
+
+	/* all of the image is in the buffer and its size is known */
+	u8 inputDone;
+
+	/* the upload failed, or the image is being written back after that */
+	u8 aborted;
+	u8 restoring;
+
+	/* the image failed while it was uploaded, so the upload fails too */
+	u8 failed;
+
+	/*
+	 * The control sector is marked as being written, and the image in
+	 * the flash is partly erased. They stay set until an image is
+	 * complete, even if the image which changed the flash is replaced.
+	 */
+	u8 marked;
+	u8 dirty;
+
+	/*
+	 * The first part of the image is read from a file: the received
+	 * part of a resumed upload, or the whole current image when it is
+	 * written back.
+	 */
+	FIL source;
+	u8 sourceOpen;
+	u32 prefix;
+	u32 loaded;
+
+	/* size announced by the client, 0 if unknown */
+	u32 sizeHint;
+
+	/* encrypted bytes in the buffer, decrypted ones and the size of the image */
+	u32 received;
+	u32 decrypted;
+	u32 size;
+
+	/* in the AMP configuration, end of the part core 1 is decrypting */
+	u32 decrypting;
+
+	/* progress on the flash */
+	u32 erased;
+	u32 programmed;
+	u32 verified;
+
+	struct AES_ctx ctx;
+	u32 startUs;
+} tftp_flash;
+
+/* only one image is programmed at a time */
+static tftp_flash job;
+static u8 *const flashBuffer = (u8 *)TFTP_FLASH_BUFFER_ADDR;
+static u8 flashPage[TFTP_FLASH_PAGE_SIZE];
+static u8 flashVerify[TFTP_FLASH_STEP_SIZE] __attribute__ ((aligned(TFTP_AMP_CACHE_LINE)));
+static u8 flashReady = 0;
+
+/* a page is being programmed, which takes less than a tick of the main loop */
+static u8 flashProgramming = 0;
+
+static int TFTP_flashProgram(u32 addr)
+{
+	flashProgramming = 1;
+
+	return TFTP_halFlashProgram(addr, flashPage, TFTP_FLASH_PAGE_SIZE);
+}
+
+/* Encrypted bytes in the buffer from the start of the image */
+static u32 TFTP_flashAvailable(void)
+{
+	return (job.loaded < job.prefix) ? job.loaded : job.received;
+}
+
+/*
+ * This function decrypts the next part of the image in the buffer.
+ * If last is 1, no more bytes are written into the buffer. Returns 1 if
+ * some work is done, 0 if there is nothing to do and -1 on error.
+ */
+#if TFTP_AMP
+/*
+ * Core 1 decrypts the image while the next part arrives. A part ends at
+ * a cache line, unless it is the last one, so the bytes copied into the
+ * buffer meanwhile do not share a line with the bytes of core 1.
+ */
+static int TFTP_flashDecrypt(u32 limit, u8 last)
+{
+	u32 end;
+
+	if (job.decrypting != job.decrypted) {
+		if (!TFTP_ampDecryptDone())
+			return 0;
+		job.decrypted = job.decrypting;
+	}
+
+	end = TFTP_flashAvailable() & ~(AES_BLOCKLEN - 1);
+	if ((end - job.decrypted) > limit)
+		end = job.decrypted + limit;
+	if (!last || (end != (job.received & ~(AES_BLOCKLEN - 1))))
+		end &= ~(TFTP_AMP_CACHE_LINE - 1);
+
+	if (end <= job.decrypted)
+		return 0;
+
+	if (TFTP_ampDecrypt(flashBuffer + job.decrypted, end - job.decrypted, !job.decrypted))
+		return -1;
+	job.decrypting = end;
+
+	return 1;
+}
+#else
+static int TFTP_flashDecrypt(u32 limit, u8 last)
+{
+	u32 end = TFTP_flashAvailable() & ~(AES_BLOCKLEN - 1);
+
+	if (end <= job.decrypted)
+		return 0;
+
+	if ((end - job.decrypted) > limit)
+		end = job.decrypted + limit;
+
+	decrypt_aes(&job.ctx, flashBuffer + job.decrypted, end - job.decrypted);
+	job.decrypted = end;
+
+	return 1;
+}
+#endif
+
+/*
+ * This function checks the padding of the decrypted image, as
+ * decryptFile does, and sets the size of the image without it.
+ * Returns 0, or -1 if the image cannot be decrypted with the key.
+ */
+static int TFTP_flashImageSize(void)
+{
+	u32 i, pad;
+
+	if (!job.received || (job.received % AES_BLOCKLEN) || (job.decrypted != job.received))
+		return -1;
+
+	pad = flashBuffer[job.received - 1];
+	if (!pad || (pad > AES_BLOCKLEN))
+		return -1;
+
+	for (i = 1; i <= pad; i++) {
+		if (flashBuffer[job.received - i] != pad)
+			return -1;
+	}
+
+	job.size = job.received - pad;
+	job.inputDone = 1;
+
+	return 0;
+}
+
+/* Returns 0 if the decrypted image starts with the boot header, else -1 */
+static int TFTP_flashBootHeader(void)
+{
+	u32 width, ident;
+
+	memcpy(&width, flashBuffer + TFTP_FLASH_WIDTH_OFFSET, sizeof(width));
+	memcpy(&ident, flashBuffer + TFTP_FLASH_IDENT_OFFSET, sizeof(ident));
+
+	return ((width == TFTP_FLASH_WIDTH_WORD) && (ident == TFTP_FLASH_IDENT_WORD)) ? 0 : -1;
+}
+
+/* Reads the next part of the file the image starts with */
+static int TFTP_flashLoad(void)
+{
+	u32 len = job.prefix - job.loaded;
+	UINT read;
+
+	if (len > TFTP_FLASH_STEP_SIZE)
+		len = TFTP_FLASH_STEP_SIZE;
+
+	if (f_read(&job.source, flashBuffer + job.loaded, len, &read) || (read != len))
+		return -1;
+
+	job.loaded += len;
+	if (job.loaded == job.prefix) {
+		f_close(&job.source);
+		job.sourceOpen = 0;
+	}
+
+	return 0;
+}
+
+static void TFTP_flashReset(u32 sizeHint)
+{
+	if (job.sourceOpen)
+		f_close(&job.source);
+
+#if TFTP_AMP
+	/* core 1 must be done with the buffer before it is filled again */
+	while ((job.decrypting != job.decrypted) && !TFTP_ampDecryptDone())
+		;
+	job.decrypting = 0;
+#endif
+
+	job.markStep = 0;
+	job.inputDone = 0;
+	job.streaming = 0;
+	job.aborted = 0;
+	job.restoring = 0;
+	job.failed = 0;
+	job.sourceOpen = 0;
+	job.prefix = 0;
+	job.loaded = 0;
+	job.sizeHint = sizeHint;
+	job.received = 0;
+	job.decrypted = 0;
+	job.size = 0;
+	job.erased = 0;
+	job.programmed = 0;
+	job.verified = 0;
+	job.startUs = TFTP_getTimeUs();
+
+	aes_init_ctx_iv(&job.ctx, key, iv);
+}
+
+/*
+ * This function writes the mark of the control sector, one flash
+ * operation per call. Returns 1 when it is written, 0 while it is
+ * being written and -1 on error.
+ */
+static int TFTP_flashMark(u8 value)
+{
+	switch (job.markStep++) {
+	case 0:
+		job.marked = 1;
+		return TFTP_halFlashErase(TFTP_FLASH_CONTROL_ADDR) ? -1 : 0;
+
+	case 1:
+		memset(flashPage, value, TFTP_FLASH_PAGE_SIZE);
+		return TFTP_flashProgram(TFTP_FLASH_CONTROL_ADDR) ? -1 : 0;
+
+	default:
+		job.markStep = 0;
+		if (value == TFTP_FLASH_MARK_DONE)
+			job.marked = 0;
+		return 1;
+	}
+}
+
+/* Makes the image start with the whole of a file of the SD card, returns 0 or -1 */
+static int TFTP_flashSource(const char *path)
+{
+	FSIZE_t size;
+
+	if (f_open(&job.source, path, FA_READ))
+		return -1;
+
+	size = f_size(&job.source);
+	if (!size || (size > (TFTP_FLASH_MAX_IMAGE + AES_BLOCKLEN))) {
+		f_close(&job.source);
+		return -1;
+	}
+
+	job.sourceOpen = 1;
+	job.prefix = size;
+	job.received = size;
+	job.sizeHint = size;
+
+	return 0;
+}
+
+/*
+ * This function handles a failed upload. If no sector of the image is
+ * erased yet, the flash still holds the current image and only its mark
+ * is written back. Otherwise the current image of the SD card is
+ * programmed again, in the same way as an uploaded one.
+ */
+static void TFTP_flashRecover(void)
+{
+	TFTP_flashReset(0);
+	job.restoring = 1;
+
+	if (!job.dirty) {
+		job.state = job.marked ? FLASH_UNMARK : FLASH_IDLE;
+		return;
+	}
+
+	if (TFTP_flashSource(BOOT_FILE_PATH)) {
+		xil_printf("Flash: unable to write %s back, the flash holds an incomplete image!\r\n", BOOT_FILE_PATH);
+		job.state = FLASH_IDLE;
+		return;
+	}
+
+	xil_printf("Flash: the upload failed, writing %s back...\r\n", BOOT_FILE_PATH);
+	job.state = FLASH_WRITE;
+}
+
+/*
+ * This function stops the image after an error. If the flash is already
+ * changed, the current image is written back as after a failed upload,
+ * unless it is the writing back which failed. An upload which is still
+ * open fails too, so its file does not replace the current boot image.
+ */
+static void TFTP_flashFail(const char *reason)
+{
+	xil_printf("Flash: %s, the boot image is not written!\r\n", reason);
+
+	if ((job.dirty || job.marked) && !job.restoring) {
+		TFTP_flashRecover();
+	} else {
+		if (job.dirty)
+			xil_printf("Flash: the flash holds an incomplete image!\r\n");
+
+		if (job.sourceOpen)
+			f_close(&job.source);
+		job.sourceOpen = 0;
+		job.state = FLASH_IDLE;
+	}
+
+	job.failed = job.open;
+}
+
+/* Sectors up to this offset are erased before their data arrives */
+static u32 TFTP_flashEraseLimit(void)
+{
+	u32 limit;
+
+	if (job.inputDone)
+		limit = job.size;
+	else if (job.sizeHint)
+		limit = job.sizeHint;
+	else
+		limit = TFTP_flashAvailable() + TFTP_FLASH_ERASE_AHEAD * TFTP_FLASH_SECTOR_SIZE;
+
+	if (limit > TFTP_FLASH_MAX_IMAGE)
+		limit = TFTP_FLASH_MAX_IMAGE;
+
+	return limit;
+}
+
+/* This function starts the next erase or program operation of the image */
+static int TFTP_flashWriteStep(void)
+{
+	u32 plain, len;
+
+	/* the last block is held back until the padding is known */
+	if (job.inputDone)
+		plain = job.size;
+	else
+		plain = (job.decrypted > AES_BLOCKLEN) ? (job.decrypted - AES_BLOCKLEN) : 0;
+
+	/* programming the next page once its sector is erased */
+	if ((job.programmed < job.erased) && (job.programmed < plain) &&
+		(job.inputDone || ((plain - job.programmed) >= TFTP_FLASH_PAGE_SIZE))) {
+		len = plain - job.programmed;
+		if (len >= TFTP_FLASH_PAGE_SIZE)
+			len = TFTP_FLASH_PAGE_SIZE;
+
+		/* the rest of the last page is filled with zeros, as in writeFileToFlash */
+		memcpy(flashPage, flashBuffer + job.programmed, len);
+		memset(flashPage + len, 0, TFTP_FLASH_PAGE_SIZE - len);
+
+		if (TFTP_flashProgram(job.programmed))
+			return -1;
+		job.programmed += len;
+		return 1;
+	}
+
+	/* erasing the sectors ahead of the data */
+	if (job.erased < TFTP_flashEraseLimit()) {
+		job.dirty = 1;
+		if (TFTP_halFlashErase(job.erased))
+			return -1;
+		job.erased += TFTP_FLASH_SECTOR_SIZE;
+		return 1;
+	}
+
+	if (job.inputDone && (job.programmed == job.size)) {
+		job.state = FLASH_VERIFY;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* This function compares the next part of the flash with the image */
+static int TFTP_flashVerifyStep(void)
+{
+	u32 len = job.size - job.verified;
+
+	if (len > TFTP_FLASH_STEP_SIZE)
+		len = TFTP_FLASH_STEP_SIZE;
+
+	if (TFTP_halFlashRead(job.verified, flashVerify, len))
+		return -1;
+
+	if (memcmp(flashVerify, flashBuffer + job.verified, len)) {
+		xil_printf("Flash: verification failed between 0x%08lx and 0x%08lx\r\n",
+				job.verified, job.verified + len);
+		return -1;
+	}
+
+	job.verified += len;
+	if (job.verified == job.size)
+		job.state = FLASH_UNMARK;
+
+	return 1;
+}
+
+/* The image passes on to the file and is copied into the buffer */
+static int TFTP_flashFilterWrite(tftp_filter *filter, const u8 *data, u32 len)
+{
+	if (job.failed)
+		return -1;
+
+	if ((job.received + len) > (TFTP_FLASH_MAX_IMAGE + AES_BLOCKLEN)) {
+		xil_printf("Flash: the boot image is larger than %lu bytes\r\n", TFTP_FLASH_MAX_IMAGE);
+		return -1;
+	}
+
+	if (TFTP_filterOutput(filter->next, data, len))
+		return -1;
+
+	memcpy(flashBuffer + job.received, data, len);
+	job.received += len;
+
+	return len;
+}
+
+/*
+ * The rest of the image is decrypted when the upload is complete, so
+ * that an image which is not encrypted with the key of the board is
+ * refused before it replaces the current one.
+ */
+static int TFTP_flashFilterFinish(tftp_filter *filter)
+{
+	if (job.failed)
+		return -1;
+
+	while (job.loaded < job.prefix) {
+		if (TFTP_flashLoad())
+			return -1;
+	}
+
+	while (job.decrypted < (job.received & ~(AES_BLOCKLEN - 1))) {
+		if (TFTP_flashDecrypt(job.received, 1) < 0)
+			return -1;
+	}
+
+	if (TFTP_flashImageSize()) {
+		xil_printf("Flash: the boot image cannot be decrypted with the key of the board\r\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void TFTP_flashFilterClose(tftp_filter *filter)
+{
+	job.open = 0;
+
+	if ((job.state != FLASH_IDLE) && !job.inputDone && !job.failed)
+		job.aborted = 1;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function starts programming a new boot image to the flash while
+* it is uploaded. An image which is being programmed is stopped, since
+* the new one replaces it.
+*
+* @param	size is the size of the encrypted image announced by the client,
+*			or 0 if it is unknown.
+* @param	next is a pointer to the filter the image is passed on to.
+*
+* @return	A pointer to the filter of the flash, or NULL if another
+*			upload is being programmed or the flash cannot be accessed.
+*
+******************************************************************************/
+tftp_filter *TFTP_flashOpen(u32 size, tftp_filter *next)
+{
+	if (job.open)
+		return NULL;
+
+	if (!flashReady) {
+		if (TFTP_halFlashOpen())
+			return NULL;
+		flashReady = 1;
+	}
+
+	if (job.state != FLASH_IDLE)
+		xil_printf("Flash: the image being written is replaced by the new one\r\n");
+
+	TFTP_flashReset(size);
+	job.streaming = (f_stat(BOOT_FILE_PATH, NULL) == FR_OK);
+	if (!job.streaming)
+		xil_printf("Flash: there is no %s to write back, the image is written when it is complete\r\n", BOOT_FILE_PATH);
+
+	job.filter.write = TFTP_flashFilterWrite;
+	job.filter.finish = TFTP_flashFilterFinish;
+	job.filter.close = TFTP_flashFilterClose;
+	job.filter.next = next;
+	job.open = 1;
+	job.state = FLASH_WAIT;
+
+	return &job.filter;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function starts programming a boot image of the SD card to the
+* flash, for example one received by the multicast client. The image is
+* read and decrypted in steps, and the flash is only erased when all of
+* it is decrypted. An image which is being written back is replaced.
+*
+* @param	path is a pointer to the path of the boot image.
+*
+* @return	0 if successful, else -1.
+*
+* @note		An image being uploaded is not replaced, -1 is returned.
+*
+******************************************************************************/
+int TFTP_flashFile(const char *path)
+{
+	if (job.open)
+		return -1;
+
+	if (!flashReady) {
+		if (TFTP_halFlashOpen())
+			return -1;
+		flashReady = 1;
+	}
+
+	if (job.state != FLASH_IDLE)
+		xil_printf("Flash: the image being written is replaced by %s\r\n", path);
+
+	TFTP_flashReset(0);
+	if (TFTP_flashSource(path)) {
+		xil_printf("Flash: unable to read %s\r\n", path);
+		job.state = FLASH_IDLE;
+		return -1;
+	}
+
+	job.state = FLASH_WAIT;
+
+	return 0;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function makes the image being uploaded start with the part of a
+* resumed upload which is already in its temporary file.
+*
+* @param	path is a pointer to the path of the temporary file.
+* @param	offset is the size of the received part.
+*
+* @return	0 if successful, else -1.
+*
+* @note		It must be called before the upload goes on.
+*
+******************************************************************************/
+int TFTP_flashResume(const char *path, u32 offset)
+{
+	if (!job.open || job.received)
+		return -1;
+
+	if (f_open(&job.source, path, FA_READ))
+		return -1;
+
+	job.sourceOpen = 1;
+	job.prefix = offset;
+	job.received = offset;
+
+	return 0;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function does the next step of programming a boot image. It must
+* be called periodically from the main loop. A flash operation is only
+* started, and its end is checked in the following steps.
+*
+* @param	None.
+*
+* @return	1 if some work is done, 0 if there is nothing to do right now.
+*
+******************************************************************************/
+int TFTP_flashStep(void)
+{
+	int work = 0;
+	int decrypt;
+	int ret;
+
+	if (job.state == FLASH_IDLE)
+		return 0;
+
+	ret = TFTP_halFlashBusy();
+	if (ret < 0) {
+		TFTP_flashFail("flash access failed");
+		return 1;
+	}
+
+	if (job.aborted) {
+		/* an operation of the failed image must end first */
+		if (ret)
+			return 0;
+		TFTP_flashRecover();
+		return 1;
+	}
+
+	/* the first part of the image is read from a file and decrypted */
+	if (job.loaded < job.prefix) {
+		if (TFTP_flashLoad()) {
+			TFTP_flashFail("unable to read the boot image");
+			return 1;
+		}
+		work = 1;
+	}
+
+	decrypt = TFTP_flashDecrypt(TFTP_FLASH_STEP_SIZE, !job.open);
+	if (decrypt < 0) {
+		TFTP_flashFail("unable to decrypt the boot image");
+		return 1;
+	}
+	work |= decrypt;
+
+	/* an image read from the SD card is complete when all of it is decrypted */
+	if (!job.open && !job.inputDone && (job.state != FLASH_VERIFY) && (job.state != FLASH_UNMARK) &&
+		(job.decrypted == job.received) && TFTP_flashImageSize()) {
+		TFTP_flashFail("the boot image of the SD card cannot be decrypted");
+		return 1;
+	}
+
+	/* the flash is still erasing or programming */
+	if (ret)
+		return work;
+
+	switch (job.state) {
+	case FLASH_WAIT:
+		/*
+		 * The flash is touched once the boot header is decrypted. An
+		 * image of the SD card, or an upload which cannot be written
+		 * back, is decrypted completely before.
+		 */
+		if (!job.inputDone && (!job.streaming || !job.open || (job.decrypted < TFTP_FLASH_HEADER_SIZE)))
+			return work;
+
+		if ((job.inputDone && (job.size < TFTP_FLASH_HEADER_SIZE)) || TFTP_flashBootHeader()) {
+			TFTP_flashFail("the image has no boot header");
+			return 1;
+		}
+		job.state = FLASH_MARK;
+		/* fall through */
+
+	case FLASH_MARK:
+		ret = TFTP_flashMark(TFTP_FLASH_MARK_WRITING);
+		if (ret > 0) {
+			job.state = FLASH_WRITE;
+			ret = TFTP_flashWriteStep();
+		}
+		break;
+
+	case FLASH_WRITE:
+		ret = TFTP_flashWriteStep();
+		break;
+
+	case FLASH_VERIFY:
+		ret = TFTP_flashVerifyStep();
+		break;
+
+	case FLASH_UNMARK:
+		ret = TFTP_flashMark(TFTP_FLASH_MARK_DONE);
+		if (ret <= 0)
+			break;
+
+		job.state = FLASH_IDLE;
+		job.dirty = 0;
+		if (job.restoring && !job.size)
+			xil_printf("Flash: the current boot image is kept\r\n");
+		else if (job.restoring)
+			xil_printf("Flash: %s is written back to flash\r\n", BOOT_FILE_PATH);
+		else {
+			xil_printf("The boot image (%lu bytes) is written to flash in %lu ms!\r\n",
+					job.size, (TFTP_getTimeUs() - job.startUs) / 1000);
+			xil_printf("Now you can turn off the board to boot from QSPI and then turn it back on by activating the QSPI boot mode.\r\n\n");
+		}
+		return 1;
+
+	default:
+		break;
+	}
+
+	if (ret < 0) {
+		TFTP_flashFail("flash access failed");
+		return 1;
+	}
+
+	return work || ret;
+}
+
+/* Returns 1 while a boot image is being programmed or written back */
+int TFTP_flashBusy(void)
+{
+	return job.state != FLASH_IDLE;
+}
+
+/*
+ * Returns 1 while a page is being programmed. The main loop keeps
+ * polling the flash then, instead of sleeping until the next tick.
+ */
+int TFTP_flashPolling(void)
+{
+#if TFTP_AMP
+	/* core 1 interrupts the main loop when the page is programmed */
+	return 0;
+#else
+	if (flashProgramming && (TFTP_halFlashBusy() <= 0))
+		flashProgramming = 0;
+
+	return flashProgramming;
+#endif
+}
@@ -0,0 +1,68 @@
+/*
+ * tftp_flash.h
+ */
+
+#ifndef SRC_TFTP_FLASH_H_
+#define SRC_TFTP_FLASH_H_
+
+#include "tftp_filter.h"
+
+/*
+ * A new boot image is programmed to the flash while it is being
+ * uploaded. The flash filter passes the encrypted image on to the file
+ * unchanged and copies it into a buffer in the DDR. In the idle time of
+ * the main loop, the buffer is decrypted, the sectors are erased ahead
+ * of the data and the decrypted pages are programmed as soon as they
+ * are available, one flash operation per step, without waiting for it.
+ * The programmed image is read back and compared at the end.
+ *
+ * The last AES block is only programmed when the upload is complete,
+ * since it holds the padding. If the upload fails, the current boot
+ * image of the SD card is written back to the flash. When there is no
+ * boot image on the SD card, the upload is decrypted completely before
+ * the flash is erased. A boot image which
+ * is already on the SD card, like one received by the multicast client,
+ * is programmed in the same steps.
+ */
+#define TFTP_FLASH_SECTOR_SIZE		(64 * 1024)
+#define TFTP_FLASH_PAGE_SIZE		256
+
+/*
+ * The flash sector holding the state of the flashing, as written by
+ * writeFileToFlash: 0x0B while an image is written and 0x0E when it is
+ * complete. The boot image must end before it.
+ */
+#define TFTP_FLASH_CONTROL_ADDR		(254 * TFTP_FLASH_SECTOR_SIZE)
+#define TFTP_FLASH_MARK_WRITING		0x0B
+#define TFTP_FLASH_MARK_DONE		0x0E
+#define TFTP_FLASH_MAX_IMAGE		TFTP_FLASH_CONTROL_ADDR
+
+/*
+ * The boot header the boot ROM looks for (see fsbl.h). The flash is
+ * only erased when the start of the image decrypts to it.
+ */
+#define TFTP_FLASH_WIDTH_OFFSET		0x20
+#define TFTP_FLASH_WIDTH_WORD		0xAA995566
+#define TFTP_FLASH_IDENT_OFFSET		0x24
+#define TFTP_FLASH_IDENT_WORD		0x584C4E58	/* "XNLX" */
+#define TFTP_FLASH_HEADER_SIZE		(TFTP_FLASH_IDENT_OFFSET + 4)
+
+/* sectors erased ahead of the received data when the size of the image is unknown */
+#define TFTP_FLASH_ERASE_AHEAD		4
+
+/* most bytes decrypted, read from the SD card or verified in one step */
+#define TFTP_FLASH_STEP_SIZE		(16 * 1024)
+
+/* the image is kept in the DDR while it is programmed (FILE_DATA_ADDR_TX of qspi.h) */
+#ifndef TFTP_FLASH_BUFFER_ADDR
+#define TFTP_FLASH_BUFFER_ADDR		0x20000000
+#endif
+
+tftp_filter *TFTP_flashOpen(u32 size, tftp_filter *next);
+int TFTP_flashFile(const char *path);
+int TFTP_flashResume(const char *path, u32 offset);
+int TFTP_flashStep(void);
+int TFTP_flashBusy(void);
+int TFTP_flashPolling(void);
+
+#endif /* SRC_TFTP_FLASH_H_ */
@@ -0,0 +1,48 @@
+/*
+ * tftp_hal.c
+ */
+
+#include "tftp_hal.h"
+#include "qspi.h"
+#include "tftp_amp.h"
+
+#include "xtime_l.h"
+
+/* Returns a free running time stamp in microseconds */
+u32 TFTP_getTimeUs(void)
+{
+	XTime now;
+
+	XTime_GetTime(&now);
+
+	return (u32)(now / (COUNTS_PER_SECOND / 1000000));
+}
+
+/* in the AMP configuration, the flash is accessed by core 1 (see tftp_amp.c) */
+#if !TFTP_AMP
+int TFTP_halFlashOpen(void)
+{
+	return (qspiOpen() == XST_SUCCESS) ? 0 : -1;
+}
+
+int TFTP_halFlashErase(u32 addr)
+{
+	return (qspiStartErase(addr) == XST_SUCCESS) ? 0 : -1;
+}
+
+int TFTP_halFlashProgram(u32 addr, const u8 *data, u32 len)
+{
+	return (qspiStartWrite(addr, data, len) == XST_SUCCESS) ? 0 : -1;
+}
+
+int TFTP_halFlashRead(u32 addr, u8 *data, u32 len)
+{
+	return (qspiRead(addr, data, len) == XST_SUCCESS) ? 0 : -1;
+}
+
+int TFTP_halFlashBusy(void)
+{
+	return qspiIsBusy();
+}
+
+#endif /* !TFTP_AMP */
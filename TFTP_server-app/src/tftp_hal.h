@@ -0,0 +1,38 @@
+/*
+ * tftp_hal.h
+ */
+
+#ifndef SRC_TFTP_HAL_H_
+#define SRC_TFTP_HAL_H_
+
+#include "xil_types.h"
+
+/*
+ * Services of the board used by the TFTP server. Besides these, the
+ * server only uses the raw UDP API of lwIP (udp_xxx and pbuf_xxx), the
+ * FatFs API (whose disk access goes through diskio.c) and the RTC for
+ * the time stamps of the files (GetCurrentTime).
+ *
+ * tftp_hal.c implements them for the ZC702. TFTP_server-host implements
+ * all of them for Linux, so the same server can be run and profiled
+ * on a workstation.
+ */
+
+/* Returns a free running time stamp in microseconds */
+u32 TFTP_getTimeUs(void);
+
+/*
+ * Access to the flash for programming an image while it is uploaded
+ * (see tftp_flash.h). The erase and program functions return as soon as
+ * the operation is started, and TFTP_halFlashBusy tells when it ends.
+ * They return 0 if successful, else -1.
+ */
+int TFTP_halFlashOpen(void);
+int TFTP_halFlashErase(u32 addr);
+int TFTP_halFlashProgram(u32 addr, const u8 *data, u32 len);
+int TFTP_halFlashRead(u32 addr, u8 *data, u32 len);
+
+/* Returns 1 while the flash is erasing or programming, 0 when it is ready, -1 on error */
+int TFTP_halFlashBusy(void);
+
+#endif /* SRC_TFTP_HAL_H_ */
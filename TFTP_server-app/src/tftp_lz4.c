@@ -0,0 +1,549 @@
+/*
+ * tftp_lz4.c
+ */
+
+#include "tftp_lz4.h"
+
+#include <string.h>
+#include "xil_printf.h"
+
+/* flags of the frame descriptor */
+#define LZ4_FLG_VERSION_MASK	0xC0
+#define LZ4_FLG_VERSION			0x40
+#define LZ4_FLG_BLOCK_CRC		0x10
+#define LZ4_FLG_CONTENT_SIZE	0x08
+#define LZ4_FLG_CONTENT_CRC		0x04
+#define LZ4_FLG_DICT_ID			0x01
+
+/* a block stored without compression */
+#define LZ4_BLOCK_RAW			0x80000000
+
+#define XXH_PRIME1				2654435761U
+#define XXH_PRIME2				2246822519U
+#define XXH_PRIME3				3266489917U
+#define XXH_PRIME4				668265263U
+#define XXH_PRIME5				374761393U
+
+#define LZ4_WINDOW_MASK			(TFTP_LZ4_WINDOW_SIZE - 1)
+
+/* state of an xxHash-32 with seed 0, the checksum of LZ4 frames */
+typedef struct {
+	u32 v[4];
+	u8 buf[16];
+	u32 bufLen;
+	u32 total;
+} tftp_xxh32;
+
+typedef enum {
+	LZ4_MAGIC,
+	LZ4_DESC,
+	LZ4_DESC_REST,
+	LZ4_BLOCK_SIZE,
+	LZ4_TOKEN,
+	LZ4_LIT_LEN,
+	LZ4_LITERALS,
+	LZ4_OFFSET,
+	LZ4_MATCH_LEN,
+	LZ4_MATCH,
+	LZ4_RAW,
+	LZ4_BLOCK_CRC,
+	LZ4_CONTENT_CRC,
+	LZ4_DONE
+} tftp_lz4_state;
+
+typedef struct {
+	tftp_filter filter;
+	u8 busy;
+
+	tftp_lz4_state state;
+
+	/* a field of the frame being received */
+	u8 field[16];
+	u8 fieldLen;
+	u8 fieldNeed;
+
+	u8 flags;
+	u32 blockMax;
+	u32 contentSize;
+	u32 contentCrc;
+
+	/* compressed bytes left in the current block */
+	u32 blockLeft;
+
+	/* the sequence being decoded */
+	u32 literals;
+	u32 matchLen;
+	u32 matchOffset;
+
+	/* bytes of output made, and passed on to the next filter */
+	u32 pos;
+	u32 flushed;
+	tftp_xxh32 xxh;
+
+	u8 window[TFTP_LZ4_WINDOW_SIZE];
+} tftp_lz4;
+
+static tftp_lz4 streams[TFTP_LZ4_MAX_STREAMS];
+
+static u32 TFTP_lz4Get32(const u8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static u32 TFTP_xxhRotl(u32 x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static u32 TFTP_xxhRound(u32 acc, const u8 *p)
+{
+	acc += TFTP_lz4Get32(p) * XXH_PRIME2;
+	return TFTP_xxhRotl(acc, 13) * XXH_PRIME1;
+}
+
+static void TFTP_xxhInit(tftp_xxh32 *h)
+{
+	h->v[0] = XXH_PRIME1 + XXH_PRIME2;
+	h->v[1] = XXH_PRIME2;
+	h->v[2] = 0;
+	h->v[3] = 0 - XXH_PRIME1;
+	h->bufLen = 0;
+	h->total = 0;
+}
+
+static void TFTP_xxhUpdate(tftp_xxh32 *h, const u8 *data, u32 len)
+{
+	u32 n, i;
+
+	h->total += len;
+
+	if (h->bufLen) {
+		n = sizeof(h->buf) - h->bufLen;
+		if (n > len)
+			n = len;
+		memcpy(h->buf + h->bufLen, data, n);
+		h->bufLen += n;
+		data += n;
+		len -= n;
+		if (h->bufLen < sizeof(h->buf))
+			return;
+
+		for (i = 0; i < 4; i++)
+			h->v[i] = TFTP_xxhRound(h->v[i], h->buf + 4 * i);
+		h->bufLen = 0;
+	}
+
+	for (; len >= 16; data += 16, len -= 16) {
+		for (i = 0; i < 4; i++)
+			h->v[i] = TFTP_xxhRound(h->v[i], data + 4 * i);
+	}
+
+	memcpy(h->buf, data, len);
+	h->bufLen = len;
+}
+
+static u32 TFTP_xxhDigest(const tftp_xxh32 *h)
+{
+	u32 acc, i;
+
+	if (h->total >= 16)
+		acc = TFTP_xxhRotl(h->v[0], 1) + TFTP_xxhRotl(h->v[1], 7) +
+			TFTP_xxhRotl(h->v[2], 12) + TFTP_xxhRotl(h->v[3], 18);
+	else
+		acc = XXH_PRIME5;
+	acc += h->total;
+
+	for (i = 0; (i + 4) <= h->bufLen; i += 4)
+		acc = TFTP_xxhRotl(acc + TFTP_lz4Get32(h->buf + i) * XXH_PRIME3, 17) * XXH_PRIME4;
+	for (; i < h->bufLen; i++)
+		acc = TFTP_xxhRotl(acc + h->buf[i] * XXH_PRIME5, 11) * XXH_PRIME1;
+
+	acc ^= acc >> 15;
+	acc *= XXH_PRIME2;
+	acc ^= acc >> 13;
+	acc *= XXH_PRIME3;
+	acc ^= acc >> 16;
+
+	return acc;
+}
+
+/* Waits for a field of the given length */
+static void TFTP_lz4Expect(tftp_lz4 *d, tftp_lz4_state state, u8 len)
+{
+	d->state = state;
+	d->fieldLen = 0;
+	d->fieldNeed = len;
+}
+
+static void TFTP_lz4EndBlock(tftp_lz4 *d)
+{
+	if (d->flags & LZ4_FLG_BLOCK_CRC)
+		TFTP_lz4Expect(d, LZ4_BLOCK_CRC, 4);
+	else
+		TFTP_lz4Expect(d, LZ4_BLOCK_SIZE, 4);
+}
+
+/*
+ * This function passes the output on to the next filter. Unless all
+ * is set, only whole pieces of TFTP_LZ4_FLUSH_SIZE bytes are passed,
+ * and it stops when the next filter does not take all of a piece.
+ */
+static int TFTP_lz4Flush(tftp_lz4 *d, u8 all)
+{
+	u32 offset, n;
+	int ret;
+
+	while (d->flushed != d->pos) {
+		offset = d->flushed & LZ4_WINDOW_MASK;
+		n = d->pos - d->flushed;
+		if (n > (TFTP_LZ4_WINDOW_SIZE - offset))
+			n = TFTP_LZ4_WINDOW_SIZE - offset;
+		if (!all) {
+			n -= n % TFTP_LZ4_FLUSH_SIZE;
+			if (!n)
+				break;
+		}
+
+		ret = TFTP_filterWrite(d->filter.next, d->window + offset, n);
+		if (ret < 0)
+			return -1;
+
+		TFTP_xxhUpdate(&d->xxh, d->window + offset, ret);
+		d->flushed += ret;
+
+		if (((u32)ret < n) && !all)
+			break;
+	}
+
+	return 0;
+}
+
+/* Appends bytes to the output */
+static void TFTP_lz4Put(tftp_lz4 *d, const u8 *data, u32 len)
+{
+	u32 offset = d->pos & LZ4_WINDOW_MASK;
+	u32 n = TFTP_LZ4_WINDOW_SIZE - offset;
+
+	if (n > len)
+		n = len;
+	memcpy(d->window + offset, data, n);
+	memcpy(d->window, data + n, len - n);
+	d->pos += len;
+}
+
+/* Appends bytes of a match, which may overlap the bytes it makes */
+static void TFTP_lz4Copy(tftp_lz4 *d, u32 len)
+{
+	u8 *window = d->window;
+	u32 pos = d->pos;
+	u32 from = pos - d->matchOffset;
+
+	while (len--)
+		window[pos++ & LZ4_WINDOW_MASK] = window[from++ & LZ4_WINDOW_MASK];
+
+	d->pos = pos;
+}
+
+/* This function handles a field of the frame when all of it is received */
+static int TFTP_lz4Field(tftp_lz4 *d)
+{
+	u32 size, hash;
+	u8 bd;
+	tftp_xxh32 h;
+
+	switch (d->state) {
+	case LZ4_MAGIC:
+		if (TFTP_lz4Get32(d->field) != TFTP_LZ4_MAGIC) {
+			xil_printf("LZ4: not an LZ4 frame\r\n");
+			return -1;
+		}
+		TFTP_lz4Expect(d, LZ4_DESC, 2);
+		break;
+
+	case LZ4_DESC:
+		d->flags = d->field[0];
+		bd = (d->field[1] >> 4) & 7;
+		if (((d->flags & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION) || (bd < 4)) {
+			xil_printf("LZ4: unsupported frame version\r\n");
+			return -1;
+		}
+		if (d->flags & LZ4_FLG_DICT_ID) {
+			xil_printf("LZ4: frames with a dictionary are not supported\r\n");
+			return -1;
+		}
+		d->blockMax = 1 << (8 + 2 * bd);
+
+		/* the rest of the descriptor ends with a checksum of all of it */
+		d->state = LZ4_DESC_REST;
+		d->fieldNeed += ((d->flags & LZ4_FLG_CONTENT_SIZE) ? 8 : 0) + 1;
+		break;
+
+	case LZ4_DESC_REST:
+		TFTP_xxhInit(&h);
+		TFTP_xxhUpdate(&h, d->field, d->fieldNeed - 1);
+		hash = TFTP_xxhDigest(&h);
+		if (((hash >> 8) & 0xFF) != d->field[d->fieldNeed - 1]) {
+			xil_printf("LZ4: corrupted frame descriptor\r\n");
+			return -1;
+		}
+		if (d->flags & LZ4_FLG_CONTENT_SIZE) {
+			d->contentSize = TFTP_lz4Get32(d->field + 2);
+			if (TFTP_lz4Get32(d->field + 6)) {
+				xil_printf("LZ4: content too large\r\n");
+				return -1;
+			}
+		}
+		TFTP_lz4Expect(d, LZ4_BLOCK_SIZE, 4);
+		break;
+
+	case LZ4_BLOCK_SIZE:
+		size = TFTP_lz4Get32(d->field);
+		if (!size) {
+			if (d->flags & LZ4_FLG_CONTENT_CRC)
+				TFTP_lz4Expect(d, LZ4_CONTENT_CRC, 4);
+			else
+				d->state = LZ4_DONE;
+			break;
+		}
+
+		d->blockLeft = size & ~LZ4_BLOCK_RAW;
+		if (d->blockLeft > d->blockMax) {
+			xil_printf("LZ4: block larger than %lu bytes\r\n", d->blockMax);
+			return -1;
+		}
+		d->state = (size & LZ4_BLOCK_RAW) ? LZ4_RAW : LZ4_TOKEN;
+		break;
+
+	case LZ4_OFFSET:
+		d->matchOffset = d->field[0] | (d->field[1] << 8);
+		if (!d->matchOffset || ((d->pos < TFTP_LZ4_WINDOW_SIZE) && (d->matchOffset > d->pos))) {
+			xil_printf("LZ4: match before the start of the output\r\n");
+			return -1;
+		}
+		d->state = (d->matchLen == (15 + 4)) ? LZ4_MATCH_LEN : LZ4_MATCH;
+		break;
+
+	case LZ4_BLOCK_CRC:
+		TFTP_lz4Expect(d, LZ4_BLOCK_SIZE, 4);
+		break;
+
+	case LZ4_CONTENT_CRC:
+		d->contentCrc = TFTP_lz4Get32(d->field);
+		d->state = LZ4_DONE;
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * This function decodes a part of a frame. The sequences of a block
+ * are decoded as their bytes arrive, so the blocks are never buffered.
+ * At most TFTP_LZ4_STEP_SIZE bytes of output are made per call, and
+ * the rest of the input is left for the next calls.
+ */
+static int TFTP_lz4Write(tftp_filter *filter, const u8 *data, u32 len)
+{
+	tftp_lz4 *d = (tftp_lz4 *)filter;
+	u32 start = d->pos, taken = 0, n;
+	u8 c;
+
+	while (((taken < len) || (d->state == LZ4_MATCH)) && ((d->pos - start) < TFTP_LZ4_STEP_SIZE)) {
+		/* the output must be taken before the window is overwritten */
+		if ((d->pos - d->flushed) >= TFTP_LZ4_FLUSH_SIZE) {
+			if (TFTP_lz4Flush(d, 0))
+				return -1;
+			if ((d->pos - d->flushed) >= TFTP_LZ4_FLUSH_SIZE)
+				break;
+		}
+
+		switch (d->state) {
+		case LZ4_MAGIC:
+		case LZ4_DESC:
+		case LZ4_DESC_REST:
+		case LZ4_BLOCK_SIZE:
+		case LZ4_OFFSET:
+		case LZ4_BLOCK_CRC:
+		case LZ4_CONTENT_CRC:
+			n = d->fieldNeed - d->fieldLen;
+			if (n > (len - taken))
+				n = len - taken;
+			if (d->state == LZ4_OFFSET) {
+				if (n > d->blockLeft)
+					goto corrupted;
+				d->blockLeft -= n;
+			}
+			memcpy(d->field + d->fieldLen, data + taken, n);
+			d->fieldLen += n;
+			taken += n;
+
+			if ((d->fieldLen == d->fieldNeed) && TFTP_lz4Field(d))
+				return -1;
+			break;
+
+		case LZ4_TOKEN:
+			c = data[taken++];
+			d->blockLeft--;
+			d->literals = c >> 4;
+			d->matchLen = (c & 0x0F) + 4;
+			d->state = (d->literals == 15) ? LZ4_LIT_LEN : LZ4_LITERALS;
+			break;
+
+		case LZ4_LIT_LEN:
+			if (!d->blockLeft)
+				goto corrupted;
+			c = data[taken++];
+			d->blockLeft--;
+			d->literals += c;
+			if (c != 255)
+				d->state = LZ4_LITERALS;
+			break;
+
+		case LZ4_LITERALS:
+			if (d->literals) {
+				n = len - taken;
+				if (n > d->literals)
+					n = d->literals;
+				if (n > TFTP_LZ4_FLUSH_SIZE)
+					n = TFTP_LZ4_FLUSH_SIZE;
+				if (n > d->blockLeft)
+					goto corrupted;
+
+				TFTP_lz4Put(d, data + taken, n);
+				taken += n;
+				d->blockLeft -= n;
+				d->literals -= n;
+				break;
+			}
+
+			/* the last sequence of a block has no match */
+			if (d->blockLeft)
+				TFTP_lz4Expect(d, LZ4_OFFSET, 2);
+			else
+				TFTP_lz4EndBlock(d);
+			break;
+
+		case LZ4_MATCH_LEN:
+			if (!d->blockLeft)
+				goto corrupted;
+			c = data[taken++];
+			d->blockLeft--;
+			d->matchLen += c;
+			if (c != 255)
+				d->state = LZ4_MATCH;
+			break;
+
+		case LZ4_MATCH:
+			n = (d->matchLen < TFTP_LZ4_FLUSH_SIZE) ? d->matchLen : TFTP_LZ4_FLUSH_SIZE;
+			TFTP_lz4Copy(d, n);
+			d->matchLen -= n;
+			if (!d->matchLen) {
+				if (!d->blockLeft)
+					goto corrupted;
+				d->state = LZ4_TOKEN;
+			}
+			break;
+
+		case LZ4_RAW:
+			if (!d->blockLeft) {
+				TFTP_lz4EndBlock(d);
+				break;
+			}
+			n = len - taken;
+			if (n > d->blockLeft)
+				n = d->blockLeft;
+			if (n > TFTP_LZ4_FLUSH_SIZE)
+				n = TFTP_LZ4_FLUSH_SIZE;
+
+			TFTP_lz4Put(d, data + taken, n);
+			taken += n;
+			d->blockLeft -= n;
+			break;
+
+		case LZ4_DONE:
+			xil_printf("LZ4: data after the end of the frame\r\n");
+			return -1;
+		}
+	}
+
+	return taken;
+
+corrupted:
+	xil_printf("LZ4: corrupted block\r\n");
+	return -1;
+}
+
+/* The frame must be complete, and its output must match its checksum */
+static int TFTP_lz4Finish(tftp_filter *filter)
+{
+	tftp_lz4 *d = (tftp_lz4 *)filter;
+
+	if (d->state != LZ4_DONE) {
+		xil_printf("LZ4: incomplete frame\r\n");
+		return -1;
+	}
+
+	if (TFTP_lz4Flush(d, 1))
+		return -1;
+
+	if ((d->flags & LZ4_FLG_CONTENT_SIZE) && (d->pos != d->contentSize)) {
+		xil_printf("LZ4: %lu bytes decompressed instead of %lu\r\n", d->pos, d->contentSize);
+		return -1;
+	}
+
+	if ((d->flags & LZ4_FLG_CONTENT_CRC) && (TFTP_xxhDigest(&d->xxh) != d->contentCrc)) {
+		xil_printf("LZ4: checksum mismatch\r\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void TFTP_lz4Close(tftp_filter *filter)
+{
+	tftp_lz4 *d = (tftp_lz4 *)filter;
+
+	d->busy = 0;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function starts decompressing an LZ4 frame.
+*
+* @param	next is a pointer to the filter the output is passed to.
+*
+* @return	A pointer to the filter of the decompressor, or NULL if
+*			TFTP_LZ4_MAX_STREAMS frames are already being decompressed.
+*
+******************************************************************************/
+tftp_filter *TFTP_lz4Open(tftp_filter *next)
+{
+	tftp_lz4 *d;
+	int i;
+
+	for (i = 0; i < TFTP_LZ4_MAX_STREAMS; i++) {
+		if (!streams[i].busy)
+			break;
+	}
+	if (i == TFTP_LZ4_MAX_STREAMS)
+		return NULL;
+
+	d = &streams[i];
+	d->filter.write = TFTP_lz4Write;
+	d->filter.finish = TFTP_lz4Finish;
+	d->filter.close = TFTP_lz4Close;
+	d->filter.next = next;
+
+	TFTP_lz4Expect(d, LZ4_MAGIC, 4);
+	d->flags = 0;
+	d->pos = 0;
+	d->flushed = 0;
+	TFTP_xxhInit(&d->xxh);
+	d->busy = 1;
+
+	return &d->filter;
+}
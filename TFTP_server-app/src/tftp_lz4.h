@@ -0,0 +1,37 @@
+/*
+ * tftp_lz4.h
+ */
+
+#ifndef SRC_TFTP_LZ4_H_
+#define SRC_TFTP_LZ4_H_
+
+#include "tftp_filter.h"
+
+/*
+ * A file can be uploaded compressed in the LZ4 frame format, as made by
+ * the lz4 command line tool, with the ".lz4" suffix added to its name.
+ * It is decompressed while it is being received and stored under the
+ * name without the suffix, so BOOT.BIN.lz4 is flashed like BOOT.BIN.
+ *
+ * The blocks are decoded as they arrive, whatever their size, so only
+ * the last 64 KB of the output, which matches can refer to, are kept.
+ */
+#define TFTP_LZ4_SUFFIX			".lz4"
+
+#define TFTP_LZ4_MAGIC			0x184D2204
+
+/* output which matches can refer to, a power of two */
+#define TFTP_LZ4_WINDOW_SIZE	(64 * 1024)
+
+/* the output is passed on in pieces of this size */
+#define TFTP_LZ4_FLUSH_SIZE		(16 * 1024)
+
+/* most bytes of output made in one step */
+#define TFTP_LZ4_STEP_SIZE		(64 * 1024)
+
+/* number of compressed uploads at the same time */
+#define TFTP_LZ4_MAX_STREAMS	4
+
+tftp_filter *TFTP_lz4Open(tftp_filter *next);
+
+#endif /* SRC_TFTP_LZ4_H_ */
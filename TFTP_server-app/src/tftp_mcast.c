@@ -0,0 +1,615 @@
+/*
+ * tftp_mcast.c
+ */
+
+#include "tftp_mcast.h"
+#include "tftp_work.h"
+#include "web_utils.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "xil_printf.h"
+
+#include "lwip/inet.h"
+#include "lwip/udp.h"
+#include "lwip/igmp.h"
+
+#if LWIP_IGMP
+
+extern struct netif server_netif;
+
+typedef enum {
+	MCAST_IDLE,
+	MCAST_REQUEST,
+	MCAST_RECEIVE
+} TFTP_mcastState;
+
+typedef struct {
+	/* waiting for the answer of the RRQ, or receiving blocks */
+	TFTP_mcastState state;
+
+	/* blocks are sent to a group, or by unicast if the server has no multicast support */
+	u8 multicast;
+
+	/* connection to the server and the TID of the server */
+	struct udp_pcb *pcb;
+	ip_addr_t server;
+	u16 serverPort;
+
+	/* multicast group of the transfer */
+	struct udp_pcb *groupPcb;
+	ip_addr_t group;
+	u16 groupPort;
+	u8 groupSeen;
+	u8 joined;
+
+	/* only the master client acknowledges blocks */
+	u8 master;
+
+	/* name of the file on the server and on the SD card */
+	FIL file;
+	char remote[TFTP_MCAST_MAX_FNAME_LEN];
+	const char *local;
+	u8 bootFile;
+
+	u16 blksize;
+
+	/*
+	 * lowest block which is not received yet, and the number of the
+	 * last block of the file, which is valid if eof is set
+	 */
+	u32 firstMissing;
+	u16 lastBlock;
+	u8 eof;
+
+	/* last block acknowledged, resent when the timer expires */
+	u16 lastAck;
+
+	/* retransmission timer, times are in microseconds */
+	u32 deadline;
+	u32 lastActivity;
+	u8 retries;
+
+	/* bitmap of the received blocks */
+	u8 received[TFTP_MCAST_MAX_BLOCKS / 8];
+} TFTP_mcastClient;
+
+static TFTP_mcastClient mcast;
+
+static int TFTP_mcastIsReceived(u32 block)
+{
+	return mcast.received[block >> 3] & (1 << (block & 7));
+}
+
+static void TFTP_mcastSetReceived(u32 block)
+{
+	mcast.received[block >> 3] |= (1 << (block & 7));
+}
+
+/*
+ * This function sends the RRQ of the file. The multicast option
+ * is only asked for as long as the transfer is done by multicast.
+ */
+static err_t TFTP_mcastSendRequest(void)
+{
+	char packet[MAX_MSG_LEN];
+	int len = FILE_NAME_OFFSET;
+
+	setOpCode(packet, TFTP_RRQ);
+	len += sprintf(packet + len, "%s", mcast.remote) + 1;
+	len += sprintf(packet + len, "octet") + 1;
+
+	if (mcast.multicast) {
+		/* the multicast option has an empty value */
+		len += sprintf(packet + len, "multicast") + 1;
+		packet[len++] = '\0';
+	}
+
+	len += sprintf(packet + len, "blksize") + 1;
+	len += sprintf(packet + len, "%d", TFTP_MCAST_BLKSIZE) + 1;
+
+	/* the size is asked for, so a file which is too large is refused early */
+	len += sprintf(packet + len, "tsize") + 1;
+	len += sprintf(packet + len, "0") + 1;
+
+	mcast.deadline = TFTP_getTimeUs() + TFTP_INITIAL_RTO_US;
+
+	return TFTP_sendPacket(mcast.pcb, &mcast.server, TFTP_PORT, packet, len);
+}
+
+static void TFTP_mcastSendACK(u16 block)
+{
+	TFTP_sendACK(mcast.pcb, &mcast.server, mcast.serverPort, block);
+	mcast.lastAck = block;
+	mcast.deadline = TFTP_getTimeUs() + TFTP_INITIAL_RTO_US;
+}
+
+/* This function leaves the multicast group and closes the connections */
+static void TFTP_mcastClose(void)
+{
+	if (mcast.joined)
+		igmp_leavegroup_netif(&server_netif, ip_2_ip4(&mcast.group));
+	if (mcast.groupPcb)
+		udp_remove(mcast.groupPcb);
+	if (mcast.pcb)
+		udp_remove(mcast.pcb);
+
+	mcast.joined = 0;
+	mcast.groupPcb = NULL;
+	mcast.pcb = NULL;
+	mcast.state = MCAST_IDLE;
+}
+
+/* This function stops the transfer and removes the incomplete file */
+static void TFTP_mcastAbort(void)
+{
+	xil_printf("TFTP MCAST: Transfer of %s failed\r\n\n", mcast.remote);
+
+	TFTP_mcastClose();
+	f_close(&mcast.file);
+	f_unlink(mcast.local);
+}
+
+/*
+ * This function is called when the whole file is received. The last
+ * block of a group is acknowledged in any case, so that the server
+ * knows that this client does not need to become master any more.
+ * A unicast transfer which still has blocks to send, since the rest
+ * of them came by multicast before, is stopped by an error instead:
+ * its server only takes the ACK of the block it has just sent.
+ */
+static void TFTP_mcastFinish(u16 block)
+{
+	if (mcast.multicast || (block == mcast.lastBlock))
+		TFTP_mcastSendACK(mcast.lastBlock);
+	else
+		TFTP_sendError(mcast.pcb, &mcast.server, mcast.serverPort, ERR_NOT_DEFINED);
+
+	xil_printf("TFTP MCAST: Transfer of %s completed!\r\n\n", mcast.remote);
+
+	TFTP_mcastClose();
+	f_close(&mcast.file);
+	TFTP_fileReceived(mcast.local, mcast.bootFile, 0);
+}
+
+/*
+ * This function writes a block into its place in the file. Blocks
+ * of a group may arrive in any order, so the file is seeked to the
+ * offset of the block, which extends it if the block is beyond its end.
+ */
+static int TFTP_mcastWrite(struct pbuf *p_buf, u16 block, u32 len)
+{
+	FSIZE_t offset = (FSIZE_t)(block - 1) * mcast.blksize;
+	u32 skip = TFTP_PACKET_HDR_LEN;
+	struct pbuf *q;
+	UINT written;
+	u32 segLen;
+
+	if ((f_tell(&mcast.file) != offset) && f_lseek(&mcast.file, offset))
+		return -1;
+
+	/* the segments of a chained pbuf are written one after the other */
+	for (q = p_buf; q && len; q = q->next) {
+		if (skip >= q->len) {
+			skip -= q->len;
+			continue;
+		}
+
+		segLen = q->len - skip;
+		if (segLen > len)
+			segLen = len;
+
+		if (f_write(&mcast.file, (char *)q->payload + skip, segLen, &written) ||
+			(written != segLen))
+			return -1;
+
+		len -= segLen;
+		skip = 0;
+	}
+
+	return 0;
+}
+
+static void TFTP_mcastData(struct pbuf *p_buf, u16 block)
+{
+	u32 len = p_buf->tot_len - TFTP_PACKET_HDR_LEN;
+
+	if (!block || (len > mcast.blksize))
+		return;
+
+	mcast.lastActivity = TFTP_getTimeUs();
+
+	/* block numbers do not roll over, blocks of a group cannot be told apart then */
+	if ((block == TFTP_MCAST_LAST_BLOCK) && (len == mcast.blksize)) {
+		xil_printf("TFTP MCAST: %s has more than %d blocks\r\n", mcast.remote, TFTP_MCAST_LAST_BLOCK);
+		TFTP_sendError(mcast.pcb, &mcast.server, mcast.serverPort, ERR_DISK_FULL);
+		return TFTP_mcastAbort();
+	}
+
+	if (!TFTP_mcastIsReceived(block)) {
+		if (TFTP_mcastWrite(p_buf, block, len)) {
+			xil_printf("TFTP MCAST: Write to file error\r\n");
+			TFTP_sendError(mcast.pcb, &mcast.server, mcast.serverPort, ERR_DISK_FULL);
+			return TFTP_mcastAbort();
+		}
+		TFTP_mcastSetReceived(block);
+
+		/* a short (or empty) block marks the end of the file */
+		if (len < mcast.blksize) {
+			mcast.lastBlock = block;
+			mcast.eof = 1;
+		}
+
+		while ((mcast.firstMissing < TFTP_MCAST_MAX_BLOCKS) &&
+			TFTP_mcastIsReceived(mcast.firstMissing))
+			mcast.firstMissing++;
+	}
+
+	if (mcast.eof && (mcast.firstMissing > mcast.lastBlock))
+		return TFTP_mcastFinish(block);
+
+	if (!mcast.master)
+		return;
+
+	/*
+	 * The master client of a group asks for the block after the
+	 * last contiguous one it has, so the blocks received while it
+	 * was not master are skipped. A unicast transfer is lock-step,
+	 * but a block is never acknowledged while one before it is missing.
+	 */
+	mcast.retries = 0;
+	if (mcast.multicast || (block >= mcast.firstMissing))
+		block = mcast.firstMissing - 1;
+	TFTP_mcastSendACK(block);
+}
+
+/*
+ * This function uses the block size which is negotiated with the
+ * server. Blocks are addressed by their number, so if a new request
+ * ends up with another block size, the received blocks must be
+ * fetched again.
+ */
+static void TFTP_mcastSetBlksize(u16 blksize)
+{
+	if (blksize == mcast.blksize)
+		return;
+
+	if (mcast.firstMissing > 1)
+		xil_printf("TFTP MCAST: Block size changed, receiving %s from the start\r\n", mcast.remote);
+
+	memset(mcast.received, 0, sizeof mcast.received);
+	mcast.blksize = blksize;
+	mcast.firstMissing = 1;
+	mcast.eof = 0;
+}
+
+/*
+ * This function parses the value of the multicast option, which is
+ * "<address>,<port>,<mc>". The address and the port are only given
+ * in the first OACK, mc is 1 if this client is the master client.
+ */
+static void TFTP_mcastParseGroup(char *value)
+{
+	char *port, *mc;
+
+	port = strchr(value, ',');
+	if (!port)
+		return;
+	*port++ = '\0';
+
+	mc = strchr(port, ',');
+	if (!mc)
+		return;
+	*mc++ = '\0';
+
+	if (!mcast.joined) {
+		if (*value && !inet_aton(value, &mcast.group))
+			return;
+		if (*port)
+			mcast.groupPort = atoi(port);
+	}
+
+	mcast.master = (atoi(mc) == 1);
+	mcast.groupSeen = 1;
+}
+
+static void TFTP_mcastGroupRecv(void *arg, struct udp_pcb *upcb,
+		struct pbuf *p_buf, ip_addr_t *addr, u16 port)
+{
+	char header[TFTP_PACKET_HDR_LEN];
+
+	if ((mcast.state == MCAST_RECEIVE) && ip_addr_cmp(addr, &mcast.server) &&
+		(pbuf_copy_partial(p_buf, header, TFTP_PACKET_HDR_LEN, 0) == TFTP_PACKET_HDR_LEN) &&
+		(getOpCode(header) == TFTP_DATA))
+		TFTP_mcastData(p_buf, getBlockValue(header));
+
+	pbuf_free(p_buf);
+}
+
+static int TFTP_mcastJoin(void)
+{
+	mcast.groupPcb = udp_new();
+	if (!mcast.groupPcb) {
+		xil_printf("Error creating PCB. Out of Memory!\r\n");
+		return -1;
+	}
+
+	/* only the packets sent to the group are received on its port */
+	if (udp_bind(mcast.groupPcb, &mcast.group, mcast.groupPort) != ERR_OK) {
+		xil_printf("Unable to bind to port %d\r\n", mcast.groupPort);
+		return -1;
+	}
+	udp_recv(mcast.groupPcb, (udp_recv_fn) TFTP_mcastGroupRecv, NULL);
+
+	if (igmp_joingroup_netif(&server_netif, ip_2_ip4(&mcast.group)) != ERR_OK) {
+		xil_printf("Unable to join multicast group %s\r\n", inet_ntoa(mcast.group));
+		return -1;
+	}
+	mcast.joined = 1;
+
+	xil_printf("TFTP MCAST: Joined group %s:%d\r\n", inet_ntoa(mcast.group), mcast.groupPort);
+
+	return 0;
+}
+
+static void TFTP_mcastOACK(char *opt, char *end)
+{
+	u8 first = (mcast.state == MCAST_REQUEST);
+	u16 blksize = DATA_PACKET_MSG_LEN;
+	u32 tsize = 0;
+	char *value;
+
+	mcast.groupSeen = 0;
+
+	while (opt < end) {
+		value = opt + strlen(opt) + 1;
+		if (value >= end)
+			break;
+
+		if (!strcasecmp(opt, "blksize"))
+			blksize = strtoul(value, NULL, 10);
+		else if (!strcasecmp(opt, "tsize"))
+			tsize = strtoul(value, NULL, 10);
+		else if (!strcasecmp(opt, "multicast") && mcast.multicast)
+			TFTP_mcastParseGroup(value);
+
+		opt = value + strlen(value) + 1;
+	}
+
+	mcast.lastActivity = TFTP_getTimeUs();
+
+	/*
+	 * Later OACKs of a group only hand over the master role,
+	 * the first one also starts the transfer.
+	 */
+	if (first) {
+		/* the last block of the file must not need a number past TFTP_MCAST_LAST_BLOCK */
+		if ((u64)tsize >= ((u64)TFTP_MCAST_LAST_BLOCK * blksize)) {
+			xil_printf("TFTP MCAST: %s is too large (%lu bytes)\r\n", mcast.remote, tsize);
+			TFTP_sendError(mcast.pcb, &mcast.server, mcast.serverPort, ERR_DISK_FULL);
+			return TFTP_mcastAbort();
+		}
+
+		mcast.state = MCAST_RECEIVE;
+		TFTP_mcastSetBlksize(blksize);
+
+		if (!mcast.groupSeen) {
+			/* the server does not support multicast, so the file is received by unicast */
+			mcast.multicast = 0;
+			mcast.master = 1;
+		}
+		else if (TFTP_mcastJoin()) {
+			TFTP_sendError(mcast.pcb, &mcast.server, mcast.serverPort, ERR_NOT_DEFINED);
+			return TFTP_mcastAbort();
+		}
+	}
+
+	if (mcast.master) {
+		mcast.retries = 0;
+		TFTP_mcastSendACK(mcast.multicast ? (u16)(mcast.firstMissing - 1) : 0);
+	}
+}
+
+static void TFTP_mcastRecv(void *arg, struct udp_pcb *upcb,
+		struct pbuf *p_buf, ip_addr_t *addr, u16 port)
+{
+	char packet[MAX_MSG_LEN + 1];
+	u16 len;
+
+	len = pbuf_copy_partial(p_buf, packet, MAX_MSG_LEN, 0);
+	packet[len] = '\0';
+
+	if ((len < TFTP_PACKET_HDR_LEN) || !ip_addr_cmp(addr, &mcast.server)) {
+		pbuf_free(p_buf);
+		return;
+	}
+
+	/* the first answer of the server tells its TID */
+	if (mcast.state == MCAST_REQUEST)
+		mcast.serverPort = port;
+	else if (port != mcast.serverPort) {
+		TFTP_sendError(upcb, addr, port, ERR_UNKNOWN_TRANSFER_ID);
+		pbuf_free(p_buf);
+		return;
+	}
+
+	switch (getOpCode(packet)) {
+	case TFTP_OACK:
+		TFTP_mcastOACK(packet + OPTION_OFFSET, packet + len);
+		break;
+	case TFTP_DATA:
+		if (mcast.state == MCAST_REQUEST) {
+			/* the server ignored the options, this is a plain unicast transfer */
+			mcast.state = MCAST_RECEIVE;
+			mcast.multicast = 0;
+			mcast.master = 1;
+			TFTP_mcastSetBlksize(DATA_PACKET_MSG_LEN);
+		}
+		TFTP_mcastData(p_buf, getBlockValue(packet));
+		break;
+	case TFTP_ERR:
+		xil_printf("TFTP MCAST: Transfer aborted by server [%d]\r\n", getErrCode(packet));
+		TFTP_mcastAbort();
+		break;
+	default:
+		break;
+	}
+
+	pbuf_free(p_buf);
+}
+
+/* This function opens a new connection to the server and sends the RRQ */
+static int TFTP_mcastConnect(void)
+{
+	mcast.pcb = udp_new();
+	if (!mcast.pcb) {
+		xil_printf("Error creating PCB. Out of Memory!\r\n");
+		return -1;
+	}
+
+	/* binding to port 0 to receiving the next available free port */
+	if (udp_bind(mcast.pcb, IP_ADDR_ANY, 0) != ERR_OK) {
+		xil_printf("Unable to bind the multicast client\r\n");
+		return -1;
+	}
+	udp_recv(mcast.pcb, (udp_recv_fn) TFTP_mcastRecv, NULL);
+
+	mcast.state = MCAST_REQUEST;
+	mcast.retries = 0;
+	mcast.lastActivity = TFTP_getTimeUs();
+	TFTP_mcastSendRequest();
+
+	return 0;
+}
+
+/*
+ * This function fetches the missing blocks with a unicast transfer,
+ * when the group is silent or the server stops answering the master.
+ * The blocks which are already received are not written again.
+ */
+static void TFTP_mcastFallback(void)
+{
+	xil_printf("TFTP MCAST: Group is silent, fetching the missing blocks by unicast\r\n");
+
+	TFTP_mcastClose();
+	mcast.multicast = 0;
+	mcast.master = 1;
+
+	if (TFTP_mcastConnect())
+		TFTP_mcastAbort();
+}
+
+/*
+ * This function starts downloading the file given in the request file
+ * by multicast. A new boot image is flashed when it is complete.
+ */
+int TFTP_mcastStart(const char *requestFile)
+{
+	char line[TFTP_MCAST_MAX_FNAME_LEN + 32];
+	char *ip, *name;
+	FIL req;
+	UINT len;
+
+	if (mcast.state != MCAST_IDLE) {
+		xil_printf("TFTP MCAST: A transfer is already running\r\n");
+		return -1;
+	}
+
+	if (f_open(&req, requestFile, FA_READ)) {
+		xil_printf("Unable to open file: %s\r\n", requestFile);
+		return -1;
+	}
+	f_read(&req, line, sizeof(line) - 1, &len);
+	f_close(&req);
+	line[len] = '\0';
+
+	ip = strtok(line, " \t\r\n");
+	name = strtok(NULL, " \t\r\n");
+
+	memset(&mcast, 0, sizeof mcast);
+
+	if (!ip || !name || !inet_aton(ip, &mcast.server) || (strlen(name) >= sizeof(mcast.remote))) {
+		xil_printf("TFTP MCAST: Invalid request in %s\r\n", requestFile);
+		return -1;
+	}
+	strcpy(mcast.remote, name);
+
+	/* a new boot image is received into the firmwares folder */
+	if (!strcmp(name, BOOT_FILE_NAME)) {
+		mcast.local = BOOT_FILE_PATH_TEMP;
+		mcast.bootFile = 1;
+		TFTP_workBootFile();
+	}
+	else
+		mcast.local = mcast.remote;
+
+	if (f_open(&mcast.file, mcast.local, FA_CREATE_ALWAYS | FA_WRITE)) {
+		xil_printf("Unable to open file %s for writing\r\n", mcast.local);
+		return -1;
+	}
+	fileCacheInvalidate(mcast.local);
+
+	mcast.multicast = 1;
+	mcast.blksize = DATA_PACKET_MSG_LEN;
+	mcast.firstMissing = 1;
+
+	xil_printf("TFTP MCAST: Requesting %s from %s\r\n", mcast.remote, inet_ntoa(mcast.server));
+
+	if (TFTP_mcastConnect()) {
+		TFTP_mcastAbort();
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function is called from the retransmission timer of the server.
+ * A client which is not master only watches the group; the master
+ * client resends its request or its last ACK when the server is silent.
+ */
+void TFTP_mcastProcessTimers(void)
+{
+	u32 now = TFTP_getTimeUs();
+
+	if (mcast.state == MCAST_IDLE)
+		return;
+
+	if ((mcast.state == MCAST_RECEIVE) && !mcast.master) {
+		if ((s32)(now - mcast.lastActivity) >= TFTP_MCAST_IDLE_US)
+			TFTP_mcastFallback();
+		return;
+	}
+
+	if ((s32)(now - mcast.deadline) < 0)
+		return;
+
+	if (++mcast.retries > TFTP_MAX_RETRIES) {
+		if (mcast.multicast)
+			return TFTP_mcastFallback();
+
+		xil_printf("TFTP MCAST: Server timed out\r\n");
+		return TFTP_mcastAbort();
+	}
+
+	if (mcast.state == MCAST_REQUEST)
+		TFTP_mcastSendRequest();
+	else
+		TFTP_mcastSendACK(mcast.lastAck);
+}
+
+#else
+
+int TFTP_mcastStart(const char *requestFile)
+{
+	xil_printf("TFTP MCAST: LWIP_IGMP must be enabled for multicast transfers\r\n");
+	return -1;
+}
+
+void TFTP_mcastProcessTimers(void)
+{
+}
+
+#endif /* LWIP_IGMP */
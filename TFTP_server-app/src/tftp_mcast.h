@@ -0,0 +1,49 @@
+/*
+ * tftp_mcast.h
+ */
+
+#ifndef SRC_TFTP_MCAST_H_
+#define SRC_TFTP_MCAST_H_
+
+#include "tftp_server.h"
+
+/*
+ * Multicast client (RFC 2090). Uploading a file with this name makes
+ * the board download a file from another TFTP server, together with
+ * all other boards asking for the same file. The request file holds
+ * a single line: "<server ip> <file name>"
+ *
+ * In order to receive multicast packets, LWIP_IGMP must be enabled
+ * ('igmp_options' must be set to 'true' in the BSP settings).
+ */
+#define TFTP_MCAST_REQUEST_FILE		"MCAST.REQ"
+
+/*
+ * Blocks sent to a group are not fragmented, since a lost
+ * fragment would cost the block to every board of the group.
+ */
+#define TFTP_MCAST_BLKSIZE			TFTP_MTU_BLKSIZE
+
+/* longest file name in the request file, terminator included */
+#define TFTP_MCAST_MAX_FNAME_LEN	128
+
+/*
+ * A board which is not the master client waits for the server to make
+ * it master. If the group is silent for this long, the missing blocks
+ * are fetched with a unicast transfer instead.
+ */
+#define TFTP_MCAST_IDLE_US			5000000
+
+/* blocks which can be tracked, block numbers are 16 bits long */
+#define TFTP_MCAST_MAX_BLOCKS		65536
+
+/*
+ * The block numbers of a group do not roll over, since the blocks may
+ * arrive in any order. A file which needs more blocks is refused.
+ */
+#define TFTP_MCAST_LAST_BLOCK		0xFFFF
+
+int TFTP_mcastStart(const char *requestFile);
+void TFTP_mcastProcessTimers(void);
+
+#endif /* SRC_TFTP_MCAST_H_ */
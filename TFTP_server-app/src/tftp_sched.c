@@ -0,0 +1,199 @@
+/*
+ * tftp_sched.c
+ */
+
+#include "tftp_server.h"
+#include "tftp_sched.h"
+
+#include <string.h>
+
+/* every session has a single client, so the table never runs out */
+#define TFTP_SCHED_MAX_CLIENTS		TFTP_MAX_SESSIONS
+
+/* run queues, the priority one is served first */
+typedef struct {
+	tftp_sched_node *head;
+	tftp_sched_node *tail;
+} tftp_run_queue;
+
+static tftp_run_queue runQueues[2];
+
+static tftp_client clients[TFTP_SCHED_MAX_CLIENTS];
+
+/*
+ * This function fills a token bucket for the time passed since its last
+ * use. The loop calls it every few microseconds, so the part of a token
+ * earned meanwhile is kept for the next call instead of being dropped.
+ */
+static void TFTP_bucketRefill(tftp_bucket *bucket, u32 now)
+{
+	u64 earned;
+	s64 tokens;
+
+	if (!bucket->rate)
+		return;
+
+	earned = (u64)(now - bucket->lastUs) * bucket->rate + bucket->fraction;
+	bucket->lastUs = now;
+
+	tokens = bucket->tokens + (s64)(earned / 1000000);
+	bucket->fraction = earned % 1000000;
+
+	if (tokens >= TFTP_SCHED_BURST) {
+		tokens = TFTP_SCHED_BURST;
+		bucket->fraction = 0;
+	}
+
+	bucket->tokens = tokens;
+}
+
+static void TFTP_bucketInit(tftp_bucket *bucket, u32 rate)
+{
+	bucket->rate = rate;
+	bucket->tokens = TFTP_SCHED_BURST;
+	bucket->lastUs = TFTP_getTimeUs();
+	bucket->fraction = 0;
+}
+
+/*
+ * This function checks if a node may send now. A bucket may go into
+ * debt by the last quantum sent, it only has to be positive to send.
+ */
+static int TFTP_schedReady(tftp_sched_node *node, u32 now)
+{
+	if (node->priority)
+		return 1;
+
+	TFTP_bucketRefill(&node->bucket, now);
+	TFTP_bucketRefill(&node->client->bucket, now);
+
+	return ((!node->bucket.rate || (node->bucket.tokens > 0)) &&
+			(!node->client->bucket.rate || (node->client->bucket.tokens > 0)));
+}
+
+void TFTP_schedInit(void)
+{
+	memset(runQueues, 0, sizeof runQueues);
+	memset(clients, 0, sizeof clients);
+}
+
+/*
+ * This function prepares the node of a new session and attaches it
+ * to the token bucket of its client, which is shared by all sessions
+ * of the same address.
+ */
+void TFTP_schedAttach(tftp_sched_node *node, void *owner, u32 addr, u8 priority)
+{
+	tftp_client *client = NULL;
+	int i;
+
+	for (i = 0; i < TFTP_SCHED_MAX_CLIENTS; i++) {
+		if (clients[i].refs && (clients[i].addr == addr)) {
+			client = &clients[i];
+			break;
+		}
+		if (!clients[i].refs && !client)
+			client = &clients[i];
+	}
+
+	if (!client->refs) {
+		client->addr = addr;
+		TFTP_bucketInit(&client->bucket, TFTP_SCHED_CLIENT_RATE);
+	}
+	client->refs++;
+
+	node->next = NULL;
+	node->owner = owner;
+	node->queued = 0;
+	node->priority = priority;
+	node->client = client;
+	TFTP_bucketInit(&node->bucket, TFTP_SCHED_SESSION_RATE);
+}
+
+/* This function removes the node of a closed session from the scheduler */
+void TFTP_schedDetach(tftp_sched_node *node)
+{
+	tftp_run_queue *queue = &runQueues[node->priority ? 1 : 0];
+	tftp_sched_node **link, *prev = NULL;
+
+	if (node->queued) {
+		for (link = &queue->head; *link; prev = *link, link = &(*link)->next) {
+			if (*link == node) {
+				*link = node->next;
+				if (queue->tail == node)
+					queue->tail = prev;
+				break;
+			}
+		}
+		node->queued = 0;
+	}
+
+	if (node->client) {
+		node->client->refs--;
+		node->client = NULL;
+	}
+}
+
+/* This function puts a node at the end of its run queue */
+void TFTP_schedWake(tftp_sched_node *node)
+{
+	tftp_run_queue *queue = &runQueues[node->priority ? 1 : 0];
+
+	if (node->queued)
+		return;
+
+	node->next = NULL;
+	if (queue->tail)
+		queue->tail->next = node;
+	else
+		queue->head = node;
+	queue->tail = node;
+	node->queued = 1;
+}
+
+/*
+ * This function takes the first node of the run queues which may send
+ * now, or returns NULL if there is none. Nodes waiting for their token
+ * buckets keep their places.
+ */
+tftp_sched_node *TFTP_schedNext(void)
+{
+	tftp_run_queue *queue;
+	tftp_sched_node *node, *prev;
+	u32 now = TFTP_getTimeUs();
+	int i;
+
+	for (i = 1; i >= 0; i--) {
+		queue = &runQueues[i];
+
+		for (prev = NULL, node = queue->head; node; prev = node, node = node->next) {
+			if (!TFTP_schedReady(node, now))
+				continue;
+
+			if (prev)
+				prev->next = node->next;
+			else
+				queue->head = node->next;
+			if (queue->tail == node)
+				queue->tail = prev;
+
+			node->next = NULL;
+			node->queued = 0;
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+/* This function takes the bytes sent by a node from its token buckets */
+void TFTP_schedCharge(tftp_sched_node *node, u32 bytes)
+{
+	if (node->priority)
+		return;
+
+	if (node->bucket.rate)
+		node->bucket.tokens -= bytes;
+	if (node->client->bucket.rate)
+		node->client->bucket.tokens -= bytes;
+}
@@ -0,0 +1,74 @@
+/*
+ * tftp_sched.h
+ */
+
+#ifndef SRC_TFTP_SCHED_H_
+#define SRC_TFTP_SCHED_H_
+
+#include "xil_types.h"
+
+/*
+ * Sessions which have something to send (the blocks of an open window
+ * or the ACK of a received window) wait in a run queue. The queue is
+ * served round robin, each session sending at most TFTP_SCHED_QUANTUM
+ * bytes before the next one gets its turn, so a client which ACKs fast
+ * cannot starve the others. Uploads of a new boot image have a queue
+ * of their own, which is always served first and is not rate capped.
+ */
+#define TFTP_SCHED_QUANTUM			(16 * 1024)
+
+/*
+ * Optional rate caps in bytes per second for every session and for
+ * all sessions of a client together, 0 means unlimited. A capped
+ * session waits in the queue until its token bucket is refilled.
+ */
+#ifndef TFTP_SCHED_SESSION_RATE
+#define TFTP_SCHED_SESSION_RATE		0
+#endif
+
+#ifndef TFTP_SCHED_CLIENT_RATE
+#define TFTP_SCHED_CLIENT_RATE		0
+#endif
+
+/* bytes which can be sent at once after a session was idle */
+#define TFTP_SCHED_BURST			(64 * 1024)
+
+typedef struct {
+	u32 rate;
+	s32 tokens;
+	u32 lastUs;
+
+	/* part of a token earned since the last refill, in bytes times microseconds */
+	u32 fraction;
+} tftp_bucket;
+
+typedef struct {
+	u32 addr;
+	u32 refs;
+	tftp_bucket bucket;
+} tftp_client;
+
+typedef struct tftp_sched_node {
+	struct tftp_sched_node *next;
+
+	/* session which owns the node */
+	void *owner;
+
+	/* the node is in a run queue */
+	u8 queued;
+
+	/* the node is in the priority queue */
+	u8 priority;
+
+	tftp_bucket bucket;
+	tftp_client *client;
+} tftp_sched_node;
+
+void TFTP_schedInit(void);
+void TFTP_schedAttach(tftp_sched_node *node, void *owner, u32 addr, u8 priority);
+void TFTP_schedDetach(tftp_sched_node *node);
+void TFTP_schedWake(tftp_sched_node *node);
+tftp_sched_node *TFTP_schedNext(void);
+void TFTP_schedCharge(tftp_sched_node *node, u32 bytes);
+
+#endif /* SRC_TFTP_SCHED_H_ */
@@ -6,299 +6,1984 @@
  */
 
 #include "tftp_server.h"
+#include "tftp_mcast.h"
+#include "tftp_delta.h"
+#include "tftp_lz4.h"
+#include "tftp_flash.h"
+#include "tftp_work.h"
 #include "web_utils.h"
-#include "qspi.h"
 
 #include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "xil_printf.h"
 
 #include "lwip/inet.h"
 #include "lwip/udp.h"
+#include "lwip/sys.h"
 
 extern struct netif server_netif;
-static int checkBootFileFlag = 0;
-static char* filename = "";
 
-static err_t TFTP_sendPacket(struct udp_pcb *pcb, ip_addr_t *addr, int port, char *buf, int buflen)
+/*
+ * Session table. The rings are kept apart from the table, so that
+ * walking the sessions touches only their compact state. They are
+ * aligned to cache lines, since the SD controller reads whole
+ * sectors straight into them.
+ */
+static tftp_arg sessionTable[TFTP_MAX_SESSIONS];
+static char sessionRings[TFTP_MAX_SESSIONS][TFTP_RING_SIZE] __attribute__ ((aligned(64)));
+
+/* unused entries of the session table */
+static tftp_arg *freeSessions = NULL;
+
+#if LWIP_SUPPORT_CUSTOM_PBUF
+/*
+ * Reference of a DATA packet to a part of the ring of its session.
+ * It is a custom pbuf, so it is freed by the GEM driver once the
+ * packet is sent, which happens in the TX interrupt.
+ */
+typedef struct tftp_txref {
+	struct pbuf_custom pc;
+	struct tftp_txref *next;
+	tftp_arg *session;
+	u8 firstSlot;
+	u8 lastSlot;
+} tftp_txref;
+
+static tftp_txref txRefTable[TFTP_MAX_TX_REFS];
+static tftp_txref *freeTxRefs = NULL;
+#endif
+
+/* sessions with an open transfer, walked by the retransmission timer */
+static tftp_arg *sessions = NULL;
+
+/* the same sessions, indexed by their key */
+static tftp_arg *sessionIndex[TFTP_SESSION_HASH_SIZE];
+
+/* a packet of a stalled session is sent, set in the TX interrupt */
+static volatile u8 stalledTxFreed = 0;
+
+static int TFTP_flushRing(tftp_arg *args, int all);
+
+err_t TFTP_sendPacket(struct udp_pcb *pcb, ip_addr_t *addr, int port, char *buf, int buflen)
 {
 	err_t err;
 	struct pbuf *p_buf = pbuf_alloc(PBUF_TRANSPORT, buflen, PBUF_POOL);
 
-	if (!p_buf) {
-		xil_printf("Error allocating pbuf\r\n");
-		return ERR_MEM;
+	if (!p_buf) {
+		xil_printf("Error allocating pbuf\r\n");
+		return ERR_MEM;
+	}
+
+	/* packets larger than a pool buffer are spread over a pbuf chain */
+	pbuf_take(p_buf, buf, buflen);
+
+	/* sending packet */
+	err = udp_sendto(pcb, p_buf, addr, port);
+	if (err != ERR_OK)
+		xil_printf("UDP send error!\r\n");
+
+	/* free pbuf */
+	pbuf_free(p_buf);
+
+	return err;
+}
+
+static int TFTP_sendErrorMsg(struct udp_pcb *pcb, ip_addr_t *ip, int port,
+		TFTP_errCode err, const char *msg)
+{
+	char buf[MAX_ERR_MSG_LEN] = {0};
+	int len;
+
+	setOpCode(buf, TFTP_ERR);
+	setErrCode(buf, err);
+	setErrMsg(buf, msg);
+
+	/* total packet length */
+	len = TFTP_PACKET_HDR_LEN + strlen(msg) + 1;
+
+	return TFTP_sendPacket(pcb, ip, port, buf, len);
+}
+
+int TFTP_sendError(struct udp_pcb *pcb, ip_addr_t *ip, int port, TFTP_errCode err)
+{
+	/* TFTP_errCode error strings */
+	static const char *TFTP_errCodeString[] = {
+			"not defined",
+			"file not found",
+			"access violation",
+			"disk full",
+			"illegal operation",
+			"unknown transfer id",
+			"file already exists",
+			"no such user",
+			"option negotiation failed"
+	};
+
+	return TFTP_sendErrorMsg(pcb, ip, port, err, TFTP_errCodeString[err]);
+}
+
+/*
+ * A block which wraps around the end of a ring is given in two parts,
+ * the second part (wrap) is empty otherwise.
+ */
+static int TFTP_sendDataPacket(struct udp_pcb *pcb, ip_addr_t *ip,
+		int port, int block, char *buf, int buflen, char *wrap, int wrapLen)
+{
+	char header[TFTP_PACKET_HDR_LEN];
+	struct pbuf *p_buf;
+	err_t err;
+
+	p_buf = pbuf_alloc(PBUF_TRANSPORT, buflen + wrapLen + TFTP_PACKET_HDR_LEN, PBUF_POOL);
+	if (!p_buf) {
+		xil_printf("Error allocating pbuf\r\n");
+		return ERR_MEM;
+	}
+
+	setOpCode(header, TFTP_DATA);
+	setBlockValue(header, block);
+
+	/*
+	 * The block is copied straight into the pbuf (chain),
+	 * so the block size is not limited by a staging buffer.
+	 */
+	pbuf_take(p_buf, header, TFTP_PACKET_HDR_LEN);
+	pbuf_take_at(p_buf, buf, buflen, TFTP_PACKET_HDR_LEN);
+	if (wrapLen)
+		pbuf_take_at(p_buf, wrap, wrapLen, TFTP_PACKET_HDR_LEN + buflen);
+
+	err = udp_sendto(pcb, p_buf, ip, port);
+	if (err != ERR_OK)
+		xil_printf("UDP send error!\r\n");
+
+	pbuf_free(p_buf);
+
+	return err;
+}
+
+#if LWIP_SUPPORT_CUSTOM_PBUF
+static void TFTP_freeSession(tftp_arg *conn);
+
+/*
+ * This function is called when a ring reference is freed, normally by
+ * the GEM driver in the TX interrupt, so the shared state is only
+ * changed with the interrupts disabled.
+ */
+static void TFTP_freeTxRef(struct pbuf *p)
+{
+	tftp_txref *ref = (tftp_txref *)p;
+	tftp_arg *args = ref->session;
+	u8 slot;
+	SYS_ARCH_DECL_PROTECT(lev);
+
+	SYS_ARCH_PROTECT(lev);
+
+	for (slot = ref->firstSlot; slot <= ref->lastSlot; slot++)
+		args->txSlotRefs[slot]--;
+
+	/* the session is closed, it can be reused when all packets are sent */
+	if (!--args->txRefs && args->released)
+		TFTP_freeSession(args);
+	else if (args->stalled)
+		stalledTxFreed = 1;
+
+	ref->next = freeTxRefs;
+	freeTxRefs = ref;
+
+	SYS_ARCH_UNPROTECT(lev);
+}
+
+/*
+ * This function creates a PBUF_REF pbuf which points to len bytes of
+ * data of a session, either in its ring or in its file cache entry,
+ * or returns NULL if all references are in use. A part of the ring
+ * must not wrap around it.
+ *
+ * There is no cache maintenance to do here: the GEM driver flushes
+ * the payload of every pbuf it sends (see emacps_sgsend), and holds
+ * the pbuf until its buffer descriptor is done.
+ */
+static struct pbuf *TFTP_refData(tftp_arg *args, char *data, u32 len)
+{
+	tftp_txref *ref;
+	u32 index;
+	u8 slot;
+	SYS_ARCH_DECL_PROTECT(lev);
+
+	SYS_ARCH_PROTECT(lev);
+
+	ref = freeTxRefs;
+	if (ref) {
+		freeTxRefs = ref->next;
+
+		ref->session = args;
+
+		/*
+		 * The cache entry is held by the session until it is freed,
+		 * so only the slots of the ring are counted.
+		 */
+		if (args->cache) {
+			ref->firstSlot = 1;
+			ref->lastSlot = 0;
+		}
+		else {
+			index = data - args->ring;
+			ref->firstSlot = index / TFTP_RING_CHUNK_SIZE;
+			ref->lastSlot = (index + len - 1) / TFTP_RING_CHUNK_SIZE;
+		}
+		for (slot = ref->firstSlot; slot <= ref->lastSlot; slot++)
+			args->txSlotRefs[slot]++;
+		args->txRefs++;
+	}
+
+	SYS_ARCH_UNPROTECT(lev);
+
+	if (!ref)
+		return NULL;
+
+	ref->pc.custom_free_function = TFTP_freeTxRef;
+
+	return pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &ref->pc, data, len);
+}
+#endif
+
+/*
+ * This function sends a block of a session without copying it. The
+ * block is given in two contiguous parts (the second one may be empty),
+ * as it can wrap around the ring or cross a page of the file cache.
+ * The DATA header is put into a small pbuf which is chained to one
+ * PBUF_REF pbuf per part of the block. If no reference is available,
+ * the block is copied instead.
+ */
+static int TFTP_sendBlockRef(struct udp_pcb *pcb, tftp_arg *args, ip_addr_t *ip,
+		int port, int block, char *first, u32 firstLen, char *second, u32 secondLen)
+{
+#if LWIP_SUPPORT_CUSTOM_PBUF
+	struct pbuf *p_buf, *ref;
+	err_t err;
+
+	p_buf = pbuf_alloc(PBUF_TRANSPORT, TFTP_PACKET_HDR_LEN, PBUF_RAM);
+	if (!p_buf) {
+		xil_printf("Error allocating pbuf\r\n");
+		return ERR_MEM;
+	}
+
+	setOpCode(p_buf->payload, TFTP_DATA);
+	setBlockValue(p_buf->payload, block);
+
+	if (firstLen) {
+		ref = TFTP_refData(args, first, firstLen);
+		if (!ref)
+			goto copy;
+		pbuf_cat(p_buf, ref);
+	}
+
+	if (secondLen) {
+		ref = TFTP_refData(args, second, secondLen);
+		if (!ref)
+			goto copy;
+		pbuf_cat(p_buf, ref);
+	}
+
+	err = udp_sendto(pcb, p_buf, ip, port);
+	if (err != ERR_OK)
+		xil_printf("UDP send error!\r\n");
+
+	pbuf_free(p_buf);
+
+	return err;
+
+copy:
+	/* freeing the header gives back the reference taken so far */
+	pbuf_free(p_buf);
+#endif
+
+	return TFTP_sendDataPacket(pcb, ip, port, block, first, firstLen, second, secondLen);
+}
+
+int TFTP_sendACK(struct udp_pcb *pcb, ip_addr_t *ip, int port, int block)
+{
+	char packet[MAX_ACK_LEN] = {0};
+
+	setOpCode(packet, TFTP_ACK);
+	setBlockValue(packet, block);
+
+	return TFTP_sendPacket(pcb, ip, port, packet, MAX_ACK_LEN);
+}
+
+/* Appends a "name\0value\0" pair to an OACK packet and returns its length */
+static int TFTP_appendOption(char *buf, const char *name, u32 value)
+{
+	int len;
+
+	strcpy(buf, name);
+	len = strlen(name) + 1;
+	len += sprintf(buf + len, "%lu", (unsigned long)value) + 1;
+
+	return len;
+}
+
+static int TFTP_sendOACK(struct udp_pcb *pcb, ip_addr_t *ip, int port, tftp_options *opts)
+{
+	char packet[MAX_MSG_LEN] = {0};
+	int len = OPTION_OFFSET;
+
+	setOpCode(packet, TFTP_OACK);
+
+	if (opts->accepted & TFTP_OPT_BLKSIZE)
+		len += TFTP_appendOption(packet + len, "blksize", opts->blksize);
+	if (opts->accepted & TFTP_OPT_WINDOWSIZE)
+		len += TFTP_appendOption(packet + len, "windowsize", opts->windowsize);
+	if (opts->accepted & TFTP_OPT_TSIZE)
+		len += TFTP_appendOption(packet + len, "tsize", opts->tsize);
+	if (opts->accepted & TFTP_OPT_TIMEOUT)
+		len += TFTP_appendOption(packet + len, "timeout", opts->timeout);
+	if (opts->accepted & TFTP_OPT_ROLLOVER)
+		len += TFTP_appendOption(packet + len, "rollover", opts->rollover);
+	/* the checksum only qualifies the offset, so it is not sent back */
+	if (opts->accepted & TFTP_OPT_OFFSET)
+		len += TFTP_appendOption(packet + len, "offset", opts->offset);
+
+	return TFTP_sendPacket(pcb, ip, port, packet, len);
+}
+
+/*
+ * This function parses the RFC 2347 option list following the mode
+ * string of a request. Unknown options are silently ignored and
+ * only the accepted ones will be acknowledged with an OACK.
+ */
+static void TFTP_parseOptions(char *opt, char *end, tftp_options *opts,
+		u16 maxBlksize, u16 maxWindowsize)
+{
+	char *value;
+	u32 num;
+
+	opts->accepted = 0;
+	opts->blksize = DATA_PACKET_MSG_LEN;
+	opts->windowsize = 1;
+	opts->tsize = 0;
+	opts->timeout = 0;
+	opts->rollover = 0;
+	opts->offset = 0;
+	opts->crc32 = 0;
+
+	while (opt < end) {
+		value = opt + strlen(opt) + 1;
+		if (value >= end)
+			break;
+
+		num = strtoul(value, NULL, 10);
+
+		if (!strcasecmp(opt, "blksize") && (num >= TFTP_MIN_BLKSIZE)) {
+			/* RFC 2348 allows the server to answer with a smaller block size */
+			opts->blksize = (num > maxBlksize) ? maxBlksize : num;
+			opts->accepted |= TFTP_OPT_BLKSIZE;
+		}
+		else if (!strcasecmp(opt, "windowsize") && (num >= 1)) {
+			opts->windowsize = (num > maxWindowsize) ? maxWindowsize : num;
+			opts->accepted |= TFTP_OPT_WINDOWSIZE;
+		}
+		else if (!strcasecmp(opt, "tsize")) {
+			/* the size of a read request is filled in when the file is opened */
+			opts->tsize = num;
+			opts->accepted |= TFTP_OPT_TSIZE;
+		}
+		else if (!strcasecmp(opt, "timeout") && (num >= 1) && (num <= 255)) {
+			opts->timeout = num;
+			opts->accepted |= TFTP_OPT_TIMEOUT;
+		}
+		else if (!strcasecmp(opt, "rollover") && (num <= 1)) {
+			opts->rollover = num;
+			opts->accepted |= TFTP_OPT_ROLLOVER;
+		}
+		else if (!strcasecmp(opt, "offset")) {
+			/* checked against the file when it is opened */
+			opts->offset = num;
+			opts->accepted |= TFTP_OPT_OFFSET;
+		}
+		else if (!strcasecmp(opt, "crc32")) {
+			/* a checksum is usually written in hex */
+			opts->crc32 = strtoul(value, NULL, 0);
+			opts->accepted |= TFTP_OPT_CRC32;
+		}
+
+		opt = value + strlen(value) + 1;
+	}
+}
+
+/*
+ * This function returns the block number on the wire of a block.
+ * After block 65535 the numbers roll over to 0, or to 1 if the client
+ * asked for it with the rollover option.
+ */
+static u16 TFTP_wireBlock(tftp_arg *args, u32 block)
+{
+	if (block <= 0xFFFF)
+		return block;
+
+	if (args->opts.rollover)
+		return ((block - 0x10000) % 0xFFFF) + 1;
+
+	return block & 0xFFFF;
+}
+
+/* (Re)starts the retransmission timer of a session */
+static void TFTP_armTimer(tftp_arg *args)
+{
+	args->deadline = TFTP_getTimeUs() + args->rto;
+	args->timerArmed = 1;
+}
+
+/*
+ * This function updates the RTO of a session with a new round trip
+ * time sample, as described in RFC 6298. A timeout which is fixed
+ * by the client with the timeout option is not changed.
+ */
+static void TFTP_updateRto(tftp_arg *args, u32 rtt)
+{
+	u32 delta;
+
+	TFTP_statsAck(&args->stats, rtt);
+
+	if (args->opts.accepted & TFTP_OPT_TIMEOUT)
+		return;
+
+	if (!rtt)
+		rtt = 1;
+
+	if (!args->srtt) {
+		args->srtt = rtt;
+		args->rttvar = rtt / 2;
+	}
+	else {
+		delta = (args->srtt > rtt) ? (args->srtt - rtt) : (rtt - args->srtt);
+		args->rttvar = (3 * args->rttvar + delta) / 4;
+		args->srtt = (7 * args->srtt + rtt) / 8;
+	}
+
+	args->rto = args->srtt + 4 * args->rttvar;
+	if (args->rto < TFTP_MIN_RTO_US)
+		args->rto = TFTP_MIN_RTO_US;
+	else if (args->rto > TFTP_MAX_RTO_US)
+		args->rto = TFTP_MAX_RTO_US;
+}
+
+/*
+ * This function puts all entries of the session table,
+ * and all ring references, on their free lists.
+ */
+static void TFTP_initSessionTable(void)
+{
+	int i;
+
+	freeSessions = NULL;
+	sessions = NULL;
+	memset(sessionIndex, 0, sizeof sessionIndex);
+
+	for (i = TFTP_MAX_SESSIONS - 1; i >= 0; i--) {
+		sessionTable[i].next = freeSessions;
+		freeSessions = &sessionTable[i];
+	}
+
+#if LWIP_SUPPORT_CUSTOM_PBUF
+	freeTxRefs = NULL;
+	for (i = TFTP_MAX_TX_REFS - 1; i >= 0; i--) {
+		txRefTable[i].next = freeTxRefs;
+		freeTxRefs = &txRefTable[i];
+	}
+#endif
+}
+
+/*
+ * This function takes an entry from the session table and clears it.
+ * It returns NULL if all sessions are in use.
+ */
+static tftp_arg *TFTP_allocSession(void)
+{
+	tftp_arg *conn;
+	SYS_ARCH_DECL_PROTECT(lev);
+
+	SYS_ARCH_PROTECT(lev);
+	conn = freeSessions;
+	if (conn)
+		freeSessions = conn->next;
+	SYS_ARCH_UNPROTECT(lev);
+
+	if (!conn)
+		return NULL;
+
+	memset(conn, 0, sizeof *conn);
+	conn->ring = sessionRings[conn - sessionTable];
+
+	return conn;
+}
+
+/*
+ * This function gives an entry back to the session table. It is also
+ * called from the TX interrupt, so the caller disables the interrupts.
+ */
+static void TFTP_freeSession(tftp_arg *conn)
+{
+	fileCacheRelease(conn->cache);
+	conn->cache = NULL;
+
+	conn->next = freeSessions;
+	freeSessions = conn;
+}
+
+/*
+ * This function calculates the key of a request (FNV-1a hash of
+ * the client address and port, the opcode and the file name).
+ */
+static u32 TFTP_sessionKey(ip_addr_t *ip, u16 port, TFTP_opCode op, const char *fname)
+{
+	u32 addr = ip4_addr_get_u32(ip_2_ip4(ip));
+	u32 key = 2166136261u;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		key = (key ^ ((addr >> (i * 8)) & 0xFF)) * 16777619u;
+	key = (key ^ (port & 0xFF)) * 16777619u;
+	key = (key ^ (port >> 8)) * 16777619u;
+	key = (key ^ op) * 16777619u;
+
+	while (*fname)
+		key = (key ^ (u8)*fname++) * 16777619u;
+
+	return key;
+}
+
+/* This function returns the active session of a request, or NULL */
+static tftp_arg *TFTP_findSession(ip_addr_t *ip, u16 port, TFTP_opCode op, u32 key)
+{
+	tftp_arg *conn;
+
+	for (conn = sessionIndex[key & (TFTP_SESSION_HASH_SIZE - 1)]; conn; conn = conn->hashNext) {
+		if ((conn->key == key) && (conn->port == port) &&
+			(conn->op == op) && ip_addr_cmp(&conn->ip, ip))
+			return conn;
+	}
+
+	return NULL;
+}
+
+/*
+ * This function initializes the common state of a new session, whose
+ * file is already opened, and adds it to the list of active sessions.
+ */
+static void TFTP_initSession(tftp_arg *conn, TFTP_opCode op, struct udp_pcb *pcb,
+		ip_addr_t *ip, u16 port, const char *fname, tftp_options *opts, u32 key)
+{
+	tftp_arg **bucket = &sessionIndex[key & (TFTP_SESSION_HASH_SIZE - 1)];
+
+	conn->op = op;
+	conn->pcb = pcb;
+	conn->ip = *ip;
+	conn->port = port;
+	conn->opts = *opts;
+	strcpy(conn->fname, fname);
+
+	/*
+	 * The ring is accessed in clusters, unless they are larger than a chunk.
+	 * A file served from the file cache may not be opened at all.
+	 */
+	if (conn->file.obj.fs)
+		conn->chunkSize = (u32)conn->file.obj.fs->csize * FF_MAX_SS;
+	else
+		conn->chunkSize = TFTP_RING_CHUNK_SIZE;
+	if (conn->chunkSize > TFTP_RING_CHUNK_SIZE)
+		conn->chunkSize = TFTP_RING_CHUNK_SIZE;
+
+	if (opts->accepted & TFTP_OPT_TIMEOUT)
+		conn->rto = opts->timeout * 1000000;
+	else
+		conn->rto = TFTP_INITIAL_RTO_US;
+
+	conn->prev = NULL;
+	conn->next = sessions;
+	if (sessions)
+		sessions->prev = conn;
+	sessions = conn;
+
+	conn->key = key;
+	conn->hashNext = *bucket;
+	*bucket = conn;
+
+	TFTP_statsStart(&conn->stats);
+
+	/* a new boot image is received before anything else */
+	TFTP_schedAttach(&conn->sched, conn, ip4_addr_get_u32(ip_2_ip4(ip)), conn->bootFile);
+}
+
+static void TFTP_cleanup(struct udp_pcb *pcb, tftp_arg *args)
+{
+	tftp_arg **link;
+	SYS_ARCH_DECL_PROTECT(lev);
+
+	/* removing the session from the list of active sessions */
+	if (args->prev)
+		args->prev->next = args->next;
+	else
+		sessions = args->next;
+	if (args->next)
+		args->next->prev = args->prev;
+
+	for (link = &sessionIndex[args->key & (TFTP_SESSION_HASH_SIZE - 1)]; *link; link = &(*link)->hashNext) {
+		if (*link == args) {
+			*link = args->hashNext;
+			break;
+		}
+	}
+
+	/* the delivered part of the file */
+	if (args->op == TFTP_RRQ) {
+		args->stats.blocks = args->lastAcked;
+		if (((u64)args->lastAcked * args->opts.blksize) < (args->fileSize - args->opts.offset))
+			args->stats.bytes = args->lastAcked * args->opts.blksize;
+		else
+			args->stats.bytes = args->fileSize - args->opts.offset;
+	}
+	else {
+		args->stats.blocks = args->block;
+		args->stats.bytes = args->ringEnd - args->opts.offset;
+	}
+	TFTP_statsFinish(&args->stats, args->fname, args->op == TFTP_WRQ);
+	TFTP_schedDetach(&args->sched);
+
+	/* the server is idle again */
+	if (!sessions)
+		TFTP_statsPrintTotals();
+
+	/*
+	 * The received part of an interrupted upload is written to its
+	 * temporary file, so that the client can resume it from there.
+	 */
+	if ((args->op == TFTP_WRQ) && !args->stats.completed && !args->verifying && !args->decoding) {
+		while (TFTP_flushRing(args, 1) > 0)
+			;
+	}
+
+	if (args->filter) {
+		TFTP_filterClose(args->filter);
+		args->filter = NULL;
+	}
+
+	/*
+	 * An upload which ends before its announced tsize
+	 * gives back the clusters preallocated for the rest.
+	 */
+	if ((args->file.flag & FA_WRITE) && (f_tell(&args->file) < f_size(&args->file)))
+		f_truncate(&args->file);
+
+	/* cleaning up the args */
+	if (args->file.obj.fs)
+		f_close(&args->file);
+
+	/* DATA packets still in flight keep the ring of the session in use */
+	SYS_ARCH_PROTECT(lev);
+	if (args->txRefs)
+		args->released = 1;
+	else
+		TFTP_freeSession(args);
+	SYS_ARCH_UNPROTECT(lev);
+
+	/* closing the connection */
+	udp_remove(pcb);
+}
+
+/*
+ * This function is called when the retransmission timer of a session
+ * expires. It doubles the RTO (unless it is fixed by the client) and
+ * returns 0 if the session may retransmit, or -1 if the session ran
+ * out of retries and is closed.
+ */
+static int TFTP_backoff(tftp_arg *args)
+{
+	args->stats.timeouts++;
+
+	if (++args->retries > TFTP_MAX_RETRIES) {
+		xil_printf("TFTP %s: Session timed out, closing connection\r\n",
+				(args->op == TFTP_RRQ) ? "RRQ" : "WRQ");
+		TFTP_sendError(args->pcb, &args->ip, args->port, ERR_NOT_DEFINED);
+		TFTP_cleanup(args->pcb, args);
+		return -1;
+	}
+
+	if (!(args->opts.accepted & TFTP_OPT_TIMEOUT)) {
+		args->rto *= 2;
+		if (args->rto > TFTP_MAX_RTO_US)
+			args->rto = TFTP_MAX_RTO_US;
+	}
+
+	/* a block sent again cannot be timed (Karn's algorithm) */
+	args->rttPending = 0;
+
+	return 0;
+}
+
+/*
+ * This function reads the next chunk of the file into the read-ahead
+ * ring of a session. The chunks are cluster-sized and aligned, so
+ * FatFs reads each of them with a single multi-sector access straight
+ * into the ring, and a chunk never wraps around the end of the ring.
+ *
+ * If the file is being cached, the chunks are read into the pages of
+ * its cache entry instead, which hold the whole file. Pages are a
+ * multiple of the chunk size, so a chunk never crosses a page either.
+ *
+ * Returns 1 if a chunk is read, 0 if the whole file is read, the ring
+ * is full or the chunk is still in use and -1 on a file error.
+ */
+static int TFTP_fillRing(tftp_arg *args)
+{
+	FRESULT Res = FR_OK;
+	char *buf;
+	u32 avail, start;
+	UINT len;
+
+	if (args->ringEnd >= args->fileSize)
+		return 0;
+
+	if (args->cache)
+		buf = fileCacheData(&args->cacheFill, args->ringEnd, &avail);
+	else {
+		if ((args->ringEnd + args->chunkSize - args->ringStart) > TFTP_RING_SIZE)
+			return 0;
+
+		/* the chunk to be filled again is still being sent by the GEM */
+		if (args->txSlotRefs[(args->ringEnd % TFTP_RING_SIZE) / TFTP_RING_CHUNK_SIZE])
+			return 0;
+
+		buf = args->ring + (args->ringEnd % TFTP_RING_SIZE);
+	}
+
+	start = TFTP_getTimeUs();
+	if (f_tell(&args->file) != args->ringEnd)
+		Res = f_lseek(&args->file, args->ringEnd);
+	if (!Res)
+		Res = f_read(&args->file, buf, args->chunkSize, &len);
+	TFTP_statsIo(&args->stats, TFTP_getTimeUs() - start);
+	if (Res || !len)
+		return -1;
+
+	args->ringEnd += len;
+
+	/* the whole file is in the cache, so the next requests are served from it */
+	if (args->cache && (args->ringEnd >= args->fileSize))
+		fileCacheComplete(args->cache);
+
+	return 1;
+}
+
+/*
+ * This function gives the chunks which only hold acknowledged
+ * blocks back to the ring, so they can be filled again.
+ */
+static void TFTP_releaseRing(tftp_arg *args)
+{
+	u64 acked = args->opts.offset + (u64)args->lastAcked * args->opts.blksize;
+
+	/* the chunks of a cache entry are never filled again */
+	if (args->cache)
+		return;
+
+	acked -= acked % args->chunkSize;
+	if ((acked > args->ringStart) && (acked <= args->ringEnd))
+		args->ringStart = acked;
+}
+
+/*
+ * This function sends the block with the given number from the
+ * read-ahead ring. Blocks are addressed by their offset in the file,
+ * which starts from the offset option of a resumed download, so the
+ * window can be rewound to any block which is not acknowledged yet.
+ * Normally the ring is already filled in the idle time of the main
+ * loop, otherwise the missing chunks are read right here.
+ *
+ * Returns 0 if the block is sent, 1 if it could not be sent right now
+ * and -1 if the connection is closed due to a file error.
+ */
+static int TFTP_sendBlock(struct udp_pcb *pcb, tftp_arg *args, ip_addr_t *ip, u16 port, u32 block)
+{
+	u64 offset = args->opts.offset + (u64)(block - 1) * args->opts.blksize;
+	u64 size = args->fileSize;
+	char *first, *second = NULL;
+	u32 firstLen, secondLen;
+	u32 index, avail, len = 0;
+	int ret;
+
+	if (offset < size)
+		len = ((size - offset) < args->opts.blksize) ? (size - offset) : args->opts.blksize;
+
+	/* the block is not covered by the ring, so the ring starts over from it */
+	if (!args->cache &&
+		((offset < args->ringStart) || ((offset + len) > (args->ringStart + TFTP_RING_SIZE)))) {
+		args->ringStart = offset - (offset % args->chunkSize);
+		args->ringEnd = args->ringStart;
+	}
+
+	while (args->ringEnd < (offset + len)) {
+		ret = TFTP_fillRing(args);
+		if (ret < 0) {
+			xil_printf("Closing connection! Unable to read %s\r\n", args->fname);
+			TFTP_cleanup(pcb, args);
+			return -1;
+		}
+
+		/* the chunk is still being sent, the block goes with the next window */
+		if (!ret)
+			return 1;
+	}
+
+	/* a short (or empty) block marks the end of the file */
+	if (len < args->opts.blksize) {
+		args->lastBlock = block;
+		args->eof = 1;
+	}
+
+	/* finding the parts of the block, in the cache entry or in the ring */
+	if (args->cache) {
+		first = NULL;
+		firstLen = 0;
+		if (len)
+			first = fileCacheData(&args->cacheSend, offset, &firstLen);
+		if (firstLen > len)
+			firstLen = len;
+		secondLen = len - firstLen;
+		if (secondLen)
+			second = fileCacheData(&args->cacheSend, offset + firstLen, &avail);
+	}
+	else {
+		index = offset % TFTP_RING_SIZE;
+		firstLen = ((TFTP_RING_SIZE - index) < len) ? (TFTP_RING_SIZE - index) : len;
+		first = args->ring + index;
+		secondLen = len - firstLen;
+		second = args->ring;
+	}
+
+	/* sending the data */
+	if (TFTP_sendBlockRef(pcb, args, ip, port, TFTP_wireBlock(args, block),
+			first, firstLen, second, secondLen) != ERR_OK)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * This function checks if the current window has blocks left to send,
+ * that is, less than windowsize blocks are waiting for an ACK and the
+ * last block of the file is not sent yet.
+ */
+static int TFTP_windowOpen(tftp_arg *args)
+{
+	if (args->eof && (args->block > args->lastBlock))
+		return 0;
+
+	return (args->block - args->lastAcked) <= args->opts.windowsize;
+}
+
+/*
+ * This function sends the blocks of the current window, starting from
+ * the next block, until the window is closed or budget bytes are sent.
+ * It returns the number of bytes sent, or -1 if the connection is closed.
+ */
+static int TFTP_sendWindow(struct udp_pcb *pcb, tftp_arg *args, ip_addr_t *ip, u16 port,
+		u32 budget)
+{
+	u32 sent = 0;
+	int ret;
+
+	while (TFTP_windowOpen(args) && (sent < budget)) {
+		/*
+		 * If the block could not be queued (e.g. out of pbufs),
+		 * it will be sent again with the next window.
+		 */
+		ret = TFTP_sendBlock(pcb, args, ip, port, args->block);
+		if (ret < 0)
+			return -1;
+		if (ret)
+			break;
+
+		if (args->block < args->sendMax)
+			args->stats.retransmits++;
+		else if (args->block == args->sendMax) {
+			/* only blocks which are sent once are timed (Karn's algorithm) */
+			if (!args->rttPending) {
+				args->rttPending = 1;
+				args->rttBlock = args->block;
+				args->rttStart = TFTP_getTimeUs();
+			}
+			args->sendMax++;
+		}
+
+		args->block++;
+		sent += args->opts.blksize;
+	}
+
+	TFTP_armTimer(args);
+
+	return sent;
+}
+
+static void TFTP_readReqRecvCallback(void *_args, struct udp_pcb *upcb,
+		struct pbuf *p_buf, ip_addr_t *addr, u16 port)
+{
+	tftp_arg *args = (tftp_arg *)_args;
+	u32 ack;
+	u16 wire;
+
+	if (p_buf->len < TFTP_PACKET_HDR_LEN) {
+		pbuf_free(p_buf);
+		return;
+	}
+
+	if (getOpCode(p_buf->payload) == TFTP_ERR) {
+		xil_printf("TFTP RRQ: Transfer aborted by client [%d]\r\n", getErrCode(p_buf->payload));
+		pbuf_free(p_buf);
+		return TFTP_cleanup(upcb, args);
+	}
+
+	if (getOpCode(p_buf->payload) != TFTP_ACK) {
+		pbuf_free(p_buf);
+		return;
+	}
+
+	wire = getBlockValue(p_buf->payload);
+	pbuf_free(p_buf);
+
+	/*
+	 * Only the last acknowledged block and the blocks sent after it
+	 * can be acknowledged, anything else is a stray packet. There are
+	 * at most windowsize of them, so the block is simply looked up.
+	 * The blocks sent before a timeout rewound the window count too,
+	 * their ACKs may still be on the way.
+	 */
+	for (ack = args->lastAcked; ack < args->sendMax; ack++) {
+		if (TFTP_wireBlock(args, ack) == wire)
+			break;
+	}
+	if (ack == args->sendMax) {
+		/* an ACK of an earlier window which arrives late is a duplicate too */
+		ack = args->lastAcked;
+		while (ack && ((args->lastAcked - ack) < args->opts.windowsize)) {
+			if (TFTP_wireBlock(args, --ack) == wire) {
+				args->stats.duplicates++;
+				return;
+			}
+		}
+
+		xil_printf("TFTP RRQ: Unexpected ACK %d received, ignoring...\r\n", wire);
+		return;
+	}
+
+	/*
+	 * A repeated ACK is never answered, only the retransmission timer
+	 * resends blocks. Otherwise a delayed packet would make both sides
+	 * send every following block twice (Sorcerer's Apprentice Syndrome).
+	 * The ACK of the OACK comes before any block is sent.
+	 */
+	if ((ack == args->lastAcked) && (args->sendMax != 1)) {
+		args->stats.duplicates++;
+		return;
+	}
+
+	if (ack != args->lastAcked) {
+		/* the transfer made progress, so the retries start over */
+		args->retries = 0;
+
+		if (args->rttPending && (args->rttBlock <= ack)) {
+			TFTP_updateRto(args, TFTP_getTimeUs() - args->rttStart);
+			args->rttPending = 0;
+		}
+	}
+
+	args->lastAcked = ack;
+	TFTP_releaseRing(args);
+
+	/* a late ACK of a block sent before the rewind saves resending it */
+	if (ack >= args->block)
+		args->block = ack + 1;
+
+	/*
+	 * if the block carrying the end of the file is acknowledged,
+	 * then the whole file is sent so program can quit
+	 */
+	if (args->eof && (ack == args->lastBlock)) {
+		xil_printf("TFTP RRQ: Transfer completed!\r\n\n");
+		args->stats.completed = 1;
+		return TFTP_cleanup(upcb, args);
+	}
+
+	/*
+	 * An ACK for a block before the last one sent means that
+	 * the client missed the block after it, so the window is
+	 * rewound and the transfer continues from there.
+	 */
+	if (ack != (args->block - 1)) {
+		xil_printf("TFTP RRQ: Incorrect ACK received, resending from block %lu...\r\n", ack + 1);
+		args->block = ack + 1;
+		args->rttPending = 0;
+	}
+
+	/* the window is sent when the session gets its turn */
+	TFTP_schedWake(&args->sched);
+}
+
+static int TFTP_readProcess(struct udp_pcb *pcb, ip_addr_t *ip, int port, char *fname,
+		tftp_options *opts, u32 key)
+{
+	tftp_arg *conn;
+	FILINFO info;
+	FRESULT Res;
+
+	conn = TFTP_allocSession();
+	if (!conn) {
+		xil_printf("No free TFTP session!\r\n");
+		TFTP_sendErrorMsg(pcb, ip, port, ERR_NOT_DEFINED, "server busy");
+		TFTP_statsRejected();
+		udp_remove(pcb);
+		return -1;
+	}
+
+	/*
+	 * A file which is in the file cache, with the same size and
+	 * modification time, is sent from there without opening it.
+	 * Otherwise the file is opened and, if there is room, it is
+	 * read into a new cache entry while it is being sent.
+	 */
+	Res = f_stat(fname, &info);
+	if (!Res) {
+		/*
+		 * An offset beyond the end of the file does not belong to
+		 * this file, so the option is refused and the whole file is sent.
+		 */
+		if ((opts->accepted & TFTP_OPT_OFFSET) && (opts->offset > info.fsize)) {
+			opts->accepted &= ~(TFTP_OPT_OFFSET | TFTP_OPT_CRC32);
+			opts->offset = 0;
+		}
+
+		/* a resumed download does not read the file from its start to fill an entry */
+		conn->cache = fileCacheLookup(fname, &info);
+		if (!conn->cache) {
+			Res = f_open(&conn->file, fname, FA_READ);
+			if (!Res && !opts->offset)
+				conn->cache = fileCacheCreate(fname, &info);
+		}
+	}
+	if (Res) {
+		xil_printf("Unable to open file: %s\r\n", fname);
+		TFTP_sendError(pcb, ip, port, ERR_FILE_NOT_FOUND);
+		udp_remove(pcb);
+		TFTP_freeSession(conn);
+		return -1;
+	}
+
+	TFTP_initSession(conn, TFTP_RRQ, pcb, ip, port, fname, opts, key);
+	conn->fileSize = info.fsize;
+	conn->opts.tsize = info.fsize;
+
+	/* the ring starts from the chunk holding the offset, so reads stay aligned */
+	if (conn->opts.offset) {
+		xil_printf("TFTP RRQ: Resuming %s from byte %lu\r\n", fname, conn->opts.offset);
+		conn->ringStart = conn->opts.offset - (conn->opts.offset % conn->chunkSize);
+		conn->ringEnd = conn->ringStart;
+	}
+
+	if (conn->cache) {
+		fileCacheInitCursor(&conn->cacheFill, conn->cache);
+		fileCacheInitCursor(&conn->cacheSend, conn->cache);
+
+		if (!conn->file.obj.fs) {
+			xil_printf("TFTP RRQ: Sending %s from the file cache\r\n", fname);
+			conn->ringEnd = conn->fileSize;
+		}
+	}
+
+	conn->block = 1;
+	conn->sendMax = 1;
+
+	/* setting callback for receiving operations on this pcb */
+	udp_recv(pcb, (udp_recv_fn) TFTP_readReqRecvCallback, conn);
+
+	/*
+	 * If any option is sent back, the transaction starts with an OACK
+	 * and the first window will be sent when the client answers with ACK 0.
+	 */
+	if (opts->accepted & TFTP_OPT_ECHOED) {
+		TFTP_sendOACK(pcb, ip, port, &conn->opts);
+		TFTP_armTimer(conn);
+		return 0;
+	}
+
+	/*
+	 * initiating the transaction by sending the first window of data.
+	 * further windows will be sent when ACKs are received.
+	 */
+	TFTP_schedWake(&conn->sched);
+
+	return 0;
+}
+
+/*
+ * This function builds the name of the temporary file an upload is
+ * received into, by putting TFTP_TEMP_PREFIX before the name of the
+ * file in its folder. Returns -1 if the name gets too long.
+ */
+static int TFTP_tempName(const char *fname, char *temp)
+{
+	const char *base = strrchr(fname, '/');
+	u32 dirLen = base ? (base + 1 - fname) : 0;
+
+	if ((strlen(fname) + sizeof(TFTP_TEMP_PREFIX)) > TFTP_MAX_FNAME_LEN)
+		return -1;
+
+	memcpy(temp, fname, dirLen);
+	strcpy(temp + dirLen, TFTP_TEMP_PREFIX);
+	strcat(temp, fname + dirLen);
+
+	return 0;
+}
+
+/*
+ * This function writes the received data of an upload from the ring
+ * to the file. The ring is written in cluster-sized chunks, which are
+ * aligned in the file, so FatFs writes each of them with a single
+ * multi-sector access. A partial chunk is only written if all is set,
+ * at the end of the upload. A resumed upload starts in the middle of a
+ * chunk, so its first write only goes up to the end of that chunk.
+ *
+ * If the upload has filters, the chunks are passed to them instead.
+ * They may take a part of a chunk, the rest is passed on the next call.
+ *
+ * Returns 1 if data is written, 0 if there is nothing to write
+ * and -1 on a file error.
+ */
+static int TFTP_flushRing(tftp_arg *args, int all)
+{
+	u32 len = args->ringEnd - args->ringStart;
+	u32 chunk = args->chunkSize - (args->ringStart % args->chunkSize);
+	u32 start = TFTP_getTimeUs();
+	FRESULT Res;
+	UINT written;
+	int ret;
+
+	if (len >= chunk)
+		len = chunk;
+	else if (!all || !len)
+		return 0;
+
+	if (args->filter) {
+		ret = TFTP_filterWrite(args->filter, args->ring + (args->ringStart % TFTP_RING_SIZE), len);
+		TFTP_statsIo(&args->stats, TFTP_getTimeUs() - start);
+		if (ret < 0)
+			return -1;
+
+		args->ringStart += ret;
+		return 1;
+	}
+
+	Res = f_write(&args->file, args->ring + (args->ringStart % TFTP_RING_SIZE), len, &written);
+	TFTP_statsIo(&args->stats, TFTP_getTimeUs() - start);
+	if (Res || (written != len))
+		return -1;
+
+	args->ringStart += len;
+
+	return 1;
+}
+
+/*
+ * This function copies the payload of a DATA packet into the
+ * write-behind ring of an upload, so that it can be acknowledged
+ * without waiting for the SD card. Full chunks are normally written
+ * in the idle time of the main loop; if the ring is full, they are
+ * written right here. Returns 0 on success and -1 on a file error.
+ *
+ * Large blocks arrive as a chain of reassembled IP fragments. Every
+ * segment of the chain is copied straight to its place in the ring,
+ * so the block is never linearized on its way.
+ */
+static int TFTP_storeBlock(tftp_arg *args, struct pbuf *p_buf, u32 len)
+{
+	struct pbuf *q;
+	u32 skip = TFTP_PACKET_HDR_LEN;
+	u32 segLen, index, part;
+	char *seg;
+
+	while ((args->ringEnd + len - args->ringStart) > TFTP_RING_SIZE) {
+		if (TFTP_flushRing(args, 0) <= 0)
+			return -1;
+	}
+
+	for (q = p_buf; q && len; q = q->next) {
+		/* the TFTP header may span more than one segment */
+		if (skip >= q->len) {
+			skip -= q->len;
+			continue;
+		}
+
+		seg = (char *)q->payload + skip;
+		segLen = q->len - skip;
+		skip = 0;
+		if (segLen > len)
+			segLen = len;
+		len -= segLen;
+
+		/* a segment is split where it wraps around the end of the ring */
+		while (segLen) {
+			index = args->ringEnd % TFTP_RING_SIZE;
+			part = ((TFTP_RING_SIZE - index) < segLen) ? (TFTP_RING_SIZE - index) : segLen;
+
+			memcpy(args->ring + index, seg, part);
+			args->ringEnd += part;
+			seg += part;
+			segLen -= part;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * This function acknowledges the blocks of an upload received so far.
+ * The time until the first block of the next window arrives is the
+ * round trip time of the ACK.
+ */
+static void TFTP_sendWindowAck(tftp_arg *args)
+{
+	TFTP_sendACK(args->pcb, &args->ip, args->port, TFTP_wireBlock(args, args->block));
+	args->lastAcked = args->block;
+	args->ackPending = 0;
+
+	if (!args->rttPending) {
+		args->rttPending = 1;
+		args->rttBlock = args->block + 1;
+		args->rttStart = TFTP_getTimeUs();
+	}
+}
+
+static void TFTP_writeReqRecvCallback(void *_args, struct udp_pcb *upcb,
+		struct pbuf *p_buf, ip_addr_t *addr, u16 port)
+{
+	ip_addr_t ip = *addr;
+	tftp_arg *args = (tftp_arg *)_args;
+	char header[TFTP_PACKET_HDR_LEN];
+	int dataLen, ret;
+	u16 block;
+
+	/*
+	 * The packet may be a chain of pbufs, so only the header
+	 * is copied out of it, the data is taken from the chain.
+	 */
+	if (pbuf_copy_partial(p_buf, header, TFTP_PACKET_HDR_LEN, 0) < TFTP_PACKET_HDR_LEN) {
+		pbuf_free(p_buf);
+		return;
+	}
+
+	if (getOpCode(header) == TFTP_ERR) {
+		xil_printf("TFTP WRQ: Transfer aborted by client [%d]\r\n", getErrCode(header));
+		pbuf_free(p_buf);
+		return TFTP_cleanup(upcb, args);
+	}
+
+	/* no block is expected before the received part of a resumed upload is checked */
+	if ((getOpCode(header) != TFTP_DATA) || args->verifying) {
+		pbuf_free(p_buf);
+		return;
 	}
 
-	memcpy(p_buf->payload, buf, buflen);
+	block = getBlockValue(header);
+	dataLen = p_buf->tot_len - TFTP_PACKET_HDR_LEN;
 
-	/* sending packet */
-	err = udp_sendto(pcb, p_buf, addr, port);
-	if (err != ERR_OK)
-		xil_printf("UDP send error!\r\n");
+	/* a block larger than negotiated cannot be a block of this transfer */
+	if (dataLen > args->opts.blksize) {
+		pbuf_free(p_buf);
+		return;
+	}
 
-	/* free pbuf */
+	if (block != TFTP_wireBlock(args, args->block + 1)) {
+		if (!args->block && (args->opts.accepted & TFTP_OPT_ECHOED)) {
+			/* the client did not receive the OACK */
+			TFTP_sendOACK(upcb, &ip, port, &args->opts);
+		}
+		else if ((s16)(block - TFTP_wireBlock(args, args->block + 1)) < 0) {
+			/*
+			 * An accepted block is received again. Only if it is the
+			 * acknowledged last block, the ACK of it (or of its window)
+			 * is lost. A duplicate from the middle of a window is
+			 * dropped, since a client takes any ACK as the end of a
+			 * window and would resend the rest of it.
+			 */
+			if ((block == TFTP_wireBlock(args, args->block)) && (args->lastAcked == args->block)) {
+				TFTP_sendACK(upcb, &ip, port, block);
+				args->ackPending = 0;
+				args->stats.retransmits++;
+			}
+			args->stats.duplicates++;
+		}
+		else if (!args->gapAcked) {
+			/*
+			 * A block of the window is missing. The last contiguous
+			 * block is acknowledged once, so that the client resends
+			 * from the missing block; the rest of the window is dropped.
+			 */
+			xil_printf("TFTP WRQ: Block %lu missing, acknowledging block %lu\r\n",
+					args->block + 1, args->block);
+			TFTP_sendACK(upcb, &ip, port, TFTP_wireBlock(args, args->block));
+			args->lastAcked = args->block;
+			args->gapAcked = 1;
+			args->stats.retransmits++;
+		}
+		/* the answer to a repeated ACK cannot be timed */
+		args->rttPending = 0;
+		pbuf_free(p_buf);
+		return;
+	}
+
+	/* collecting received data in the write-behind ring */
+	ret = TFTP_storeBlock(args, p_buf, dataLen);
 	pbuf_free(p_buf);
 
-	return err;
-}
+	/*
+	 * The final block is acknowledged only when the whole file
+	 * is written to the SD card, so a completed upload is safe.
+	 */
+	if (!ret && (dataLen < args->opts.blksize)) {
+		while ((ret = TFTP_flushRing(args, 1)) > 0)
+			;
 
-static int TFTP_sendError(struct udp_pcb *pcb, ip_addr_t *ip, int port, TFTP_errCode err)
-{
-	/* TFTP_errCode error strings */
-	static const char *TFTP_errCodeString[] = {
-			"not defined",
-			"file not found",
-			"access violation",
-			"disk full",
-			"illegal operation",
-			"unknown transfer id",
-			"file already exists",
-			"no such user"
-	};
-	char buf[MAX_ERR_MSG_LEN] = {0};
-	int len;
+		/*
+		 * A file built by filters is checked before the upload is
+		 * confirmed. A broken one is deleted, so it is never used.
+		 */
+		if (!ret && args->filter && TFTP_filterFinish(args->filter)) {
+			char path[TFTP_MAX_FNAME_LEN];
+
+			if (args->bootFile)
+				strcpy(path, args->fname);
+			else
+				TFTP_tempName(args->fname, path);
+
+			xil_printf("TFTP WRQ: Unable to build %s\r\n", args->fname);
+			TFTP_sendErrorMsg(upcb, &ip, port, ERR_NOT_DEFINED, "unable to build the file");
+			TFTP_cleanup(upcb, args);
+			f_unlink(path);
+			return;
+		}
 
-	setOpCode(buf, TFTP_ERR);
-	setErrCode(buf, err);
-	setErrMsg(buf, TFTP_errCodeString[err]);
+		if (!ret) {
+			u32 start = TFTP_getTimeUs();
 
-	/* total packet length */
-	len = TFTP_PACKET_HDR_LEN + strlen(TFTP_errCodeString[err]) + 1;
+			if (f_sync(&args->file))
+				ret = -1;
+			TFTP_statsIo(&args->stats, TFTP_getTimeUs() - start);
+		}
+	}
 
-	return TFTP_sendPacket(pcb, ip, port, buf, len);
-}
+	if (ret) {
+		xil_printf("TFTP WRQ: Write to file error\r\n");
+		TFTP_sendError(upcb, &ip, port, ERR_DISK_FULL);
+		return TFTP_cleanup(upcb, args);
+	}
+	args->block++;
+	args->gapAcked = 0;
+	args->retries = 0;
 
-static int TFTP_sendDataPacket(struct udp_pcb *pcb, ip_addr_t *ip,
-		int port, int block, char *buf, int buflen)
-{
-	char packet[MAX_MSG_LEN] = {0};
+	if (args->rttPending && (args->block == args->rttBlock)) {
+		TFTP_updateRto(args, TFTP_getTimeUs() - args->rttStart);
+		args->rttPending = 0;
+	}
 
-	setOpCode(packet, TFTP_DATA);
-	setBlockValue(packet, block);
-	setData(packet, buf, buflen);
+	/*
+	 * Only one ACK is sent per window, when windowsize blocks are
+	 * received in order since the last ACK or when the final block arrives.
+	 * The ACK of a window is sent when the session gets its turn, which
+	 * paces the client, the final ACK is sent right away.
+	 */
+	if (dataLen < args->opts.blksize)
+		TFTP_sendWindowAck(args);
+	else if ((args->block - args->lastAcked) >= args->opts.windowsize) {
+		args->ackPending = 1;
+		TFTP_schedWake(&args->sched);
+	}
+
+	TFTP_armTimer(args);
+
+	/*
+	 * if the last block carries less than the negotiated number of bytes,
+	 * then program received the whole file so it can quit
+	 */
+	if (dataLen < args->opts.blksize) {
+		char fname[TFTP_MAX_FNAME_LEN];
+		u8 bootFile = args->bootFile;
 
-	return TFTP_sendPacket(pcb, ip, port, packet, buflen + TFTP_PACKET_HDR_LEN);
+		/* the session is released, so the name of its file is kept aside */
+		strcpy(fname, args->fname);
+
+		xil_printf("TFTP WRQ: Transfer completed!\r\n\n");
+		args->stats.completed = 1;
+		TFTP_cleanup(upcb, args);
+
+		/*
+		 * The complete file replaces the old one. The boot image
+		 * is renamed by checkBootFile, keeping the old one aside.
+		 */
+		if (!bootFile) {
+			char temp[TFTP_MAX_FNAME_LEN];
+
+			TFTP_tempName(fname, temp);
+			f_unlink(fname);
+			if (f_rename(temp, fname))
+				xil_printf("Unable to rename %s to %s\r\n", temp, fname);
+			fileCacheInvalidate(fname);
+		}
+
+		/* the rest of the work is done later by the main loop */
+		TFTP_fileReceived(fname, bootFile, bootFile);
+	}
 }
 
-static int TFTP_sendACK(struct udp_pcb *pcb, ip_addr_t *ip, int port, int block)
+/* This function checks if the volume has room for a file of the given size */
+static int TFTP_hasFreeSpace(u32 size)
 {
-	char packet[MAX_ACK_LEN] = {0};
+	FATFS *fs;
+	DWORD freeClusters;
 
-	setOpCode(packet, TFTP_ACK);
-	setBlockValue(packet, block);
+	if (f_getfree("0:", &freeClusters, &fs) != FR_OK)
+		return 0;
 
-	return TFTP_sendPacket(pcb, ip, port, packet, MAX_ACK_LEN);
+	return ((u64)freeClusters * fs->csize * FF_MAX_SS) >= size;
 }
 
-static void TFTP_cleanup(struct udp_pcb *pcb, tftp_arg *args)
+/*
+ * This function starts an upload by sending the first ACK, or the OACK
+ * which stands for it if any option is sent back.
+ */
+static void TFTP_startUpload(tftp_arg *conn)
 {
-	/* cleaning up the args */
-	f_close(&args->file);
-	mem_free(args);
-
-	/* closing the connection */
-	udp_remove(pcb);
+	if (conn->opts.accepted & TFTP_OPT_ECHOED)
+		TFTP_sendOACK(conn->pcb, &conn->ip, conn->port, &conn->opts);
+	else
+		TFTP_sendACK(conn->pcb, &conn->ip, conn->port, conn->block);
+
+	conn->rttPending = 1;
+	conn->rttBlock = 1;
+	conn->rttStart = TFTP_getTimeUs();
+	TFTP_armTimer(conn);
 }
 
-static void TFTP_sendNextBlock(struct udp_pcb *pcb, tftp_arg *args, ip_addr_t *ip, u16 port)
+/*
+ * This function checks the next chunk of the part of the temporary
+ * file before the offset of a resumed upload. The chunks are read into
+ * the ring, which is not used yet. When the whole part is read, the
+ * upload goes on after it if its CRC-32 is the one sent by the client,
+ * otherwise the offset is refused and the upload starts over.
+ *
+ * Returns 1 if a chunk is checked and -1 on a file error.
+ */
+static int TFTP_verifyPrefix(tftp_arg *args)
 {
+	u32 len = args->opts.offset - args->verified;
+	u32 start = TFTP_getTimeUs();
 	FRESULT Res;
+	UINT read;
 
-	Res = f_read(&args->file, args->data, DATA_PACKET_MSG_LEN, &args->dataLen);
-	if (Res) {
-		xil_printf("Closing connection! Err: %d\r\n", args->dataLen);
-		return TFTP_cleanup(pcb, args);
-	}
+	if (len > args->chunkSize)
+		len = args->chunkSize;
 
-	/* sending the data */
-	TFTP_sendDataPacket(pcb, ip, port, args->block, args->data, args->dataLen);
-}
+	Res = f_read(&args->file, args->ring, len, &read);
+	TFTP_statsIo(&args->stats, TFTP_getTimeUs() - start);
+	if (Res || (read != len))
+		return -1;
 
-static void TFTP_readReqRecvCallback(void *_args, struct udp_pcb *upcb,
-		struct pbuf *p_buf, ip_addr_t *addr, u16 port)
-{
-	tftp_arg *args = (tftp_arg *)_args;
+	args->crc = TFTP_crc32(args->crc, (u8 *)args->ring, len);
+	args->verified += len;
+	if (args->verified < args->opts.offset)
+		return 1;
 
-	if ((getOpCode(p_buf->payload) == TFTP_ACK) &&
-		(args->block == getBlockValue(p_buf->payload))) {
+	args->verifying = 0;
 
-		/* incrementing block number */
-		args->block++;
+	if (args->crc == args->opts.crc32) {
+		xil_printf("TFTP WRQ: Resuming %s from byte %lu\r\n", args->fname, args->opts.offset);
+
+		/* the received part of a boot image is programmed before the rest */
+		if (args->bootFile && TFTP_flashResume(args->fname, args->opts.offset))
+			return -1;
 	}
 	else {
-		/*
-		 * program could not receive the expected ACK,
-		 * so the block number will not be updated
-		 * and current block will resend
-		 */
-		xil_printf("TFTP RRQ: Incorrect ACK received, resending...\r\n");
-		TFTP_sendDataPacket(upcb, addr, port, args->block, args->data, args->dataLen);
-		pbuf_free(p_buf);
-		return;
+		xil_printf("TFTP WRQ: Received part of %s differs, starting over\r\n", args->fname);
+		args->opts.accepted &= ~(TFTP_OPT_OFFSET | TFTP_OPT_CRC32);
+		args->opts.offset = 0;
 	}
 
-	pbuf_free(p_buf);
+	/* anything after the offset was not acknowledged, so it is dropped */
+	Res = f_lseek(&args->file, args->opts.offset);
+	if (!Res)
+		Res = f_truncate(&args->file);
+	if (Res)
+		return -1;
 
-	/*
-	 * if the last read returned less than the requested number of bytes,
-	 * then program will send the whole file so it can quit
-	 */
-	if (args->dataLen < DATA_PACKET_MSG_LEN) {
-		xil_printf("TFTP RRQ: Transfer completed!\r\n\n");
-		return TFTP_cleanup(upcb, args);
-	}
+	args->ringStart = args->opts.offset;
+	args->ringEnd = args->opts.offset;
+	TFTP_startUpload(args);
 
-	TFTP_sendNextBlock(upcb, args, addr, port);
+	return 1;
 }
 
-static int TFTP_readProcess(struct udp_pcb *pcb, ip_addr_t *ip, int port, char *fname)
+static int TFTP_writeProcess(struct udp_pcb *pcb, ip_addr_t *ip, int port, char *fname,
+		tftp_options *opts, u32 key)
 {
+	char temp[TFTP_MAX_FNAME_LEN];
+	char plain[TFTP_MAX_FNAME_LEN];
+	char *path = temp;
 	tftp_arg *conn;
-	FIL file;
+	tftp_filter *filter;
+	FILINFO info;
 	FRESULT Res;
+	u32 len = strlen(fname);
+	u8 bootFile = 0;
+	u8 delta = 0;
+	u8 lz4 = 0;
+	u8 resume;
 
-	Res = f_open(&file, fname, FA_READ);
-	if (Res) {
-		xil_printf("Unable to open file: %s\r\n", fname);
-		TFTP_sendError(pcb, ip, port, ERR_FILE_NOT_FOUND);
+	/*
+	 * A compressed file is stored under its name without the suffix,
+	 * and is handled like the uncompressed file from then on.
+	 */
+	if ((len > (sizeof(TFTP_LZ4_SUFFIX) - 1)) &&
+		!strcmp(fname + len - (sizeof(TFTP_LZ4_SUFFIX) - 1), TFTP_LZ4_SUFFIX)) {
+		len -= sizeof(TFTP_LZ4_SUFFIX) - 1;
+		memcpy(plain, fname, len);
+		plain[len] = '\0';
+		fname = plain;
+		lz4 = 1;
+	}
+
+	/*
+	 * A new boot image is received into a temporary file in the
+	 * firmwares folder. It is opened by its full path, so that the
+	 * current directory, which is shared by all sessions, is untouched.
+	 * A delta of the boot image builds the new image into the same file.
+	 * Other files are received into a temporary file next to them.
+	 */
+	if (!strcmp(fname, TFTP_DELTA_FILE_NAME))
+		delta = 1;
+
+	if (delta || !strncmp(fname, BOOT_FILE_NAME, sizeof(BOOT_FILE_NAME))) {
+		fname = BOOT_FILE_PATH_TEMP;
+		path = fname;
+		bootFile = 1;
+	}
+	else if (TFTP_tempName(fname, temp)) {
+		xil_printf("File name too long: %s\r\n", fname);
+		TFTP_sendError(pcb, ip, port, ERR_ACCESS_VIOLATION);
 		udp_remove(pcb);
 		return -1;
 	}
 
-	conn = mem_malloc(sizeof *conn);
-	if (!conn) {
-		xil_printf("Unable to allocate memory for TFTP connection!\r\n");
+	/*
+	 * A received boot image is only moved out of the temporary file
+	 * by its queued work, so that is done before the file is opened.
+	 */
+	if (bootFile)
+		TFTP_workBootFile();
+
+	/*
+	 * A client which retries an upload, after losing the server, may come
+	 * back before its old session times out. The old session is closed
+	 * first, which also writes out the part it received. An upload of
+	 * the same file by another client is left alone, and the new one is
+	 * refused.
+	 */
+	for (conn = sessions; conn; conn = conn->next) {
+		if ((conn->op == TFTP_WRQ) && !strcmp(conn->fname, fname)) {
+			if (!ip_addr_cmp(&conn->ip, ip)) {
+				xil_printf("TFTP WRQ: %s is being uploaded by another client\r\n", fname);
+				TFTP_sendErrorMsg(pcb, ip, port, ERR_NOT_DEFINED, "file busy");
+				TFTP_statsRejected();
+				udp_remove(pcb);
+				return -1;
+			}
+
+			xil_printf("TFTP WRQ: %s is uploaded again, closing the previous upload\r\n", fname);
+			TFTP_sendError(conn->pcb, &conn->ip, conn->port, ERR_NOT_DEFINED);
+			TFTP_cleanup(conn->pcb, conn);
+			break;
+		}
+	}
+
+	/*
+	 * An upload is resumed from the offset option if the temporary file
+	 * holds at least that many bytes, and their CRC-32 is given to check
+	 * them. Otherwise the option is refused and the upload starts over.
+	 * A delta or a compressed file is decoded as it arrives, so it cannot
+	 * be resumed.
+	 */
+	resume = !delta && !lz4 && (opts->accepted & TFTP_OPT_OFFSET) && (opts->accepted & TFTP_OPT_CRC32) &&
+			opts->offset && !f_stat(path, &info) && (info.fsize >= opts->offset);
+	if (!resume) {
+		opts->accepted &= ~(TFTP_OPT_OFFSET | TFTP_OPT_CRC32);
+		opts->offset = 0;
+	}
+
+	/*
+	 * If the client announced the size of the file, an upload which
+	 * does not fit is rejected before the temporary file is truncated.
+	 */
+	if ((opts->accepted & TFTP_OPT_TSIZE) && (opts->tsize > opts->offset) &&
+		!TFTP_hasFreeSpace(opts->tsize - opts->offset)) {
+		xil_printf("Not enough free space for %s [%lu bytes]\r\n", fname, opts->tsize);
 		TFTP_sendError(pcb, ip, port, ERR_DISK_FULL);
 		udp_remove(pcb);
-		f_close(&file);
 		return -1;
 	}
 
-	memcpy(&conn->file, &file, sizeof(file));
-
-	/* setting callback for receiving operations on this pcb */
-	udp_recv(pcb, (udp_recv_fn) TFTP_readReqRecvCallback, conn);
+	conn = TFTP_allocSession();
+	if (!conn) {
+		xil_printf("No free TFTP session!\r\n");
+		TFTP_sendErrorMsg(pcb, ip, port, ERR_NOT_DEFINED, "server busy");
+		TFTP_statsRejected();
+		udp_remove(pcb);
+		return -1;
+	}
 
 	/*
-	 * initiating the transaction by sending the first block of data.
-	 * further blocks will be sent when ACKs are received.
+	 * The received data of a compressed file or a delta is decoded by
+	 * filters on its way to the file. A compressed delta is decompressed
+	 * first, and the new boot image is then built from the delta and
+	 * the current image. A new boot image passes through the flash
+	 * filter last, which programs it while it is received.
 	 */
-	conn->block = 1;
+	if (delta || lz4 || bootFile) {
+		TFTP_fileSinkInit(&conn->sink, &conn->file);
+		conn->filter = &conn->sink.filter;
+	}
 
-	TFTP_sendNextBlock(pcb, conn, ip, port);
+	if (bootFile) {
+		conn->filter = TFTP_flashOpen((!delta && !lz4 && (opts->accepted & TFTP_OPT_TSIZE)) ?
+				opts->tsize : 0, conn->filter);
+		if (!conn->filter) {
+			xil_printf("The flash is busy with another upload!\r\n");
+			TFTP_sendErrorMsg(pcb, ip, port, ERR_NOT_DEFINED, "flash busy");
+			udp_remove(pcb);
+			TFTP_freeSession(conn);
+			return -1;
+		}
+	}
 
-	return 0;
-}
+	if (delta) {
+		filter = TFTP_deltaOpen(BOOT_FILE_PATH, conn->filter);
+		if (!filter) {
+			xil_printf("No boot image to apply the delta to\r\n");
+			TFTP_sendError(pcb, ip, port, ERR_FILE_NOT_FOUND);
+			TFTP_filterClose(conn->filter);
+			udp_remove(pcb);
+			TFTP_freeSession(conn);
+			return -1;
+		}
+		conn->filter = filter;
+	}
 
-static void TFTP_writeReqRecvCallback(void *_args, struct udp_pcb *upcb,
-		struct pbuf *p_buf, ip_addr_t *addr, u16 port)
-{
-	ip_addr_t ip = *addr;
-	tftp_arg *args = (tftp_arg *)_args;
+	if (lz4) {
+		filter = TFTP_lz4Open(conn->filter);
+		if (!filter) {
+			xil_printf("No free decompressor for %s!\r\n", fname);
+			TFTP_sendErrorMsg(pcb, ip, port, ERR_NOT_DEFINED, "server busy");
+			TFTP_filterClose(conn->filter);
+			udp_remove(pcb);
+			TFTP_freeSession(conn);
+			return -1;
+		}
+		conn->filter = filter;
+	}
 
-	if (p_buf->len != p_buf->tot_len) {
-		xil_printf("TFTP WRQ: TFTP Server does not support chained pbufs!\r\n");
-		pbuf_free(p_buf);
-		return;
+	if (resume)
+		Res = f_open(&conn->file, path, FA_OPEN_EXISTING | FA_READ | FA_WRITE);
+	else
+		Res = f_open(&conn->file, path, FA_CREATE_ALWAYS | FA_WRITE);
+	if (Res) {
+		xil_printf("Unable to open file %s for writing [%d]\r\n", path, Res);
+		TFTP_sendError(pcb, ip, port, ERR_DISK_FULL);
+		TFTP_filterClose(conn->filter);
+		udp_remove(pcb);
+		TFTP_freeSession(conn);
+		return -1;
 	}
 
-	if ((p_buf->len >= TFTP_PACKET_HDR_LEN) &&
-		(getBlockValue(p_buf->payload) == (u16)(args->block + 1))) {
+	/* the old content of the file must not be sent from the file cache */
+	fileCacheInvalidate(path);
+
+#if FF_USE_EXPAND
+	/*
+	 * Allocating a contiguous cluster run for the announced size,
+	 * so the upload streams into consecutive sectors. If there is
+	 * no contiguous free area, clusters are allocated while writing.
+	 *
+	 * In order to be able to use the f_expand function,
+	 * FF_USE_EXPAND must be set to 1 in the ffconf.h of the BSP.
+	 */
+	if ((opts->accepted & TFTP_OPT_TSIZE) && opts->tsize && !resume && !conn->filter) {
+		Res = f_expand(&conn->file, opts->tsize, 1);
+		if (Res)
+			xil_printf("No contiguous area for %s, allocating on the fly [%d]\r\n", fname, Res);
+	}
+#endif
 
-		/* writing received data to the file */
-		unsigned int numBytesWritten;
+	conn->bootFile = bootFile;
+	conn->decoding = delta || lz4;
+	TFTP_initSession(conn, TFTP_WRQ, pcb, ip, port, fname, opts, key);
 
-		f_write(&args->file, p_buf->payload + TFTP_PACKET_HDR_LEN,
-				p_buf->len - TFTP_PACKET_HDR_LEN, &numBytesWritten);
+	/* setting callback for receiving operations on this pcb */
+	udp_recv(pcb, (udp_recv_fn) TFTP_writeReqRecvCallback, conn);
 
-		if (numBytesWritten != p_buf->len - TFTP_PACKET_HDR_LEN) {
-			xil_printf("TFTP WRQ: Write to file error\r\n");
-			TFTP_sendError(upcb, &ip, port, ERR_DISK_FULL);
-			pbuf_free(p_buf);
-			return TFTP_cleanup(upcb, args);
-		}
-		args->block++;
+	/*
+	 * The received part of a resumed upload is checked in the idle time
+	 * of the main loop first, the client repeats its request meanwhile.
+	 */
+	if (resume) {
+		conn->verifying = 1;
+		return 0;
 	}
-	TFTP_sendACK(upcb, &ip, port, args->block);
 
+	/* initiating the transaction */
+	TFTP_startUpload(conn);
+
+	return 0;
+}
+
+/*
+ * This function retransmits the unacknowledged data of a session
+ * whose retransmission timer expired.
+ */
+static void TFTP_timeout(tftp_arg *args)
+{
 	/*
-	 * if the last read returned less than the requested number of bytes,
-	 * then program will send the whole file so it can quit
+	 * The client answered, and the session is still waiting for its
+	 * turn to send the next window (or ACK), so nothing is lost.
 	 */
-	if (p_buf->len < DATA_PACKET_MSG_LEN) {
-		xil_printf("TFTP WRQ: Transfer completed!\r\n\n");
-		TFTP_cleanup(upcb, args);
-		setTimestamp(filename);
+	if (args->sched.queued) {
+		TFTP_armTimer(args);
+		return;
+	}
+
+	if (TFTP_backoff(args))
+		return;
 
-		if (checkBootFileFlag) {
-			checkBootFile();
-			doQspiFlash("BOOT.BIN");
-			f_chdir("/..");
-			checkBootFileFlag = 0;
+	if (args->op == TFTP_RRQ) {
+		/* no block is sent yet, so the OACK (or its ACK) is lost */
+		if ((args->opts.accepted & TFTP_OPT_ECHOED) && (args->sendMax == 1)) {
+			TFTP_sendOACK(args->pcb, &args->ip, args->port, &args->opts);
+			TFTP_armTimer(args);
+			return;
 		}
 
-		listDirectory("0:");
-		createIndexFileTree("0:");
+		/* going back to the first unacknowledged block */
+		xil_printf("TFTP RRQ: Timeout, resending from block %lu...\r\n", args->lastAcked + 1);
+		args->block = args->lastAcked + 1;
+		TFTP_schedWake(&args->sched);
 		return;
 	}
-	pbuf_free(p_buf);
+
+	/* acknowledging the last contiguous block again */
+	if (!args->block && (args->opts.accepted & TFTP_OPT_ECHOED))
+		TFTP_sendOACK(args->pcb, &args->ip, args->port, &args->opts);
+	else {
+		TFTP_sendACK(args->pcb, &args->ip, args->port, TFTP_wireBlock(args, args->block));
+		args->lastAcked = args->block;
+		args->stats.retransmits++;
+	}
+	TFTP_armTimer(args);
 }
 
-static int TFTP_writeProcess(struct udp_pcb *pcb, ip_addr_t *ip, int port, char *fname)
+/*
+ * This function must be called periodically from the main loop.
+ * It handles the sessions whose retransmission timer expired.
+ */
+void TFTP_processTimers(void)
 {
-	tftp_arg *conn;
-	FIL file;
-	FRESULT Res;
+	tftp_arg *args, *next;
+	u32 now = TFTP_getTimeUs();
 
-	filename = fname;
+	for (args = sessions; args; args = next) {
+		/* the session may be closed while it is handled */
+		next = args->next;
 
-	if (!strncmp(fname, BOOT_FILE_NAME, sizeof(BOOT_FILE_NAME))) {
-		/*
-		 * In order for the f_chdir function to work,
-		 * the 'set_fs_rpath' value must be set to '2'
-		 * in the BSP settings.
-		 */
-		fname = BOOT_FILE_NAME_TEMP;
-		f_chdir("/firmwares");
-		checkBootFileFlag = 1;
+		if (args->timerArmed && ((s32)(now - args->deadline) >= 0))
+			TFTP_timeout(args);
 	}
 
-	Res = f_open(&file, fname, FA_CREATE_ALWAYS | FA_WRITE);
-	if (Res) {
-		xil_printf("Unable to open file %s for writing [%d]\r\n", fname, Res);
-		TFTP_sendError(pcb, ip, port, ERR_DISK_FULL);
-		udp_remove(pcb);
-		return -1;
+	TFTP_mcastProcessTimers();
+}
+
+/*
+ * This function puts a stalled session back on the run queue.
+ */
+static void TFTP_unstall(tftp_arg *args)
+{
+	args->stalled = 0;
+	TFTP_schedWake(&args->sched);
+}
+
+/*
+ * This function should be called from the main loop when no packets
+ * are waiting. It reads the next chunk of a download into its ring,
+ * so that the blocks are already in memory when their turn comes, or
+ * writes a full chunk of an upload from its ring to the SD card.
+ * Only one chunk is handled per call to keep the network responsive.
+ * Returns 1 if there was anything to do, or 0 if the storage is idle.
+ */
+int TFTP_processStorage(void)
+{
+	tftp_arg *args;
+	int flash, ret;
+
+	/* a new boot image is programmed to the flash while it is uploaded */
+	flash = TFTP_flashStep();
+
+	for (args = sessions; args; args = args->next) {
+		if (args->op == TFTP_RRQ)
+			ret = TFTP_fillRing(args);
+		else if (args->verifying)
+			ret = TFTP_verifyPrefix(args);
+		else
+			ret = TFTP_flushRing(args, 0);
+
+		if (ret < 0) {
+			xil_printf("Closing connection! Unable to access %s\r\n", args->fname);
+			TFTP_sendError(args->pcb, &args->ip, args->port,
+					(args->op == TFTP_RRQ) ? ERR_ACCESS_VIOLATION : ERR_DISK_FULL);
+			TFTP_cleanup(args->pcb, args);
+			return 1;
+		}
+		if (ret) {
+			/* the chunk the window was waiting for may be here now */
+			if (args->stalled)
+				TFTP_unstall(args);
+			return 1;
+		}
 	}
 
-	conn = mem_malloc(sizeof *conn);
-	if (!conn) {
-		xil_printf("Unable to allocate memory for TFTP connection!\r\n");
-		TFTP_sendError(pcb, ip, port, ERR_DISK_FULL);
-		udp_remove(pcb);
-		return -1;
+	return flash;
+}
+
+/*
+ * This function must be called periodically from the main loop. It
+ * gives the sessions waiting to send their turns, one quantum each
+ * and round robin, until none of them can send any more right now.
+ */
+void TFTP_processSchedule(void)
+{
+	tftp_sched_node *node;
+	tftp_arg *args;
+	u32 now = TFTP_getTimeUs();
+	u8 freed = 0;
+	int sent;
+
+	/*
+	 * The stalled sessions try again when a packet of theirs is sent,
+	 * which frees pbufs and chunks of the ring, or after a short time,
+	 * so that they do neither spin nor wait for the retransmission.
+	 */
+	if (stalledTxFreed) {
+		stalledTxFreed = 0;
+		freed = 1;
+	}
+	for (args = sessions; args; args = args->next) {
+		if (args->stalled && (freed || ((now - args->stallStart) >= TFTP_STALL_RETRY_US)))
+			TFTP_unstall(args);
 	}
 
-	memcpy(&conn->file, &file, sizeof(file));
-	conn->block = 0;
+	while ((node = TFTP_schedNext())) {
+		args = (tftp_arg *)node->owner;
 
-	/* setting callback for receiving operations on this pcb */
-	udp_recv(pcb, (udp_recv_fn) TFTP_writeReqRecvCallback, conn);
+		if (args->op == TFTP_WRQ) {
+			if (args->ackPending) {
+				TFTP_schedCharge(node, (args->block - args->lastAcked) * args->opts.blksize);
+				TFTP_sendWindowAck(args);
+			}
+			continue;
+		}
 
-	/* initiating the transaction by sending the first ACK */
-	TFTP_sendACK(pcb, ip, port, conn->block);
+		sent = TFTP_sendWindow(args->pcb, args, &args->ip, args->port, TFTP_SCHED_QUANTUM);
+		if (sent < 0)
+			continue;
+
+		/* nothing could be sent, the session waits until it can */
+		if (!sent) {
+			if (TFTP_windowOpen(args)) {
+				args->stalled = 1;
+				args->stallStart = now;
+			}
+			continue;
+		}
 
-	return 0;
+		TFTP_schedCharge(node, sent);
+		if (TFTP_windowOpen(args))
+			TFTP_schedWake(node);
+	}
 }
 
 static void TFTP_recvCallback(void *arg, struct udp_pcb *upcb, struct pbuf *p_buf, ip_addr_t *ip, u16_t port)
 {
 	TFTP_opCode op;
 	err_t err;
-	char fname[512];
+	char req[MAX_MSG_LEN + 1];
+	char *fname, *mode, *opt, *end;
+	tftp_options opts;
 	struct udp_pcb *pcb;
+	u32 key = 0;
+	u16 len;
+
+	/*
+	 * Copying the request out of the pbuf and terminating it,
+	 * so that the strings in it can be walked safely.
+	 */
+	len = pbuf_copy_partial(p_buf, req, MAX_MSG_LEN, 0);
+	req[len] = '\0';
+	end = req + len;
+
+	if (len < TFTP_PACKET_HDR_LEN) {
+		pbuf_free(p_buf);
+		return;
+	}
+
+	op = getOpCode(req);
+	fname = req + FILE_NAME_OFFSET;
+	mode = fname + strlen(fname) + 1;
+
+	/* the options (if any) follow the mode string */
+	opt = (mode < end) ? mode + strlen(mode) + 1 : end;
+
+	if ((op == TFTP_RRQ) || (op == TFTP_WRQ)) {
+		/*
+		 * A client repeats its request if the first answer is lost or
+		 * late. The session which is already serving it retransmits
+		 * that answer by itself, so the request is dropped instead of
+		 * opening the file once more.
+		 */
+		key = TFTP_sessionKey(ip, port, op, fname);
+		if (TFTP_findSession(ip, port, op, key)) {
+			xil_printf("TFTP: Repeated request for %s, ignoring...\r\n", fname);
+			goto cleanup;
+		}
+
+		/*
+		 * A request which cannot get a session is refused right from
+		 * the server port, without taking a PCB for the answer.
+		 */
+		if (!freeSessions) {
+			xil_printf("TFTP: All %d sessions are in use, refusing %s\r\n", TFTP_MAX_SESSIONS, fname);
+			TFTP_sendErrorMsg(upcb, ip, port, ERR_NOT_DEFINED, "server busy");
+			TFTP_statsRejected();
+			goto cleanup;
+		}
 
-	op = getOpCode(p_buf->payload);
+		if (strlen(fname) >= TFTP_MAX_FNAME_LEN) {
+			TFTP_sendError(upcb, ip, port, ERR_ACCESS_VIOLATION);
+			goto cleanup;
+		}
+	}
 
 	pcb = udp_new();
 	if (!pcb) {
@@ -315,16 +2000,14 @@ static void TFTP_recvCallback(void *arg, struct udp_pcb *upcb, struct pbuf *p_bu
 
 	switch(op) {
 	case TFTP_RRQ:
-		/* getting the file name from request payload */
-		strcpy(fname, p_buf->payload + FILE_NAME_OFFSET);
+		TFTP_parseOptions(opt, end, &opts, TFTP_MAX_BLKSIZE, TFTP_MAX_WINDOWSIZE);
 		xil_printf("TFTP RRQ: %s\r\n", fname);
-		TFTP_readProcess(pcb, ip, port, fname);
+		TFTP_readProcess(pcb, ip, port, fname, &opts, key);
 		break;
 	case TFTP_WRQ:
-		/* getting the file name from request payload */
-		strcpy(fname, p_buf->payload + FILE_NAME_OFFSET);
+		TFTP_parseOptions(opt, end, &opts, TFTP_MAX_BLKSIZE, TFTP_MAX_WINDOWSIZE);
 		xil_printf("TFTP WRQ: %s\r\n", fname);
-		TFTP_writeProcess(pcb, ip, port, fname);
+		TFTP_writeProcess(pcb, ip, port, fname, &opts, key);
 		break;
 	default:
 		/* sending a generic access violation message */
@@ -403,6 +2086,10 @@ void startApplication()
 		return;
 	}
 
+	TFTP_initSessionTable();
+	TFTP_schedInit();
+	fileCacheInit();
+
 	udp_recv(pcb, (udp_recv_fn) TFTP_recvCallback, NULL);
 }
 
@@ -9,19 +9,131 @@
 #define SRC_TFTP_SERVER_H_
 
 #include "ff.h"
+#include "file_cache.h"
+#include "tftp_stats.h"
+#include "tftp_sched.h"
+#include "tftp_filter.h"
+#include "tftp_hal.h"
 #include "lwip/ip.h"
+#include "lwip/udp.h"
 
 #define DEFAULT_IP_ADDRESS     "192.168.1.10"
 #define DEFAULT_IP_MASK        "255.255.255.0"
 #define DEFAULT_GW_ADDRESS     "192.168.1.1"
 
+#ifndef TFTP_PORT
 #define TFTP_PORT				69
+#endif
 
 #define MAX_MSG_LEN				600
 #define MAX_ACK_LEN				4
 #define MAX_ERR_MSG_LEN			30
 #define DATA_PACKET_MSG_LEN		512
 
+/*
+ * RFC 2348 block sizes. A block of TFTP_MTU_BLKSIZE bytes still fits
+ * into a single Ethernet frame, larger blocks are only accepted when
+ * lwIP is able to fragment and reassemble IP datagrams.
+ */
+#define TFTP_MIN_BLKSIZE		8
+#define TFTP_MTU_BLKSIZE		1428
+#if IP_FRAG && IP_REASSEMBLY
+#define TFTP_MAX_BLKSIZE		8192
+#else
+#define TFTP_MAX_BLKSIZE		TFTP_MTU_BLKSIZE
+#endif
+
+/*
+ * RFC 7440 window size. A window of large blocks is sent as a burst of
+ * IP fragments, so it is limited to what the GEM TX descriptor ring
+ * is able to queue at once.
+ */
+#define TFTP_MAX_WINDOWSIZE		16
+
+/* RFC 2347 option flags */
+#define TFTP_OPT_BLKSIZE		(1 << 0)
+#define TFTP_OPT_WINDOWSIZE		(1 << 1)
+#define TFTP_OPT_TSIZE			(1 << 2)
+#define TFTP_OPT_TIMEOUT		(1 << 3)
+#define TFTP_OPT_ROLLOVER		(1 << 4)
+#define TFTP_OPT_OFFSET			(1 << 5)
+#define TFTP_OPT_CRC32			(1 << 6)
+
+/* options sent back in an OACK, the checksum only qualifies the offset */
+#define TFTP_OPT_ECHOED			(TFTP_OPT_BLKSIZE | TFTP_OPT_WINDOWSIZE | TFTP_OPT_TSIZE | \
+								 TFTP_OPT_TIMEOUT | TFTP_OPT_ROLLOVER | TFTP_OPT_OFFSET)
+
+/*
+ * Retransmission timer. The RTO of a session is estimated from the
+ * measured round trip times as in RFC 6298, unless the client fixes
+ * it with the RFC 2349 timeout option. A session is dropped when no
+ * progress is made after TFTP_MAX_RETRIES retransmissions.
+ */
+#define TFTP_INITIAL_RTO_US		1000000
+#define TFTP_MIN_RTO_US			50000
+#define TFTP_MAX_RTO_US			5000000
+#define TFTP_MAX_RETRIES		6
+
+/* a session which could not send its window tries again after this time */
+#define TFTP_STALL_RETRY_US		1000
+
+/*
+ * Session table. Every transfer takes one entry of a statically
+ * allocated table and a UDP PCB of its own, so MEMP_NUM_UDP_PCB must
+ * be set to at least TFTP_MAX_SESSIONS + 1 in the BSP settings for all
+ * entries to be usable. A request arriving while the table is full is
+ * answered with an error.
+ */
+#ifndef TFTP_MAX_SESSIONS
+#define TFTP_MAX_SESSIONS		32
+#endif
+
+#if MEMP_NUM_UDP_PCB < (TFTP_MAX_SESSIONS + 1)
+#warning "MEMP_NUM_UDP_PCB is less than TFTP_MAX_SESSIONS + 1, some sessions will be refused"
+#endif
+
+/*
+ * Ring of a session. A download is read into it ahead of the blocks
+ * being sent, an upload is collected in it and written behind the
+ * blocks being acknowledged. The file is accessed in cluster-sized
+ * chunks of at most TFTP_RING_CHUNK_SIZE bytes. The ring must hold the
+ * unacknowledged window plus the chunk it starts in, and both sizes
+ * must be powers of two.
+ */
+#define TFTP_RING_SIZE			(256 * 1024)
+#define TFTP_RING_CHUNK_SIZE	(32 * 1024)
+
+#if (TFTP_MAX_WINDOWSIZE * TFTP_MAX_BLKSIZE + TFTP_RING_CHUNK_SIZE) > TFTP_RING_SIZE
+#error "TFTP_RING_SIZE must hold a window of blocks and a chunk"
+#endif
+
+#define TFTP_RING_SLOTS			(TFTP_RING_SIZE / TFTP_RING_CHUNK_SIZE)
+
+/*
+ * DATA packets refer to the ring of their session instead of copying
+ * it. A reference is held until the GEM has sent the packet, so there
+ * must be more of them than TX buffer descriptors; a packet which
+ * does not get a reference is copied into a pool pbuf as before.
+ */
+#define TFTP_MAX_TX_REFS		128
+
+/*
+ * Active sessions are indexed by their client, opcode and file name,
+ * so a request which is repeated by the client finds its session.
+ * The number of buckets must be a power of two.
+ */
+#define TFTP_SESSION_HASH_SIZE	64
+
+/* longest file name which can be requested, terminator included */
+#define TFTP_MAX_FNAME_LEN		(FF_MAX_LFN + 1)
+
+/*
+ * An upload is received into a temporary file with this prefix, like
+ * the boot image, and replaces the file only when it is complete. An
+ * interrupted upload is kept there, so it can be resumed.
+ */
+#define TFTP_TEMP_PREFIX		"temp_"
+
 #define TFTP_PACKET_HDR_LEN		4
 #define TFTP_DATA_PACKET_LEN	(DATA_PACKET_MSG_LEN + TFTP_PACKET_HDR_LEN)
 
@@ -30,6 +142,7 @@
 #define FILE_NAME_OFFSET		2
 #define ERRCODE_OFFSET			2
 #define BLOCK_OFFSET			2
+#define OPTION_OFFSET			2
 #define DATA_OFFSET				4
 
 /* Packet form macros */
@@ -71,7 +184,8 @@ typedef enum {
 	TFTP_WRQ,
 	TFTP_DATA,
 	TFTP_ACK,
-	TFTP_ERR
+	TFTP_ERR,
+	TFTP_OACK
 } TFTP_opCode;
 
 typedef enum {
@@ -82,24 +196,194 @@ typedef enum {
 	ERR_ILLEGALOP,
 	ERR_UNKNOWN_TRANSFER_ID,
 	ERR_FILE_ALREADY_EXISTS,
-	ERR_NO_SUCH_USER
+	ERR_NO_SUCH_USER,
+	ERR_OPTION_NEGOTIATION
 } TFTP_errCode;
 
 typedef struct {
+	/* TFTP_OPT_* flags of the options acknowledged with OACK */
+	u32 accepted;
+
+	/* negotiated block size */
+	u16 blksize;
+
+	/* number of blocks sent before waiting for an ACK */
+	u16 windowsize;
+
+	/* RFC 2349 transfer size in bytes */
+	u32 tsize;
+
+	/* RFC 2349 retransmission timeout in seconds */
+	u8 timeout;
+
+	/* block number which follows block 65535 on the wire (0 or 1) */
+	u8 rollover;
+
+	/*
+	 * Non-standard options for resuming a transfer: the byte offset
+	 * of the file which block 1 starts from, and the CRC-32 of the
+	 * part of the file before it, which the client already sent (WRQ)
+	 */
+	u32 offset;
+	u32 crc32;
+} tftp_options;
+
+typedef struct tftp_arg {
+	/*
+	 * neighbours in the list of active sessions,
+	 * next also links the free entries of the table
+	 */
+	struct tftp_arg *next;
+	struct tftp_arg *prev;
+
+	/* next session in the same bucket of the session index */
+	struct tftp_arg *hashNext;
+
+	/* hash of the request (client, opcode and requested file name) */
+	u32 key;
+
+	/* TFTP_RRQ or TFTP_WRQ */
+	TFTP_opCode op;
+
+	/* connection of this transfer and the address of the client */
+	struct udp_pcb *pcb;
+	ip_addr_t ip;
+	u16 port;
+
 	FIL file;
 
-	/* last block read */
-	char data[MAX_MSG_LEN];
-	UINT dataLen;
+	/* size of the file which is read (RRQ) */
+	FSIZE_t fileSize;
+
+	/*
+	 * name of the file on the SD card, an upload is received into
+	 * a temporary file next to it (see TFTP_TEMP_PREFIX)
+	 */
+	char fname[TFTP_MAX_FNAME_LEN];
+
+	/* the upload is a new boot image which will be flashed (WRQ) */
+	u8 bootFile;
+
+	/* options negotiated for this transfer */
+	tftp_options opts;
+
+	/*
+	 * The part of the temporary file before the offset of a resumed
+	 * upload is being checked against the CRC-32 sent by the client.
+	 * The upload starts when the whole part is read (WRQ).
+	 */
+	u8 verifying;
+	u32 verified;
+	u32 crc;
+
+	/*
+	 * Filters the received data passes through before it reaches the
+	 * file, ending with the sink of the file, or NULL if it is written
+	 * as received (WRQ)
+	 */
+	tftp_filter *filter;
+	tftp_file_sink sink;
+
+	/*
+	 * The file is decoded by the filters, so a part of it is of no
+	 * use and it cannot be resumed (WRQ)
+	 */
+	u8 decoding;
+
+	/*
+	 * read-ahead (RRQ) or write-behind (WRQ) ring, holding the part
+	 * of the file from ringStart up to ringEnd at offset % TFTP_RING_SIZE
+	 */
+	char *ring;
+	u32 chunkSize;
+	u64 ringStart;
+	u64 ringEnd;
+
+	/*
+	 * If the file is served from the file cache (RRQ), the chunks are
+	 * read into its entry instead of the ring and they are never
+	 * overwritten. The file is not opened at all if the entry is
+	 * already complete. The cursors follow the reading and sending
+	 * of the file through the pages of the entry.
+	 */
+	FILE_CACHE_ENTRY *cache;
+	FILE_CACHE_CURSOR cacheFill;
+	FILE_CACHE_CURSOR cacheSend;
+
+	/*
+	 * DATA packets waiting to be sent by the GEM, in total and per
+	 * TFTP_RING_CHUNK_SIZE slot of the ring. A referenced slot is not
+	 * filled again and a released session with packets in flight is
+	 * only reused when the last of them is sent.
+	 */
+	volatile u16 txRefs;
+	volatile u8 txSlotRefs[TFTP_RING_SLOTS];
+	u8 released;
+
+	/*
+	 * Blocks are counted with 32 bits from the start of the transfer,
+	 * so they never wrap around. Only the block numbers on the wire
+	 * are 16 bits long and roll over after block 65535.
+	 */
+
+	/* next block to send (RRQ) or last block received (WRQ) */
+	u32 block;
+
+	/* first block which has never been sent (RRQ) */
+	u32 sendMax;
+
+	/* last block acknowledged by the client (RRQ) or by the server (WRQ) */
+	u32 lastAcked;
+
+	/* a missing block of the current window is already reported (WRQ) */
+	u8 gapAcked;
+
+	/* number of the last block of the file, valid if eof is set (RRQ) */
+	u32 lastBlock;
+	u8 eof;
+
+	/* retransmission timer, times are in microseconds */
+	u32 deadline;
+	u32 rto;
+	u32 srtt;
+	u32 rttvar;
+	u8 timerArmed;
+	u8 retries;
+
+	/* round trip time measurement of a single block */
+	u32 rttStart;
+	u32 rttBlock;
+	u8 rttPending;
+
+	/* metrics of the transfer, printed when the session ends */
+	tftp_stats stats;
+
+	/* place of the session in the transmit scheduler */
+	tftp_sched_node sched;
+
+	/*
+	 * The window is open, but its next block could not be sent (out
+	 * of pbufs, or its chunk of the ring is still being sent). The
+	 * session is scheduled again when a chunk of it is read or one of
+	 * its packets is sent, or after TFTP_STALL_RETRY_US at the latest.
+	 */
+	u8 stalled;
+	u32 stallStart;
 
-	/* next block number */
-	u16 block;
+	/* the ACK of a received window waits for its turn (WRQ) */
+	u8 ackPending;
 } tftp_arg;
 
 void printIPSettings(ip_addr_t *ip, ip_addr_t *mask, ip_addr_t *gw);
 void printAppHeader(void);
 void assignDefaultIP(ip_addr_t *ip, ip_addr_t *mask, ip_addr_t *gw);
 void startApplication(void);
+void TFTP_processTimers(void);
+int TFTP_processStorage(void);
+void TFTP_processSchedule(void);
+err_t TFTP_sendPacket(struct udp_pcb *pcb, ip_addr_t *addr, int port, char *buf, int buflen);
+int TFTP_sendError(struct udp_pcb *pcb, ip_addr_t *ip, int port, TFTP_errCode err);
+int TFTP_sendACK(struct udp_pcb *pcb, ip_addr_t *ip, int port, int block);
 int initFileSystem(const char *path, int formatDrive);
 
 #endif /* SRC_TFTP_SERVER_H_ */
@@ -0,0 +1,172 @@
+/*
+ * tftp_stats.c
+ */
+
+#include "tftp_stats.h"
+#include "tftp_server.h"
+
+#include <string.h>
+#include "xil_printf.h"
+
+static tftp_stats_totals totals;
+
+/* the last finished transfers, the oldest one is overwritten first */
+static tftp_stats_record history[TFTP_STATS_HISTORY];
+static u32 historyCount;
+
+/* transfers started and not finished yet */
+static u32 activeSessions;
+
+/* This function adds a time to a histogram */
+static void TFTP_statsHist(u32 *hist, u32 us)
+{
+	int i = 0;
+
+	while ((us >>= 1) && (i < (TFTP_STATS_HIST_BUCKETS - 1)))
+		i++;
+
+	hist[i]++;
+}
+
+/*
+ * This function returns the upper bound of the bucket which holds
+ * the given percentile of a histogram, in microseconds, or 0 if the
+ * histogram is empty.
+ */
+static u32 TFTP_statsPercentile(const u32 *hist, u32 pct)
+{
+	u32 count = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < TFTP_STATS_HIST_BUCKETS; i++)
+		count += hist[i];
+	if (!count)
+		return 0;
+
+	for (i = 0; i < TFTP_STATS_HIST_BUCKETS; i++) {
+		sum += hist[i];
+		if (((u64)sum * 100) >= ((u64)count * pct))
+			break;
+	}
+
+	return 2u << i;
+}
+
+/* This function starts the metrics of a new transfer */
+void TFTP_statsStart(tftp_stats *stats)
+{
+	memset(stats, 0, sizeof *stats);
+	stats->startUs = TFTP_getTimeUs();
+	totals.sessions++;
+
+	/* the load of the core is measured from the first transfer after an idle time */
+	if (!activeSessions++) {
+		totals.idleUs = 0;
+		totals.windowStartUs = stats->startUs;
+	}
+}
+
+/* This function records the round trip time of a block or an ACK */
+void TFTP_statsAck(tftp_stats *stats, u32 us)
+{
+	TFTP_statsHist(stats->ackHist, us);
+	TFTP_statsHist(totals.ackHist, us);
+}
+
+/* This function records the time of a single access to the SD card */
+void TFTP_statsIo(tftp_stats *stats, u32 us)
+{
+	stats->ioUs += us;
+	TFTP_statsHist(stats->ioHist, us);
+	TFTP_statsHist(totals.ioHist, us);
+}
+
+/*
+ * This function finishes the metrics of a transfer. It prints a
+ * summary line, keeps the metrics in the history table and adds
+ * them to the counters of the server.
+ *
+ * The time spent on the SD card is printed next to the round trip
+ * times, so a slow transfer can be blamed on the network (high round
+ * trip times, retransmits), on the SD card (high io time) or on the
+ * server itself (neither of them).
+ */
+void TFTP_statsFinish(tftp_stats *stats, const char *fname, u8 upload)
+{
+	tftp_stats_record *rec = &history[historyCount++ % TFTP_STATS_HISTORY];
+	u32 duration = TFTP_getTimeUs() - stats->startUs;
+	u32 rate = duration ? (u32)(((u64)stats->bytes * 1000000 / duration) / 1024) : 0;
+
+	if (activeSessions)
+		activeSessions--;
+
+	xil_printf("TFTP %s %s: %s, %lu bytes in %lu blocks, %lu ms, %lu KB/s, "
+			"rtx %lu, dup %lu, rtt p50/p99 %lu/%lu us, io %lu ms (p99 %lu us)\r\n",
+			upload ? "WRQ" : "RRQ", fname, stats->completed ? "done" : "failed",
+			stats->bytes, stats->blocks, duration / 1000, rate,
+			stats->retransmits, stats->duplicates,
+			TFTP_statsPercentile(stats->ackHist, 50), TFTP_statsPercentile(stats->ackHist, 99),
+			stats->ioUs / 1000, TFTP_statsPercentile(stats->ioHist, 99));
+
+	strncpy(rec->fname, fname, TFTP_STATS_NAME_LEN - 1);
+	rec->fname[TFTP_STATS_NAME_LEN - 1] = '\0';
+	rec->upload = upload;
+	rec->durationUs = duration;
+	rec->stats = *stats;
+
+	if (stats->completed)
+		totals.completed++;
+	else
+		totals.failed++;
+	if (upload)
+		totals.bytesReceived += stats->bytes;
+	else
+		totals.bytesSent += stats->bytes;
+	totals.retransmits += stats->retransmits;
+	totals.duplicates += stats->duplicates;
+	totals.timeouts += stats->timeouts;
+}
+
+/* This function counts a request refused because all sessions are in use */
+void TFTP_statsRejected(void)
+{
+	totals.rejected++;
+}
+
+/* This function records how long a received packet waited for the main loop */
+void TFTP_statsWake(u32 us)
+{
+	TFTP_statsHist(totals.wakeHist, us);
+}
+
+/* This function counts the time the main loop slept with nothing to do */
+void TFTP_statsIdle(u32 us)
+{
+	totals.idleUs += us;
+}
+
+/*
+ * This function prints the counters of the server. The load of the core
+ * is the part of the time it did not sleep, since the first transfer
+ * after the totals were last printed.
+ */
+void TFTP_statsPrintTotals(void)
+{
+	u32 elapsed = TFTP_getTimeUs() - totals.windowStartUs;
+	u32 load = 0;
+
+	if (elapsed && (totals.idleUs < elapsed))
+		load = (u32)((u64)(elapsed - totals.idleUs) * 100 / elapsed);
+
+	xil_printf("TFTP totals: %lu sessions (%lu done, %lu failed, %lu refused), "
+			"%lu bytes sent, %lu bytes received, rtx %lu, dup %lu, timeouts %lu, "
+			"rtt p50/p99 %lu/%lu us, io p50/p99 %lu/%lu us, "
+			"wake p50/p99 %lu/%lu us, cpu %lu%%\r\n\n",
+			totals.sessions, totals.completed, totals.failed, totals.rejected,
+			totals.bytesSent, totals.bytesReceived,
+			totals.retransmits, totals.duplicates, totals.timeouts,
+			TFTP_statsPercentile(totals.ackHist, 50), TFTP_statsPercentile(totals.ackHist, 99),
+			TFTP_statsPercentile(totals.ioHist, 50), TFTP_statsPercentile(totals.ioHist, 99),
+			TFTP_statsPercentile(totals.wakeHist, 50), TFTP_statsPercentile(totals.wakeHist, 99),
+			load);
+}
@@ -0,0 +1,92 @@
+/*
+ * tftp_stats.h
+ */
+
+#ifndef SRC_TFTP_STATS_H_
+#define SRC_TFTP_STATS_H_
+
+#include "xil_types.h"
+
+/*
+ * Times are collected in histograms with power of two buckets:
+ * bucket 0 counts the samples below 2 us, bucket i the samples from
+ * 2^i us up to 2^(i+1) us and the last bucket everything above.
+ * 20 buckets reach up to about half a second.
+ */
+#define TFTP_STATS_HIST_BUCKETS		20
+
+/* number of finished transfers kept in the history table */
+#define TFTP_STATS_HISTORY			16
+#define TFTP_STATS_NAME_LEN			32
+
+/* metrics of a single transfer */
+typedef struct {
+	/* start of the transfer, in microseconds */
+	u32 startUs;
+
+	/* file data and blocks delivered (RRQ: acknowledged, WRQ: received) */
+	u32 bytes;
+	u32 blocks;
+
+	/* blocks (RRQ) or ACKs (WRQ) sent again */
+	u32 retransmits;
+
+	/* ACKs (RRQ) or DATA blocks (WRQ) received again */
+	u32 duplicates;
+
+	/* expirations of the retransmission timer */
+	u32 timeouts;
+
+	/* time spent in f_read or f_write (and f_sync), in microseconds */
+	u32 ioUs;
+
+	/* round trip times of blocks (RRQ) or ACKs (WRQ) */
+	u32 ackHist[TFTP_STATS_HIST_BUCKETS];
+
+	/* times of single f_read or f_write calls */
+	u32 ioHist[TFTP_STATS_HIST_BUCKETS];
+
+	/* the whole file is transferred */
+	u8 completed;
+} tftp_stats;
+
+/* a finished transfer in the history table */
+typedef struct {
+	char fname[TFTP_STATS_NAME_LEN];
+	u8 upload;
+	u32 durationUs;
+	tftp_stats stats;
+} tftp_stats_record;
+
+/* counters of the server since it started */
+typedef struct {
+	u32 sessions;
+	u32 completed;
+	u32 failed;
+	u32 rejected;
+	u32 bytesSent;
+	u32 bytesReceived;
+	u32 retransmits;
+	u32 duplicates;
+	u32 timeouts;
+	u32 ackHist[TFTP_STATS_HIST_BUCKETS];
+	u32 ioHist[TFTP_STATS_HIST_BUCKETS];
+
+	/* times from a packet interrupt until the main loop handles it */
+	u32 wakeHist[TFTP_STATS_HIST_BUCKETS];
+
+	/* time the core slept since the first transfer after an idle time, in microseconds */
+	u32 idleUs;
+	u32 windowStartUs;
+} tftp_stats_totals;
+
+void TFTP_statsStart(tftp_stats *stats);
+void TFTP_statsAck(tftp_stats *stats, u32 us);
+void TFTP_statsIo(tftp_stats *stats, u32 us);
+void TFTP_statsFinish(tftp_stats *stats, const char *fname, u8 upload);
+void TFTP_statsRejected(void);
+void TFTP_statsWake(u32 us);
+void TFTP_statsIdle(u32 us);
+void TFTP_statsPrintTotals(void);
+
+#endif /* SRC_TFTP_STATS_H_ */
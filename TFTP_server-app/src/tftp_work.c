@@ -0,0 +1,178 @@
+/*
+ * tftp_work.c
+ */
+
+#include "tftp_work.h"
+#include "tftp_server.h"
+#include "tftp_mcast.h"
+#include "tftp_flash.h"
+#include "file_cache.h"
+#include "web_utils.h"
+
+#include <string.h>
+#include <strings.h>
+#include "xil_printf.h"
+
+/* a received file waiting for its work */
+typedef struct {
+	char fname[TFTP_MAX_FNAME_LEN];
+	u8 bootFile;
+	u8 streamed;
+
+	/* the work is already done out of turn (see TFTP_workBootFile) */
+	u8 done;
+} tftp_work;
+
+static tftp_work workQueue[TFTP_WORK_QUEUE_LEN];
+static u32 workHead = 0;
+static u32 workCount = 0;
+
+/* the file tree is listed again when a walk is over */
+static FILETREE tree;
+static u8 treeRequested = 0;
+static u8 treeRunning = 0;
+
+/*
+ * This function does the work of a received file which does not depend
+ * on the others, so it takes a bounded time. A new boot image replaces
+ * the old one, and it is flashed unless it is already programmed while
+ * it was received (streamed).
+ */
+static void TFTP_workFile(tftp_work *work)
+{
+	const char *name;
+
+	setTimestamp(work->fname);
+
+	if (work->bootFile) {
+		/*
+		 * The boot file functions work in the firmwares folder.
+		 * Other sessions open their files by the path given in
+		 * their request, so the current directory is set back
+		 * to the root before returning.
+		 *
+		 * In order for the f_chdir function to work,
+		 * the 'set_fs_rpath' value must be set to '2'
+		 * in the BSP settings.
+		 */
+		f_chdir("/firmwares");
+		checkBootFile();
+		fileCacheInvalidate(BOOT_FILE_PATH);
+		fileCacheInvalidate("/firmwares/" BOOT_FILE_NAME_OLD);
+		f_chdir("/");
+
+		if (!work->streamed && TFTP_flashFile(BOOT_FILE_PATH))
+			xil_printf("The flash is busy with another boot image, %s is not flashed\r\n", work->fname);
+	}
+
+	/* the upload asks the board to fetch a file from a multicast server */
+	name = strrchr(work->fname, '/');
+	name = name ? (name + 1) : work->fname;
+	if (!strcasecmp(name, TFTP_MCAST_REQUEST_FILE))
+		TFTP_mcastStart(work->fname);
+
+	treeRequested = 1;
+}
+
+/* Does the work of the oldest file in the queue */
+static void TFTP_workNext(void)
+{
+	tftp_work *work = &workQueue[workHead];
+
+	workHead = (workHead + 1) % TFTP_WORK_QUEUE_LEN;
+	workCount--;
+
+	if (!work->done)
+		TFTP_workFile(work);
+}
+
+/*****************************************************************************/
+/**
+*
+* This function queues the work of a file which is completely received and
+* closed, either by an upload or by the multicast client. It can be called
+* from the receive callbacks.
+*
+* @param	fname is a pointer to the path of the file.
+* @param	bootFile is 1 if the file is a new boot image.
+* @param	streamed is 1 if the boot image is programmed while it
+*			was received.
+*
+* @return	None.
+*
+* @note		If the queue is full, the work of the oldest file is done
+* 			right away to make room.
+*
+******************************************************************************/
+void TFTP_fileReceived(const char *fname, u8 bootFile, u8 streamed)
+{
+	tftp_work *work;
+
+	if (workCount == TFTP_WORK_QUEUE_LEN)
+		TFTP_workNext();
+
+	work = &workQueue[(workHead + workCount) % TFTP_WORK_QUEUE_LEN];
+	strncpy(work->fname, fname, sizeof(work->fname) - 1);
+	work->fname[sizeof(work->fname) - 1] = '\0';
+	work->bootFile = bootFile;
+	work->streamed = streamed;
+	work->done = 0;
+	workCount++;
+}
+
+/*
+ * This function does the queued work of a received boot image right
+ * away. It is called before a new boot image is received, since the
+ * queued one is still in the temporary file which would be overwritten.
+ * The work of the other files keeps its turn.
+ */
+void TFTP_workBootFile(void)
+{
+	tftp_work *work;
+	u32 i;
+
+	for (i = 0; i < workCount; i++) {
+		work = &workQueue[(workHead + i) % TFTP_WORK_QUEUE_LEN];
+		if (work->bootFile && !work->done) {
+			work->done = 1;
+			TFTP_workFile(work);
+		}
+	}
+}
+
+/*****************************************************************************/
+/**
+*
+* This function does a slice of the queued work. It must be called
+* periodically from the main loop, while the network is idle.
+*
+* @param	None.
+*
+* @return	1 if some work is done, 0 if there is nothing to do.
+*
+******************************************************************************/
+int TFTP_processWork(void)
+{
+	if (workCount) {
+		TFTP_workNext();
+		return 1;
+	}
+
+	if (treeRunning) {
+		if (!stepFileTree(&tree, TFTP_WORK_TREE_ITEMS)) {
+			treeRunning = 0;
+			fileCacheInvalidate(INDEX_FILE_NAME);
+		}
+		return 1;
+	}
+
+	/* the files changed since the last walk */
+	if (treeRequested) {
+		treeRequested = 0;
+		if (!startFileTree(&tree, "0:"))
+			treeRunning = 1;
+		return 1;
+	}
+
+	return 0;
+}
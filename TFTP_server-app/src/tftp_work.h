@@ -0,0 +1,29 @@
+/*
+ * tftp_work.h
+ */
+
+#ifndef SRC_TFTP_WORK_H_
+#define SRC_TFTP_WORK_H_
+
+#include "xil_types.h"
+
+/*
+ * The work which follows a received file (its time stamp, replacing
+ * and flashing the boot image, listing the files and writing the
+ * index.html file) is not done in the receive callbacks of lwIP, since
+ * no packet is received meanwhile. The callbacks put it into a queue,
+ * and the main loop does it in short slices while the network is idle,
+ * so the other transfers go on. A boot image which is not programmed
+ * while it is received is flashed in steps by the flash job (see
+ * tftp_flash.h), and the file tree is listed a few items per slice.
+ */
+#define TFTP_WORK_QUEUE_LEN		8
+
+/* directory items listed in a slice */
+#define TFTP_WORK_TREE_ITEMS	8
+
+void TFTP_fileReceived(const char *fname, u8 bootFile, u8 streamed);
+void TFTP_workBootFile(void);
+int TFTP_processWork(void);
+
+#endif /* SRC_TFTP_WORK_H_ */
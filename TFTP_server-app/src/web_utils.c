@@ -49,7 +49,8 @@ void listDirectory(const char *path)
 	int stackIndex = 0;
 	int nFolder = 0, nFile = 0;
 
-	strncpy(currentPath, path, strlen(path) + 1);
+	strncpy(currentPath, path, sizeof(currentPath) - 1);
+	currentPath[sizeof(currentPath) - 1] = '\0';
 
 	xil_printf(".\r\n");
 
@@ -101,8 +102,8 @@ void listDirectory(const char *path)
 						 * it is required to concatenate the folder name to root path,
 						 * in order to open the directory.
 						 */
-						strncat(currentPath, "/", 2);
-						strncat(currentPath, info.fname, strlen(info.fname) + 1);
+						strncat(currentPath, "/", sizeof(currentPath) - strlen(currentPath) - 1);
+						strncat(currentPath, info.fname, sizeof(currentPath) - strlen(currentPath) - 1);
 
 						/*
 						 * The concatenated directory is opened and
@@ -260,7 +261,8 @@ void createIndexFileTree(const char *path)
 	int stackIndex = 0;
 	int nFolder = 0, nFile = 0;
 
-	strncpy(currentPath, path, strlen(path) + 1);
+	strncpy(currentPath, path, sizeof(currentPath) - 1);
+	currentPath[sizeof(currentPath) - 1] = '\0';
 
 	res = f_opendir(&dir, path);
 	if (res == FR_OK) {
@@ -317,8 +319,8 @@ void createIndexFileTree(const char *path)
 						 * it is required to concatenate the folder name to root path,
 						 * in order to open the directory.
 						 */
-						strncat(currentPath, "/", 2);
-						strncat(currentPath, info.fname, strlen(info.fname) + 1);
+						strncat(currentPath, "/", sizeof(currentPath) - strlen(currentPath) - 1);
+						strncat(currentPath, info.fname, sizeof(currentPath) - strlen(currentPath) - 1);
 
 						/*
 						 * The concatenated directory is opened and
@@ -404,6 +406,167 @@ void createIndexFileTree(const char *path)
 	f_closedir(&dir);
 }
 
+/* Writes a string into the file of a file tree */
+static void writeTreeString(FILETREE *tree, const char *str)
+{
+	UINT numBytesWritten;
+
+	f_write(&tree->file, str, strlen(str), &numBytesWritten);
+}
+
+/*****************************************************************************/
+/**
+*
+* This function starts listing the items of a given directory and writing
+* them into the index.html file, in the same way as the listDirectory and
+* createIndexFileTree functions, but a few items at a time. The items are
+* listed by calling the stepFileTree function until it returns 0.
+*
+* @param	tree is a pointer to the state of the file tree.
+* @param	path is a pointer to the path which wanted to be listed.
+*
+* @return	0 if successful, else -1.
+*
+* @note		The page is written into a temporary file, which replaces
+* 			index.html at the end, so the old page can still be
+* 			downloaded meanwhile.
+*
+******************************************************************************/
+int startFileTree(FILETREE *tree, const char *path)
+{
+	tree->stackIndex = -1;
+	tree->nFolder = 0;
+	tree->nFile = 0;
+
+	if (f_open(&tree->file, INDEX_FILE_NAME_TEMP, FA_CREATE_ALWAYS | FA_WRITE))
+		return -1;
+	writeTreeString(tree, httpHeader);
+
+	strncpy(tree->currentPath, path, sizeof(tree->currentPath) - 1);
+	tree->currentPath[sizeof(tree->currentPath) - 1] = '\0';
+
+	xil_printf(".\r\n");
+
+	if (f_opendir(&tree->stack[0].dir, path) == FR_OK) {
+		tree->stackIndex = 0;
+		tree->stack[0].level = 0;
+	}
+
+	return 0;
+}
+
+/*****************************************************************************/
+/**
+*
+* This function lists the next items of a file tree started with the
+* startFileTree function.
+*
+* @param	tree is a pointer to the state of the file tree.
+* @param	items is the number of directory items read at most.
+*
+* @return	1 if there are more items, 0 if the file tree is complete.
+*
+* @note		None.
+*
+******************************************************************************/
+int stepFileTree(FILETREE *tree, int items)
+{
+	FILINFO info;
+	char itemCountInfo[256];
+
+	while ((items-- > 0) && (tree->stackIndex >= 0)) {
+		DIRSTACK *current = &tree->stack[tree->stackIndex];
+		int currentLevel = current->level;
+
+		/*
+		 * If there is no more files or folders, then close the directory,
+		 * go back to the previous one and close the sublist of the folder.
+		 */
+		if ((f_readdir(&current->dir, &info) != FR_OK) || (info.fname[0] == 0)) {
+			f_closedir(&current->dir);
+			tree->stackIndex--;
+
+			char *previousDir = strrchr(tree->currentPath, '/');
+			if (previousDir)
+				*previousDir = '\0';
+
+			writeTreeString(tree, "\t\t\t</ul>\n");
+			continue;
+		}
+
+		/* the page being written is not listed */
+		if (!currentLevel && !strcmp(info.fname, INDEX_FILE_NAME_TEMP))
+			continue;
+
+		if ((info.fattrib & AM_DIR) && (!strcmp(info.fname, ".") || !strcmp(info.fname, "..")))
+			continue;
+
+		for (int i = 0; i < currentLevel; i++)
+			xil_printf("|  ");
+		xil_printf("|__%s\r\n", info.fname);
+
+		writeTreeString(tree, "\t\t\t");
+		for (int i = 0; i < currentLevel; i++)
+			writeTreeString(tree, "\t");
+
+		if (info.fattrib & AM_DIR) {
+			writeTreeString(tree, "<li><b><i>");
+			writeTreeString(tree, info.fname);
+			writeTreeString(tree, "</i></b></li>\n");
+
+			/* the folder is opened as the next level, if there is room for it */
+			if ((tree->stackIndex + 1) < MAX_FOLDER_LEVEL &&
+				(strlen(tree->currentPath) + strlen(info.fname) + 2) <= sizeof(tree->currentPath)) {
+				DIRSTACK *next = &tree->stack[tree->stackIndex + 1];
+
+				strcat(tree->currentPath, "/");
+				strcat(tree->currentPath, info.fname);
+
+				if (f_opendir(&next->dir, tree->currentPath) == FR_OK) {
+					next->level = currentLevel + 1;
+					tree->stackIndex++;
+
+					writeTreeString(tree, "\t\t\t");
+					for (int i = 0; i < currentLevel; i++)
+						writeTreeString(tree, "\t");
+					writeTreeString(tree, "<ul>\n");
+				}
+				else
+					*strrchr(tree->currentPath, '/') = '\0';
+			}
+
+			if (!currentLevel)
+				tree->nFolder++;
+		}
+		else {
+			writeTreeString(tree, "<li>");
+			writeTreeString(tree, info.fname);
+			writeTreeString(tree, "</li>\n");
+
+			if (!currentLevel)
+				tree->nFile++;
+		}
+	}
+
+	if (tree->stackIndex >= 0)
+		return 1;
+
+	xil_printf("\r\n%d folder(s) and %d file(s) in the root folder.\r\n\n", tree->nFolder, tree->nFile);
+
+	sprintf(itemCountInfo, "\t\t<p><i>%d folder(s) and %d file(s) in the root folder.</i></p>\n",
+			tree->nFolder, tree->nFile);
+	writeTreeString(tree, "\t\t</ul>\n");
+	writeTreeString(tree, itemCountInfo);
+	writeTreeString(tree, "\t</BODY>\n");
+	writeTreeString(tree, "</HTML>");
+	f_close(&tree->file);
+
+	f_unlink(INDEX_FILE_NAME);
+	f_rename(INDEX_FILE_NAME_TEMP, INDEX_FILE_NAME);
+
+	return 0;
+}
+
 /*****************************************************************************/
 /**
 *
@@ -15,6 +15,16 @@
 #define BOOT_FILE_NAME_OLD	"BOOT_old.BIN"
 #define BOOT_FILE_NAME_TEMP	"temp_BOOT.BIN"
 
+/* the current boot image */
+#define BOOT_FILE_PATH		"/firmwares/" BOOT_FILE_NAME
+
+/* a new boot image is received into this file and flashed when it is complete */
+#define BOOT_FILE_PATH_TEMP	"/firmwares/" BOOT_FILE_NAME_TEMP
+
+/* the file tree page, which is written into a temporary file and then replaced */
+#define INDEX_FILE_NAME			"index.html"
+#define INDEX_FILE_NAME_TEMP	"index.tmp"
+
 #define MAX_FOLDER_LEVEL	20
 #define MAX_PATH_LENGTH		512
 #define MAX_FILE_LENGTH		128
@@ -25,8 +35,20 @@ typedef struct {
 	char name[MAX_FILE_LENGTH];
 } DIRSTACK;
 
+/* state of a file tree which is listed and written in steps */
+typedef struct {
+	DIRSTACK stack[MAX_FOLDER_LEVEL];
+	int stackIndex;
+	char currentPath[MAX_PATH_LENGTH];
+	FIL file;
+	int nFolder;
+	int nFile;
+} FILETREE;
+
 void listDirectory(const char *path);
 void createIndexFileTree(const char *path);
+int startFileTree(FILETREE *tree, const char *path);
+int stepFileTree(FILETREE *tree, int items);
 void convertFileSize(char *convertedFileSize, FILINFO *info);
 void setTimestamp(char *fname);
 void checkBootFile(void);
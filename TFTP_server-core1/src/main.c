@@ -0,0 +1,193 @@
+/*
+ * main.c
+ */
+
+/*
+ * The service of the second core in the AMP configuration of the TFTP
+ * server (see tftp_amp.h of TFTP_server-app). It takes the requests of
+ * core 0 from the shared ring, decrypts the boot images and accesses
+ * the QSPI flash, and answers each request when it is done.
+ */
+
+#include "xparameters.h"
+#include "xil_exception.h"
+#include "xil_mmu.h"
+#include "xil_cache.h"
+#include "xscugic.h"
+
+#include "tftp_amp.h"
+#include "qspi.h"
+#include "aes.h"
+
+static XScuGic IntcInstance;
+
+/* the erase or program being done, it is answered when the flash is ready */
+static tftp_amp_msg flashRequest;
+static u8 flashActive = 0;
+
+/* the image is decrypted in parts, the context goes on from part to part */
+static struct AES_ctx ctx;
+
+/* The interrupt of core 0 only wakes the core up, the ring is read by the loop */
+static void requestHandler(void *arg)
+{
+}
+
+/* Puts an answer into the ring and interrupts core 0 */
+static void answer(tftp_amp_msg *msg, s32 status)
+{
+	msg->status = status;
+
+	/* core 0 waits for each of its requests, so the ring has room */
+	while (TFTP_ampPut(&TFTP_ampShared->answers, msg))
+		;
+
+	XScuGic_SoftwareIntr(&IntcInstance, TFTP_AMP_SGI_ANSWER, XSCUGIC_SPI_CPU0_MASK);
+}
+
+/* Starts an erase or a program, which is answered when the flash is ready */
+static void startFlashRequest(tftp_amp_msg *msg, int status)
+{
+	if (status != XST_SUCCESS) {
+		answer(msg, -1);
+		return;
+	}
+
+	flashRequest = *msg;
+	flashActive = 1;
+}
+
+/* The image is decrypted in place in the DDR, where core 0 reads it */
+static void decryptRequest(tftp_amp_msg *msg)
+{
+	u8 *data = (u8 *)msg->data;
+
+	Xil_DCacheInvalidateRange((INTPTR)data, msg->len);
+
+	if (msg->addr)
+		aes_init_ctx_iv(&ctx, key, iv);
+	decrypt_aes(&ctx, data, msg->len);
+
+	Xil_DCacheFlushRange((INTPTR)data, msg->len);
+	answer(msg, 0);
+}
+
+/*
+ * This function checks the flash operation being done and handles the
+ * next request. Returns 1 if some work is done, 0 if there is nothing
+ * to do.
+ */
+static int serveRequests(void)
+{
+	tftp_amp_msg msg;
+	int work = 0;
+	int status;
+
+	if (flashActive) {
+		status = qspiIsBusy();
+		if (status <= 0) {
+			flashActive = 0;
+			answer(&flashRequest, (status < 0) ? -1 : 0);
+			work = 1;
+		}
+	}
+
+	if (!TFTP_ampPeek(&TFTP_ampShared->requests, &msg))
+		return work;
+
+	/* a flash request waits for the operation before it */
+	if (flashActive && (msg.op != TFTP_AMP_DECRYPT))
+		return work;
+
+	TFTP_ampDrop(&TFTP_ampShared->requests);
+
+	switch (msg.op) {
+	case TFTP_AMP_OPEN:
+		answer(&msg, (qspiOpen() == XST_SUCCESS) ? 0 : -1);
+		break;
+
+	case TFTP_AMP_ERASE:
+		startFlashRequest(&msg, qspiStartErase(msg.addr));
+		break;
+
+	case TFTP_AMP_PROGRAM:
+		startFlashRequest(&msg, qspiStartWrite(msg.addr, TFTP_ampShared->page, msg.len));
+		break;
+
+	case TFTP_AMP_READ:
+		status = qspiRead(msg.addr, (u8 *)msg.data, msg.len);
+		Xil_DCacheFlushRange((INTPTR)msg.data, msg.len);
+		answer(&msg, (status == XST_SUCCESS) ? 0 : -1);
+		break;
+
+	case TFTP_AMP_DECRYPT:
+		decryptRequest(&msg);
+		break;
+
+	default:
+		answer(&msg, -1);
+		break;
+	}
+
+	return 1;
+}
+
+/* Sets up the interrupt of the requests, the distributor is set up by core 0 */
+static int setupInterrupts(void)
+{
+	XScuGic_Config *IntcConfig;
+
+	IntcConfig = XScuGic_LookupConfig(XPAR_SCUGIC_SINGLE_DEVICE_ID);
+	if (!IntcConfig)
+		return XST_FAILURE;
+
+	if (XScuGic_CfgInitialize(&IntcInstance, IntcConfig, IntcConfig->CpuBaseAddress) != XST_SUCCESS)
+		return XST_FAILURE;
+
+	Xil_ExceptionInit();
+	Xil_ExceptionRegisterHandler(XIL_EXCEPTION_ID_IRQ_INT,
+			(Xil_ExceptionHandler)XScuGic_InterruptHandler,
+			(void *)&IntcInstance);
+
+	if (XScuGic_Connect(&IntcInstance, TFTP_AMP_SGI_REQUEST,
+			(Xil_ExceptionHandler)requestHandler, NULL) != XST_SUCCESS)
+		return XST_FAILURE;
+
+	XScuGic_Enable(&IntcInstance, TFTP_AMP_SGI_REQUEST);
+	Xil_ExceptionEnableMask(XIL_EXCEPTION_IRQ);
+
+	return XST_SUCCESS;
+}
+
+int main()
+{
+	/* the rings are shared with core 0, they must not be cached */
+	Xil_SetTlbAttributes(TFTP_AMP_SHARED_ADDR, NORM_NONCACHE);
+
+	if (setupInterrupts() != XST_SUCCESS)
+		return -1;
+
+	/* core 0 waits for this before it posts any request */
+	TFTP_ampShared->ready = TFTP_AMP_READY;
+
+	while (1) {
+		if (serveRequests())
+			continue;
+
+		/* the flash is polled until it is ready */
+		if (flashActive)
+			continue;
+
+		/*
+		 * Sleeping until the next request. The interrupts are masked
+		 * while the ring is checked, so a request which comes just
+		 * before WFI still wakes the core up.
+		 */
+		Xil_ExceptionDisableMask(XIL_EXCEPTION_IRQ);
+		if (TFTP_ampShared->requests.head == TFTP_ampShared->requests.tail)
+			__asm__ __volatile__ ("dsb\n\twfi" : : : "memory");
+		Xil_ExceptionEnableMask(XIL_EXCEPTION_IRQ);
+	}
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# Runs the transfer scenarios against the host build of the server.
+#
+# For every scenario in bench/scenarios, the server is started on a new
+# disk image with the impairments of the scenario, and a file of every
+# size is uploaded (WRQ) and then downloaded (RRQ) with tftp_bench. The
+# completion time and goodput of each transfer is printed as a table
+# and written to results/<scenario>.txt, along with the server output.
+#
+#   bench/run.sh                 runs all the scenarios
+#   bench/run.sh loss5 wan       runs the given scenarios
+#
+# The transfers are set with environment variables:
+#
+#   SIZES       file sizes in bytes (default: 65536 1048576 4194304)
+#   BLKSIZE     blksize option (default: 1428)
+#   WINDOWSIZE  windowsize option (default: 8)
+#   TIMEOUT     retransmission timeout of the client in ms (default: 500)
+#   PORT        port of the server, as built (default: 6969)
+#
+
+cd "$(dirname "$0")/.." || exit 1
+
+SERVER=build/tftp_server
+BENCH=build/tftp_bench
+RESULTS=${RESULTS:-results}
+
+SIZES=${SIZES:-"65536 1048576 4194304"}
+BLKSIZE=${BLKSIZE:-1428}
+WINDOWSIZE=${WINDOWSIZE:-8}
+TIMEOUT=${TIMEOUT:-500}
+PORT=${PORT:-6969}
+
+if [ ! -x "$SERVER" ] || [ ! -x "$BENCH" ]; then
+	echo "Build the server and the client first (make)." >&2
+	exit 1
+fi
+
+if [ $# -eq 0 ]; then
+	set -- $(ls bench/scenarios | sed -n 's/\.conf$//p')
+fi
+
+mkdir -p "$RESULTS"
+WORK=$(mktemp -d)
+trap 'kill $PID 2>/dev/null; rm -rf "$WORK"' EXIT
+
+printf "%-10s %-4s %10s %9s %10s %9s %7s %12s\n" \
+	scenario op bytes "time(s)" "Mbit/s" timeouts resent status
+
+for SCENARIO in "$@"; do
+	CONF=bench/scenarios/$SCENARIO.conf
+	if [ ! -f "$CONF" ]; then
+		echo "No scenario $SCENARIO" >&2
+		continue
+	fi
+
+	# the impairments are the first line of the file which is not a comment
+	SPEC=$(grep -v '^#' "$CONF" | grep -v '^ *$' | head -n 1)
+	OUT=$RESULTS/$SCENARIO.txt
+	echo "# $SCENARIO: ${SPEC:-no impairment}, blksize $BLKSIZE, windowsize $WINDOWSIZE" > "$OUT"
+
+	$SERVER -i "$WORK/$SCENARIO.img" -s 64 ${SPEC:+-n "$SPEC"} > "$RESULTS/$SCENARIO.log" 2>&1 &
+	PID=$!
+	sleep 1
+
+	for SIZE in $SIZES; do
+		for OP in put get; do
+			LINE=$($BENCH -p "$PORT" -b "$BLKSIZE" -w "$WINDOWSIZE" -t "$TIMEOUT" \
+				-z "$SIZE" "$OP" "bench_$SIZE.bin" 2>>"$RESULTS/$SCENARIO.log")
+			echo "$LINE" >> "$OUT"
+
+			echo "$LINE" | awk -v s="$SCENARIO" -v op="$OP" -v size="$SIZE" '{
+				for (i = 1; i <= NF; i++) {
+					split($i, kv, "=")
+					v[kv[1]] = kv[2]
+				}
+				printf "%-10s %-4s %10s %9s %10s %9s %7s %12s\n", s, op, size,
+					v["time"], v["goodput"], v["timeouts"], v["resent"], v["status"]
+			}'
+		done
+	done
+
+	# the server prints its totals and the impairment counters when it stops
+	kill -INT $PID
+	wait $PID 2>/dev/null
+	grep "^TFTP totals" "$RESULTS/$SCENARIO.log" | tail -n 1 >> "$OUT"
+	grep "^Impairment" "$RESULTS/$SCENARIO.log" >> "$OUT"
+done
@@ -0,0 +1,559 @@
+/*
+ * tftp_bench.c
+ *
+ * TFTP client used to measure the transfers of the host build. It
+ * downloads (get) or uploads (put) one file with the blksize and
+ * windowsize options, and prints one line with its completion time,
+ * goodput and the packets it had to resend.
+ *
+ * The uploaded data is a pattern of the given size, so a download of
+ * the same file can be checked without keeping the file around.
+ *
+ * A transfer can be resumed from a byte offset with the non-standard
+ * offset option (and the CRC-32 of the part before it for an upload),
+ * and it can be cut off after some bytes to leave a partial upload.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define TFTP_RRQ		1
+#define TFTP_WRQ		2
+#define TFTP_DATA		3
+#define TFTP_ACK		4
+#define TFTP_ERR		5
+#define TFTP_OACK		6
+
+#define BENCH_MAX_BLKSIZE	65464
+#define BENCH_PACKET_LEN	(BENCH_MAX_BLKSIZE + 4)
+
+typedef struct {
+	int fd;
+	struct sockaddr_in server;
+	/* the server answers from a new port, the TID of the transfer */
+	int connected;
+
+	int blksize;
+	int windowsize;
+	int timeoutMs;
+	int retries;
+
+	uint64_t size;
+	int verify;
+
+	/* offset asked for, offset the server accepted and where to stop */
+	uint64_t offset;
+	uint64_t start;
+	uint64_t stopAt;
+	int stopped;
+
+	/* counters of the transfer */
+	uint32_t timeouts;
+	uint32_t resent;
+	uint32_t outOfOrder;
+	uint64_t bytes;
+	uint64_t endUs;
+	/* the final block of an upload is sent, only its ACK is missing */
+	int finalSent;
+} bench;
+
+static uint8_t packet[BENCH_PACKET_LEN];
+
+static uint64_t nowUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The byte at an offset of the test pattern */
+static uint8_t pattern(uint64_t offset)
+{
+	return (uint8_t)((offset * 131) ^ (offset >> 9) ^ (offset >> 17));
+}
+
+/* CRC-32 (IEEE 802.3) of the pattern up to an offset */
+static uint32_t patternCrc(uint64_t len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	uint64_t i;
+	int j;
+
+	for (i = 0; i < len; i++) {
+		crc ^= pattern(i);
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static void sendPacket(bench *b, const uint8_t *data, int len)
+{
+	sendto(b->fd, data, len, 0, (struct sockaddr *)&b->server, sizeof b->server);
+}
+
+static void sendAck(bench *b, uint16_t block)
+{
+	uint8_t ack[4];
+
+	put16(ack, TFTP_ACK);
+	put16(ack + 2, block);
+	sendPacket(b, ack, sizeof ack);
+}
+
+/*
+ * This function waits up to the timeout for a packet of the transfer.
+ * The first packet from the server fixes its port. Returns the length
+ * of the packet, 0 on timeout or -1 on error.
+ */
+static int recvPacket(bench *b)
+{
+	struct pollfd pfd = { .fd = b->fd, .events = POLLIN };
+	struct sockaddr_in from;
+	socklen_t fromLen;
+	uint64_t end = nowUs() + (uint64_t)b->timeoutMs * 1000;
+	int len, left;
+
+	for (;;) {
+		left = (int)(((int64_t)end - (int64_t)nowUs()) / 1000);
+		if ((left < 0) || (poll(&pfd, 1, left) <= 0))
+			return 0;
+
+		fromLen = sizeof from;
+		len = recvfrom(b->fd, packet, sizeof packet, 0, (struct sockaddr *)&from, &fromLen);
+		if ((len < 4) || (from.sin_addr.s_addr != b->server.sin_addr.s_addr))
+			continue;
+
+		if (!b->connected) {
+			b->server.sin_port = from.sin_port;
+			b->connected = 1;
+		}
+		else if (from.sin_port != b->server.sin_port) {
+			continue;
+		}
+
+		if (get16(packet) == TFTP_ERR) {
+			fprintf(stderr, "server error %d: %.*s\n", get16(packet + 2),
+					len - 4, (char *)packet + 4);
+			return -1;
+		}
+
+		return len;
+	}
+}
+
+static int appendOption(uint8_t *p, const char *name, unsigned long value)
+{
+	return sprintf((char *)p, "%s", name) + 1 + sprintf((char *)p + strlen(name) + 1, "%lu", value) + 1;
+}
+
+/* Builds a request with the options of the benchmark, returns its length */
+static int buildRequest(bench *b, int opcode, const char *fname, uint64_t tsize)
+{
+	int len;
+
+	put16(packet, opcode);
+	len = 2 + sprintf((char *)packet + 2, "%s", fname) + 1;
+	len += sprintf((char *)packet + len, "octet") + 1;
+	if (b->blksize != 512)
+		len += appendOption(packet + len, "blksize", b->blksize);
+	if (b->windowsize != 1)
+		len += appendOption(packet + len, "windowsize", b->windowsize);
+	len += appendOption(packet + len, "tsize", tsize);
+	if (b->offset) {
+		len += appendOption(packet + len, "offset", b->offset);
+		if (opcode == TFTP_WRQ)
+			len += appendOption(packet + len, "crc32", patternCrc(b->offset));
+	}
+
+	return len;
+}
+
+/* Takes the negotiated blksize and windowsize from an OACK */
+static void parseOack(bench *b, int len)
+{
+	char *p = (char *)packet + 2, *end = (char *)packet + len;
+	char *name, *value;
+
+	b->blksize = 512;
+	b->windowsize = 1;
+	b->start = 0;
+
+	while (p < end) {
+		name = p;
+		p += strnlen(p, end - p) + 1;
+		if (p >= end)
+			break;
+		value = p;
+		p += strnlen(p, end - p) + 1;
+
+		if (!strcasecmp(name, "blksize"))
+			b->blksize = atoi(value);
+		else if (!strcasecmp(name, "windowsize"))
+			b->windowsize = atoi(value);
+		else if (!strcasecmp(name, "tsize") && !b->size)
+			b->size = strtoull(value, NULL, 10);
+		else if (!strcasecmp(name, "offset"))
+			b->start = strtoull(value, NULL, 10);
+	}
+}
+
+/*
+ * This function downloads a file. Only one ACK is sent per window of
+ * blocks received in order (RFC 7440). A missing block is reported by
+ * acknowledging the last block before it, once. A block received
+ * before is not a gap: a copy of a block after the last ACK is
+ * ignored, and a block up to it means the ACK is lost, so it goes
+ * again, once.
+ */
+static int benchGet(bench *b, const char *fname)
+{
+	uint8_t request[600];
+	int requestLen, len, retries = 0, window = 0, gapAcked = 0;
+	uint32_t expected = 1, acked = 0;
+	uint64_t offset, i;
+	int16_t diff;
+
+	requestLen = buildRequest(b, TFTP_RRQ, fname, 0);
+	memcpy(request, packet, requestLen);
+	sendPacket(b, request, requestLen);
+
+	for (;;) {
+		len = recvPacket(b);
+		if (len < 0)
+			return -1;
+
+		if (!len) {
+			if (++retries > b->retries)
+				return -1;
+			b->timeouts++;
+			b->resent++;
+			/* the request or the last ACK is lost */
+			if (!b->connected)
+				sendPacket(b, request, requestLen);
+			else {
+				acked = expected - 1;
+				sendAck(b, acked & 0xFFFF);
+			}
+			window = 0;
+			continue;
+		}
+
+		if (get16(packet) == TFTP_OACK) {
+			if (expected == 1) {
+				parseOack(b, len);
+				sendAck(b, 0);
+			}
+			continue;
+		}
+
+		if (get16(packet) != TFTP_DATA)
+			continue;
+
+		diff = (int16_t)(get16(packet + 2) - (expected & 0xFFFF));
+		if (diff < 0) {
+			b->outOfOrder++;
+			if (!gapAcked && ((int16_t)(get16(packet + 2) - (acked & 0xFFFF)) <= 0)) {
+				sendAck(b, acked & 0xFFFF);
+				b->resent++;
+				gapAcked = 1;
+			}
+			continue;
+		}
+
+		if (diff) {
+			b->outOfOrder++;
+			if (!gapAcked) {
+				acked = expected - 1;
+				sendAck(b, acked & 0xFFFF);
+				b->resent++;
+				gapAcked = 1;
+				window = 0;
+			}
+			continue;
+		}
+
+		len -= 4;
+		if (b->verify) {
+			offset = b->start + (uint64_t)(expected - 1) * b->blksize;
+			for (i = 0; i < (uint64_t)len; i++) {
+				if (packet[4 + i] != pattern(offset + i)) {
+					fprintf(stderr, "data mismatch at offset %llu\n",
+							(unsigned long long)(offset + i));
+					return -1;
+				}
+			}
+		}
+
+		b->bytes += len;
+		retries = 0;
+		gapAcked = 0;
+
+		if (b->stopAt && (b->bytes >= b->stopAt)) {
+			b->stopped = 1;
+			return -1;
+		}
+
+		if ((len < b->blksize) || (++window >= b->windowsize)) {
+			acked = expected;
+			sendAck(b, acked & 0xFFFF);
+			window = 0;
+		}
+
+		if (len < b->blksize)
+			break;
+		expected++;
+	}
+
+	/*
+	 * The final ACK may be lost, so the client waits for a while
+	 * and acknowledges the final block again if the server resends it.
+	 */
+	b->endUs = nowUs();
+	while ((len = recvPacket(b)) > 0) {
+		if ((get16(packet) == TFTP_DATA) && (get16(packet + 2) == (expected & 0xFFFF)))
+			sendAck(b, expected & 0xFFFF);
+	}
+
+	return 0;
+}
+
+/* Builds the data packet of a block of the pattern, returns its length */
+static int buildBlock(bench *b, uint32_t block)
+{
+	uint64_t offset = b->start + (uint64_t)(block - 1) * b->blksize;
+	int len, i;
+
+	len = ((b->size - offset) < (uint64_t)b->blksize) ? (int)(b->size - offset) : b->blksize;
+
+	put16(packet, TFTP_DATA);
+	put16(packet + 2, block & 0xFFFF);
+	for (i = 0; i < len; i++)
+		packet[4 + i] = pattern(offset + i);
+
+	return len + 4;
+}
+
+/*
+ * This function uploads a pattern of the given size. A window of blocks
+ * is sent after every ACK, starting from the block after the ACK, so an
+ * ACK of an earlier block makes the missing blocks go again.
+ */
+static int benchPut(bench *b, const char *fname)
+{
+	uint8_t request[600];
+	uint32_t acked = 0, next = 1, lastBlock;
+	int requestLen, len, retries = 0, started = 0;
+	int16_t diff;
+
+	lastBlock = b->size / b->blksize + 1;
+	b->start = 0;
+
+	requestLen = buildRequest(b, TFTP_WRQ, fname, b->size);
+	memcpy(request, packet, requestLen);
+	sendPacket(b, request, requestLen);
+
+	for (;;) {
+		/* the window after the last ACK */
+		while (started && (next <= lastBlock) && (next < acked + 1 + b->windowsize)) {
+			len = buildBlock(b, next);
+			sendPacket(b, packet, len);
+			if (next == lastBlock)
+				b->finalSent = 1;
+			next++;
+		}
+
+		len = recvPacket(b);
+		if (len < 0)
+			return -1;
+
+		if (!len) {
+			if (++retries > b->retries)
+				return -1;
+			b->timeouts++;
+			if (!started) {
+				sendPacket(b, request, requestLen);
+				b->resent++;
+			}
+			else {
+				b->resent += next - acked - 1;
+				next = acked + 1;
+			}
+			continue;
+		}
+
+		if (get16(packet) == TFTP_OACK) {
+			if (!started) {
+				uint64_t size = b->size;
+
+				parseOack(b, len);
+				b->size = size;
+				lastBlock = (b->size - b->start) / b->blksize + 1;
+				started = 1;
+			}
+			continue;
+		}
+
+		if (get16(packet) != TFTP_ACK)
+			continue;
+
+		if (!started) {
+			/* the server ignored the options */
+			if (get16(packet + 2))
+				continue;
+			b->blksize = 512;
+			b->windowsize = 1;
+			lastBlock = b->size / b->blksize + 1;
+			started = 1;
+			continue;
+		}
+
+		diff = (int16_t)(get16(packet + 2) - (acked & 0xFFFF));
+		if ((diff < 0) || ((acked + diff) >= next))
+			continue;
+
+		/*
+		 * A repeated ACK is ignored, only the timeout resends blocks,
+		 * the same as the server does. A duplicated ACK would otherwise
+		 * make every following window go twice.
+		 */
+		if (!diff)
+			continue;
+
+		acked += diff;
+		retries = 0;
+
+		/* an ACK before the last block sent makes the blocks after it go again */
+		if (acked + 1 < next) {
+			b->resent += next - acked - 1;
+			next = acked + 1;
+		}
+
+		/* the client is cut off, as if its link went down */
+		if (b->stopAt && (((uint64_t)acked * b->blksize) >= b->stopAt)) {
+			b->bytes = (uint64_t)acked * b->blksize;
+			b->stopped = 1;
+			return -1;
+		}
+
+		if (acked == lastBlock) {
+			b->bytes = b->size - b->start;
+			b->endUs = nowUs();
+			return 0;
+		}
+	}
+
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-a address] [-p port] [-b blksize] [-w windowsize]\n"
+			"          [-t timeout_ms] [-r retries] [-z size] [-o offset] [-x bytes] get|put file\n"
+			"  -z  size of the uploaded pattern, or of the expected download to check\n"
+			"  -o  resume the transfer from a byte offset\n"
+			"  -x  stop after transferring this many bytes, leaving it unfinished\n",
+			name);
+}
+
+int main(int argc, char *argv[])
+{
+	bench b;
+	const char *address = "127.0.0.1";
+	int port = 6969, opt, ret, put, rcvbuf = 4 * 1024 * 1024;
+	uint64_t start, elapsed;
+
+	memset(&b, 0, sizeof b);
+	b.blksize = 512;
+	b.windowsize = 1;
+	b.timeoutMs = 1000;
+	b.retries = 8;
+
+	while ((opt = getopt(argc, argv, "a:p:b:w:t:r:z:o:x:h")) != -1) {
+		switch (opt) {
+		case 'a': address = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'b': b.blksize = atoi(optarg); break;
+		case 'w': b.windowsize = atoi(optarg); break;
+		case 't': b.timeoutMs = atoi(optarg); break;
+		case 'r': b.retries = atoi(optarg); break;
+		case 'z': b.size = strtoull(optarg, NULL, 0); b.verify = 1; break;
+		case 'o': b.offset = strtoull(optarg, NULL, 0); break;
+		case 'x': b.stopAt = strtoull(optarg, NULL, 0); break;
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : 2;
+		}
+	}
+
+	if ((argc - optind != 2) || (b.blksize < 8) || (b.blksize > BENCH_MAX_BLKSIZE) ||
+			(b.windowsize < 1)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	put = !strcmp(argv[optind], "put");
+	if (!put && strcmp(argv[optind], "get")) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (put && !b.verify) {
+		fprintf(stderr, "put needs the size of the pattern (-z)\n");
+		return 2;
+	}
+
+	b.fd = socket(AF_INET, SOCK_DGRAM, 0);
+	setsockopt(b.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+	b.server.sin_family = AF_INET;
+	b.server.sin_port = htons(port);
+	if (inet_pton(AF_INET, address, &b.server.sin_addr) != 1) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	start = nowUs();
+	ret = put ? benchPut(&b, argv[optind + 1]) : benchGet(&b, argv[optind + 1]);
+	elapsed = (ret ? nowUs() : b.endUs) - start;
+
+	if (!ret && b.verify && !put && (b.bytes != (b.size - b.start))) {
+		fprintf(stderr, "size mismatch: %llu bytes received\n", (unsigned long long)b.bytes);
+		ret = -1;
+	}
+
+	/*
+	 * An upload whose final block is sent but never acknowledged is
+	 * reported apart, the server may have stored it and lost the ACK.
+	 */
+	printf("op=%s offset=%llu bytes=%llu time=%.3f goodput=%.2f blksize=%d windowsize=%d "
+			"timeouts=%u resent=%u outoforder=%u status=%s\n",
+			argv[optind], (unsigned long long)b.start, (unsigned long long)b.bytes, elapsed / 1e6,
+			elapsed ? (b.bytes * 8.0 / elapsed) : 0.0, b.blksize, b.windowsize,
+			b.timeouts, b.resent, b.outOfOrder,
+			!ret ? "ok" : b.stopped ? "stopped" : b.finalSent ? "unconfirmed" : "failed");
+
+	close(b.fd);
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * diskio_host.c
+ *
+ * FatFs disk access of the host build. The SD card is a disk image
+ * file, which can also be mounted on the workstation (mount -o loop).
+ */
+
+#include "host.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ff.h"
+#include "diskio.h"
+
+static int imageFd = -1;
+static DWORD imageSectors;
+
+/*
+ * This function opens the disk image, creating a sparse image of
+ * sizeMb megabytes if it does not exist. Returns 1 if the image is
+ * created (so it must be formatted), 0 if it exists or -1 on error.
+ */
+int hostDiskOpen(const char *path, u32 sizeMb)
+{
+	struct stat st;
+	int created = 0;
+
+	imageFd = open(path, O_RDWR | O_CREAT, 0644);
+	if ((imageFd < 0) || fstat(imageFd, &st))
+		return -1;
+
+	if (!st.st_size) {
+		if (ftruncate(imageFd, (off_t)sizeMb * 1024 * 1024))
+			return -1;
+		st.st_size = (off_t)sizeMb * 1024 * 1024;
+		created = 1;
+	}
+
+	imageSectors = st.st_size / FF_MAX_SS;
+
+	return created;
+}
+
+void hostDiskClose(void)
+{
+	if (imageFd >= 0)
+		close(imageFd);
+	imageFd = -1;
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+	return (pdrv || (imageFd < 0)) ? STA_NOINIT : 0;
+}
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+	return disk_status(pdrv);
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+	size_t len = (size_t)count * FF_MAX_SS;
+
+	if (disk_status(pdrv))
+		return RES_NOTRDY;
+
+	if (pread(imageFd, buff, len, (off_t)sector * FF_MAX_SS) != (ssize_t)len)
+		return RES_ERROR;
+
+	return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+{
+	size_t len = (size_t)count * FF_MAX_SS;
+
+	if (disk_status(pdrv))
+		return RES_NOTRDY;
+
+	if (pwrite(imageFd, buff, len, (off_t)sector * FF_MAX_SS) != (ssize_t)len)
+		return RES_ERROR;
+
+	return RES_OK;
+}
+
+/*
+ * CTRL_SYNC leaves the image in the page cache of the workstation, so
+ * the server logic is measured and not the disk of the workstation.
+ */
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+	if (disk_status(pdrv))
+		return RES_NOTRDY;
+
+	switch (cmd) {
+	case CTRL_SYNC:
+		return RES_OK;
+	case GET_SECTOR_COUNT:
+		*(DWORD *)buff = imageSectors;
+		return RES_OK;
+	case GET_SECTOR_SIZE:
+		*(WORD *)buff = FF_MAX_SS;
+		return RES_OK;
+	case GET_BLOCK_SIZE:
+		*(DWORD *)buff = 1;
+		return RES_OK;
+	default:
+		return RES_PARERR;
+	}
+}
+
+DWORD get_fattime(void)
+{
+	time_t now = time(NULL);
+	struct tm *tm = localtime(&now);
+
+	return ((DWORD)(tm->tm_year - 80) << 25) | ((DWORD)(tm->tm_mon + 1) << 21) |
+			((DWORD)tm->tm_mday << 16) | ((DWORD)tm->tm_hour << 11) |
+			((DWORD)tm->tm_min << 5) | ((DWORD)tm->tm_sec >> 1);
+}
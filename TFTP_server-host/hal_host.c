@@ -0,0 +1,195 @@
+/*
+ * hal_host.c
+ *
+ * Board services of the host build: the clock, the flash, the RTC
+ * and the console.
+ */
+
+#include "host.h"
+#include "tftp_hal.h"
+#include "tftp_flash.h"
+#include "file_cache.h"
+#include "rtc.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+char fileCacheArena[FILE_CACHE_SIZE] __attribute__ ((aligned(64)));
+char hostFlashBuffer[TFTP_FLASH_MAX_IMAGE + 16];
+
+/*
+ * The QSPI flash of the ZC702 (16 MB), with the typical times of its
+ * sector erase and page program. Programming can only clear bits, as
+ * on the real flash, so a page which is not erased shows up when the
+ * image is verified.
+ */
+#define HOST_FLASH_SIZE			(16 * 1024 * 1024)
+#define HOST_FLASH_ERASE_US		700000
+#define HOST_FLASH_PROGRAM_US	500
+
+static u8 hostFlash[HOST_FLASH_SIZE];
+static u32 hostFlashBusyUntil;
+static u8 hostFlashBusy;
+
+u32 TFTP_getTimeUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u32)((u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* Loads the flash from a file, an erased flash is used if it does not exist */
+void hostFlashLoad(const char *path)
+{
+	FILE *file = path ? fopen(path, "rb") : NULL;
+
+	memset(hostFlash, 0xFF, sizeof hostFlash);
+	if (file) {
+		if (fread(hostFlash, 1, sizeof hostFlash, file) != sizeof hostFlash)
+			xil_printf("%s is smaller than the flash\r\n", path);
+		fclose(file);
+	}
+}
+
+void hostFlashSave(const char *path)
+{
+	FILE *file = fopen(path, "wb");
+
+	if (!file || (fwrite(hostFlash, 1, sizeof hostFlash, file) != sizeof hostFlash))
+		perror(path);
+	if (file)
+		fclose(file);
+}
+
+static void hostFlashStart(u32 us)
+{
+	hostFlashBusyUntil = TFTP_getTimeUs() + us;
+	hostFlashBusy = 1;
+}
+
+int TFTP_halFlashOpen(void)
+{
+	return 0;
+}
+
+int TFTP_halFlashErase(u32 addr)
+{
+	if (hostFlashBusy || (addr >= HOST_FLASH_SIZE))
+		return -1;
+
+	memset(hostFlash + (addr & ~(TFTP_FLASH_SECTOR_SIZE - 1)), 0xFF, TFTP_FLASH_SECTOR_SIZE);
+	hostFlashStart(HOST_FLASH_ERASE_US);
+
+	return 0;
+}
+
+int TFTP_halFlashProgram(u32 addr, const u8 *data, u32 len)
+{
+	u32 i;
+
+	if (hostFlashBusy || ((addr + len) > HOST_FLASH_SIZE))
+		return -1;
+
+	for (i = 0; i < len; i++)
+		hostFlash[addr + i] &= data[i];
+	hostFlashStart(HOST_FLASH_PROGRAM_US);
+
+	return 0;
+}
+
+int TFTP_halFlashRead(u32 addr, u8 *data, u32 len)
+{
+	if ((addr + len) > HOST_FLASH_SIZE)
+		return -1;
+
+	memcpy(data, hostFlash + addr, len);
+
+	return 0;
+}
+
+int TFTP_halFlashBusy(void)
+{
+	if (hostFlashBusy && ((s32)(TFTP_getTimeUs() - hostFlashBusyUntil) >= 0))
+		hostFlashBusy = 0;
+
+	return hostFlashBusy;
+}
+
+int I2CInit(u16 DeviceId)
+{
+	return XST_SUCCESS;
+}
+
+int GetCurrentTime(RTC_INFO *info)
+{
+	time_t now = time(NULL);
+	struct tm *tm = localtime(&now);
+
+	info->year = tm->tm_year - 100;
+	info->month = tm->tm_mon + 1;
+	info->day = tm->tm_mday;
+	info->week = tm->tm_wday;
+	info->hour = tm->tm_hour;
+	info->minute = tm->tm_min;
+	info->second = tm->tm_sec;
+
+	return XST_SUCCESS;
+}
+
+/*
+ * xil_printf of the host. The 'l' modifier is ignored, since longs are
+ * 32 bits long on the board and the server prints its u32 values with it.
+ */
+void xil_printf(const char8 *ctrl1, ...)
+{
+	char spec[16];
+	const char *f;
+	va_list ap;
+	int n;
+
+	va_start(ap, ctrl1);
+
+	for (f = ctrl1; *f; f++) {
+		if (*f != '%') {
+			putchar(*f);
+			continue;
+		}
+
+		/* copying the flags and the width, and dropping the modifiers */
+		spec[0] = '%';
+		n = 1;
+		while (*++f && strchr("-0123456789", *f) && (n < (int)sizeof spec - 2))
+			spec[n++] = *f;
+		while (*f == 'l')
+			f++;
+		if (!*f)
+			break;
+		spec[n++] = *f;
+		spec[n] = '\0';
+
+		switch (*f) {
+		case 'd':
+			printf(spec, va_arg(ap, int));
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'c':
+			printf(spec, va_arg(ap, unsigned int));
+			break;
+		case 's':
+			printf(spec, va_arg(ap, char *));
+			break;
+		default:
+			putchar(*f);
+			break;
+		}
+	}
+
+	va_end(ap);
+	fflush(stdout);
+}
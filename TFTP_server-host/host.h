@@ -0,0 +1,40 @@
+/*
+ * host.h
+ *
+ * Host (Linux) implementation of the services the TFTP server takes
+ * from the board, see tftp_hal.h.
+ */
+
+#ifndef HOST_H_
+#define HOST_H_
+
+#include "xil_types.h"
+
+/* the file cache and the image being flashed live in ordinary arrays on the host */
+extern char fileCacheArena[];
+extern char hostFlashBuffer[];
+
+/* hal_host.c */
+void hostFlashLoad(const char *path);
+void hostFlashSave(const char *path);
+
+/* udp_host.c */
+void hostUdpSetAddress(u32 addr);
+int hostUdpPoll(int timeoutMs);
+void hostUdpTransmit(int fd, const u8 *data, int len, u32 addr, u16 port);
+int hostUdpDeliver(int pcb, int fd, const u8 *data, int len, u32 addr, u16 port);
+
+/* impair_host.c */
+int hostImpairSetup(const char *spec);
+int hostImpairOutput(int fd, const u8 *data, int len, u32 addr, u16 port);
+int hostImpairInput(int pcb, int fd, const u8 *data, int len, u32 addr, u16 port);
+int hostImpairClose(int fd);
+int hostImpairRun(void);
+int hostImpairNextMs(void);
+void hostImpairPrint(void);
+
+/* diskio_host.c */
+int hostDiskOpen(const char *path, u32 sizeMb);
+void hostDiskClose(void);
+
+#endif /* HOST_H_ */
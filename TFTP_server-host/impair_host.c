@@ -0,0 +1,413 @@
+/*
+ * impair_host.c
+ *
+ * Network impairment layer of the host build. The datagrams sent and
+ * received by the server can be dropped, duplicated, delayed with
+ * jitter, reordered and paced to a bandwidth, so lossy and slow links
+ * are reproduced on a workstation. Every decision is drawn from a
+ * seeded random generator, so a run can be repeated with the same seed.
+ *
+ * The impairments are given as a comma separated list, for example
+ * "loss=2,dup=0.5,reorder=1,delay=20,jitter=5,rate=10000,seed=7":
+ *
+ *   loss=<%>       drop rate of the datagrams
+ *   dup=<%>        duplication rate of the datagrams
+ *   reorder=<%>    rate of the datagrams held back by 'gap' ms
+ *   gap=<ms>       extra delay of a reordered datagram (default 5)
+ *   delay=<ms>     one way delay
+ *   jitter=<ms>    random variation of the delay, up to +/- jitter, in order
+ *   rate=<kbit/s>  bandwidth of the link in each direction
+ *   queue=<n>      datagrams waiting for the link before it drops (default 256)
+ *   seed=<n>       seed of the random generator (default 1)
+ *
+ * The same impairments apply to both directions, each with its own link.
+ */
+
+#include "host.h"
+#include "xil_printf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HOST_IMPAIR_MAX_PENDING		8192
+
+enum {
+	HOST_IMPAIR_IN,
+	HOST_IMPAIR_OUT,
+	HOST_IMPAIR_DIRS
+};
+
+typedef struct host_datagram {
+	struct host_datagram *next;
+	u64 due;
+	int dir;
+	int pcb;
+	int fd;
+	u32 addr;
+	u16 port;
+	/* the socket is closed by the PCB and waits for its last datagram */
+	u8 closeFd;
+	int len;
+	u8 data[];
+} host_datagram;
+
+typedef struct {
+	double loss;
+	double dup;
+	double reorder;
+	u32 gapUs;
+	u32 delayUs;
+	u32 jitterUs;
+	u32 rateKbps;
+	u32 queue;
+} host_impair;
+
+typedef struct {
+	/* the time the link finishes sending the datagrams given to it */
+	u64 linkFree;
+	/* the arrival time of the last datagram which is not held back */
+	u64 lastDue;
+
+	u32 packets;
+	u32 dropped;
+	u32 duplicated;
+	u32 reordered;
+	u32 overflows;
+} host_link;
+
+static host_impair impair;
+static host_link links[HOST_IMPAIR_DIRS];
+static u8 active = 0;
+static u64 rng = 1;
+
+/* datagrams waiting for their time, in the order of their due times */
+static host_datagram *pending = NULL;
+static host_datagram *pendingTail = NULL;
+static u32 pendingCount = 0;
+
+static u64 hostNowUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, a small generator giving the same sequence for a seed */
+static u64 hostRandom(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+
+	return rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* Returns 1 with the given percentage */
+static int hostChance(double percent)
+{
+	if (percent <= 0)
+		return 0;
+
+	return ((hostRandom() >> 11) * (1.0 / 9007199254740992.0) * 100.0) < percent;
+}
+
+/* Returns a random value in [-range, +range] */
+static s64 hostSpread(u32 range)
+{
+	if (!range)
+		return 0;
+
+	return (s64)(hostRandom() % (2 * (u64)range + 1)) - range;
+}
+
+/*
+ * This function parses the impairments of the layer. Returns 0, or -1
+ * if the list has an unknown name or a bad value.
+ */
+int hostImpairSetup(const char *spec)
+{
+	char buf[256], *item, *value, *end, *save;
+	double num;
+
+	memset(&impair, 0, sizeof impair);
+	impair.gapUs = 5000;
+	impair.queue = 256;
+	rng = 1;
+
+	if (strlen(spec) >= sizeof buf)
+		return -1;
+	strcpy(buf, spec);
+
+	for (item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		value = strchr(item, '=');
+		if (!value)
+			return -1;
+		*value++ = '\0';
+
+		num = strtod(value, &end);
+		if ((end == value) || *end || (num < 0))
+			return -1;
+
+		if (!strcmp(item, "loss"))
+			impair.loss = num;
+		else if (!strcmp(item, "dup"))
+			impair.dup = num;
+		else if (!strcmp(item, "reorder"))
+			impair.reorder = num;
+		else if (!strcmp(item, "gap"))
+			impair.gapUs = num * 1000;
+		else if (!strcmp(item, "delay"))
+			impair.delayUs = num * 1000;
+		else if (!strcmp(item, "jitter"))
+			impair.jitterUs = num * 1000;
+		else if (!strcmp(item, "rate"))
+			impair.rateKbps = num;
+		else if (!strcmp(item, "queue"))
+			impair.queue = num;
+		else if (!strcmp(item, "seed"))
+			rng = (u64)num ? (u64)num : 1;
+		else
+			return -1;
+	}
+
+	/* a few rounds, so close seeds do not start alike */
+	rng *= 0x9E3779B97F4A7C15ULL;
+	hostRandom();
+	hostRandom();
+
+	active = 1;
+
+	return 0;
+}
+
+static void hostImpairQueue(host_datagram *d)
+{
+	host_datagram **pp = &pending;
+
+	/*
+	 * Datagrams due at the same time keep their order. Most of them
+	 * are due after all the others, so the tail is checked first.
+	 */
+	if (pendingTail && (pendingTail->due <= d->due))
+		pp = &pendingTail->next;
+	else {
+		while (*pp && ((*pp)->due <= d->due))
+			pp = &(*pp)->next;
+	}
+
+	d->next = *pp;
+	*pp = d;
+	if (!d->next)
+		pendingTail = d;
+	pendingCount++;
+}
+
+/*
+ * This function passes a datagram through the link of its direction,
+ * deciding if it is lost, duplicated or held back and when it arrives.
+ */
+static void hostImpairLink(int dir, int pcb, int fd, const u8 *data, int len, u32 addr, u16 port)
+{
+	host_link *link = &links[dir];
+	host_datagram *d;
+	u64 now = hostNowUs();
+	u64 start, txUs, due;
+	s64 delay;
+	int copies, i;
+
+	link->packets++;
+
+	if (hostChance(impair.loss)) {
+		link->dropped++;
+		return;
+	}
+
+	copies = 1;
+	if (hostChance(impair.dup)) {
+		link->duplicated++;
+		copies = 2;
+	}
+
+	for (i = 0; i < copies; i++) {
+		if (pendingCount >= HOST_IMPAIR_MAX_PENDING) {
+			link->overflows++;
+			return;
+		}
+
+		/*
+		 * A bandwidth limited link sends the datagrams one after the
+		 * other and drops them when too many are waiting for it.
+		 */
+		start = now;
+		if (impair.rateKbps) {
+			txUs = (u64)len * 8000 / impair.rateKbps;
+			if (link->linkFree < now)
+				link->linkFree = now;
+			if ((link->linkFree - now) >= (u64)impair.queue * txUs) {
+				link->overflows++;
+				return;
+			}
+			link->linkFree += txUs;
+			start = link->linkFree;
+		}
+
+		delay = (s64)impair.delayUs + hostSpread(impair.jitterUs);
+		if (delay < 0)
+			delay = 0;
+		due = start + delay;
+
+		/*
+		 * The jitter varies the delay but keeps the datagrams in order,
+		 * only the held back ones are overtaken by the ones after them.
+		 */
+		if (hostChance(impair.reorder)) {
+			link->reordered++;
+			due += impair.gapUs;
+		}
+		else {
+			if (due < link->lastDue)
+				due = link->lastDue;
+			link->lastDue = due;
+		}
+
+		d = malloc(sizeof *d + len);
+		if (!d) {
+			link->overflows++;
+			return;
+		}
+
+		d->due = due;
+		d->dir = dir;
+		d->pcb = pcb;
+		d->fd = fd;
+		d->addr = addr;
+		d->port = port;
+		d->closeFd = 0;
+		d->len = len;
+		memcpy(d->data, data, len);
+
+		hostImpairQueue(d);
+	}
+}
+
+/* Returns 1 if the datagram is taken over by the layer, 0 if it is sent as is */
+int hostImpairOutput(int fd, const u8 *data, int len, u32 addr, u16 port)
+{
+	if (!active)
+		return 0;
+
+	hostImpairLink(HOST_IMPAIR_OUT, -1, fd, data, len, addr, port);
+
+	return 1;
+}
+
+/* Returns 1 if the datagram is taken over by the layer, 0 if it is delivered as is */
+int hostImpairInput(int pcb, int fd, const u8 *data, int len, u32 addr, u16 port)
+{
+	if (!active)
+		return 0;
+
+	hostImpairLink(HOST_IMPAIR_IN, pcb, fd, data, len, addr, port);
+
+	return 1;
+}
+
+/*
+ * This function is called when the socket of a PCB is closed. The
+ * datagrams received on it are dropped, while the ones sent on it, like
+ * the final ACK of a transfer, still go out. Returns 1 if the socket is
+ * closed after its last datagram, or 0 if it can be closed now.
+ */
+int hostImpairClose(int fd)
+{
+	host_datagram *d, *last = NULL;
+
+	for (d = pending; d; d = d->next) {
+		if (d->fd != fd)
+			continue;
+		if (d->dir == HOST_IMPAIR_OUT)
+			last = d;
+		else
+			d->fd = -1;
+	}
+
+	if (!last)
+		return 0;
+
+	last->closeFd = 1;
+
+	return 1;
+}
+
+/*
+ * This function sends and delivers the datagrams whose time has come.
+ * It returns the number of datagrams delivered to the server.
+ */
+int hostImpairRun(void)
+{
+	host_datagram *d;
+	u64 now;
+	int delivered = 0;
+
+	if (!pending)
+		return 0;
+
+	now = hostNowUs();
+
+	while (pending && (pending->due <= now)) {
+		d = pending;
+		pending = d->next;
+		if (!pending)
+			pendingTail = NULL;
+		pendingCount--;
+
+		if (d->dir == HOST_IMPAIR_OUT) {
+			hostUdpTransmit(d->fd, d->data, d->len, d->addr, d->port);
+			if (d->closeFd)
+				close(d->fd);
+		}
+		else if (hostUdpDeliver(d->pcb, d->fd, d->data, d->len, d->addr, d->port))
+			delivered++;
+
+		free(d);
+	}
+
+	return delivered;
+}
+
+/* Returns the time until the next datagram is due in ms, or -1 if none is waiting */
+int hostImpairNextMs(void)
+{
+	u64 now;
+
+	if (!pending)
+		return -1;
+
+	now = hostNowUs();
+	if (pending->due <= now)
+		return 0;
+
+	return (pending->due - now + 999) / 1000;
+}
+
+void hostImpairPrint(void)
+{
+	static const char *names[HOST_IMPAIR_DIRS] = { "in", "out" };
+	host_link *link;
+	int i;
+
+	if (!active)
+		return;
+
+	for (i = 0; i < HOST_IMPAIR_DIRS; i++) {
+		link = &links[i];
+		xil_printf("Impairment %s: %lu packets, %lu dropped, %lu duplicated, "
+				"%lu reordered, %lu overflows\r\n", names[i], link->packets,
+				link->dropped, link->duplicated, link->reordered, link->overflows);
+	}
+}
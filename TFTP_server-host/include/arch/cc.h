@@ -0,0 +1,19 @@
+/*
+ * cc.h
+ *
+ * lwIP architecture header of the host build.
+ */
+
+#ifndef ARCH_CC_H_
+#define ARCH_CC_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LWIP_PLATFORM_DIAG(x)	do { printf x; } while (0)
+#define LWIP_PLATFORM_ASSERT(x)	do { fprintf(stderr, "Assertion \"%s\" failed at line %d in %s\n", \
+									x, __LINE__, __FILE__); abort(); } while (0)
+
+#define LWIP_RAND()				((u32_t)rand())
+
+#endif /* ARCH_CC_H_ */
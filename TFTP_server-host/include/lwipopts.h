@@ -0,0 +1,45 @@
+/*
+ * lwipopts.h
+ *
+ * lwIP options of the host build. Only the pbuf and address code of
+ * lwIP is used here, the UDP API and the group membership are provided
+ * by udp_host.c on top of BSD sockets. The pbuf options follow the BSP settings, so received
+ * blocks are chains of pool pbufs as on the board.
+ */
+
+#ifndef LWIPOPTS_H_
+#define LWIPOPTS_H_
+
+#define NO_SYS						1
+#define SYS_LIGHTWEIGHT_PROT		0
+#define LWIP_TIMERS					0
+
+#define LWIP_SOCKET					0
+#define LWIP_NETCONN				0
+
+#define LWIP_IPV4					1
+#define LWIP_IPV6					0
+#define LWIP_TCP					0
+#define LWIP_UDP					1
+#define LWIP_RAW					0
+#define LWIP_ARP					0
+#define LWIP_ICMP					0
+#define LWIP_DHCP					0
+#define LWIP_IGMP					1
+
+/* the server sends blocks by reference to its rings */
+#define LWIP_SUPPORT_CUSTOM_PBUF	1
+
+#define MEM_LIBC_MALLOC				1
+#define MEMP_MEM_MALLOC				1
+#define MEM_ALIGNMENT				8
+
+#define MEMP_NUM_PBUF				256
+#define MEMP_NUM_UDP_PCB			40
+#define PBUF_POOL_SIZE				256
+#define PBUF_POOL_BUFSIZE			1700
+#define PBUF_LINK_HLEN				16
+
+#define LWIP_STATS					0
+
+#endif /* LWIPOPTS_H_ */
@@ -0,0 +1,168 @@
+/*
+ * main.c
+ *
+ * Host (Linux) build of the TFTP server. It runs the same server
+ * logic as the board, on BSD sockets and with a disk image file in
+ * place of the SD card, so the protocol engine can be profiled and
+ * tested on a workstation.
+ */
+
+#include "host.h"
+#include "tftp_server.h"
+#include "tftp_work.h"
+#include "tftp_event.h"
+#include "tftp_flash.h"
+#include "web_utils.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lwip/mem.h"
+#include "lwip/memp.h"
+#include "lwip/netif.h"
+
+/* the address of the server, as the board keeps it in its network interface */
+struct netif server_netif;
+
+TCHAR *Path = "0:";
+
+static volatile sig_atomic_t stop = 0;
+
+static void onSignal(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-i image] [-s size_mb] [-a address] [-n impairments] [-q flash] [-f]\n"
+			"  -i  disk image used as the SD card (default: sd.img)\n"
+			"  -s  size of a new disk image in megabytes (default: 256)\n"
+			"  -a  address the server listens on (default: 127.0.0.1)\n"
+			"  -n  impairments of the network, e.g. loss=1,delay=20,jitter=5,seed=3\n"
+			"      (loss, dup, reorder, gap, delay, jitter, rate, queue, seed)\n"
+			"  -q  file holding the content of the QSPI flash, saved on exit\n"
+			"  -f  format the disk image\n", name);
+}
+
+/* This function formats the disk image and creates the folders of the board */
+static int formatImage(void)
+{
+	static BYTE work[FF_MAX_SS * 64];
+
+	if (f_mkfs(Path, FM_ANY, 0, work, sizeof work) != FR_OK) {
+		xil_printf("Failed to format the disk image!\r\n");
+		return -1;
+	}
+
+	if (initFileSystem(Path, 0))
+		return -1;
+
+	f_mkdir("logs");
+	setTimestamp("/logs");
+	f_mkdir("firmwares");
+	setTimestamp("/firmwares");
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *image = "sd.img";
+	const char *address = "127.0.0.1";
+	const char *flash = NULL;
+	u32 sizeMb = 256;
+	int format = 0;
+	int opt, ret, work, received;
+
+	while ((opt = getopt(argc, argv, "i:s:a:n:q:fh")) != -1) {
+		switch (opt) {
+		case 'i':
+			image = optarg;
+			break;
+		case 's':
+			sizeMb = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			address = optarg;
+			break;
+		case 'n':
+			if (hostImpairSetup(optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'q':
+			flash = optarg;
+			break;
+		case 'f':
+			format = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : 1;
+		}
+	}
+
+	xil_printf("---------- TFTP Server (host) ----------\r\n\r\n");
+
+	mem_init();
+	memp_init();
+	hostFlashLoad(flash);
+
+	ret = hostDiskOpen(image, sizeMb);
+	if (ret < 0) {
+		perror(image);
+		return 1;
+	}
+
+	if ((ret || format) ? formatImage() : initFileSystem(Path, 0))
+		return 1;
+	xil_printf("File system initialized on %s...\r\n\n", image);
+
+	if (!ip4addr_aton(address, ip_2_ip4(&server_netif.ip_addr))) {
+		usage(argv[0]);
+		return 1;
+	}
+	hostUdpSetAddress(ip4_addr_get_u32(ip_2_ip4(&server_netif.ip_addr)));
+
+	printAppHeader();
+	startApplication();
+
+	listDirectory(Path);
+	createIndexFileTree(Path);
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	/*
+	 * the same order as the event loop of the board, waiting for packets
+	 * instead of sleeping until an interrupt when there is nothing to do
+	 */
+	while (!stop) {
+		received = hostUdpPoll(0);
+
+		TFTP_processTimers();
+		TFTP_processSchedule();
+
+		if (received)
+			continue;
+
+		work = TFTP_processStorage();
+		work |= TFTP_processWork();
+		if (!work && !TFTP_flashPolling())
+			hostUdpPoll(TFTP_EVENT_TICK_MS);
+	}
+
+	TFTP_statsPrintTotals();
+	hostImpairPrint();
+	if (flash)
+		hostFlashSave(flash);
+	f_mount(NULL, Path, 0);
+	hostDiskClose();
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+#
+# Tests how the server takes the ACKs of a download with a window
+# (RFC 7440) after a timeout.
+#
+# The client leaves a whole window unacknowledged, so the server times
+# out and sends the window again from its first block. The client then
+# misses a block of the resent window and acknowledges the block before
+# it, and right after that the ACK of the whole first window arrives, as
+# if it had been delayed. The server must go on with the next window
+# instead of resending the old one. A repeated or late ACK which comes
+# afterwards must not make it send anything (Sorcerer's Apprentice
+# Syndrome).
+#
+#   test/ack_test.py              (run from TFTP_server-host after make)
+#
+# Environment variables:
+#
+#   PORT        port of the server, as built (default: 6969)
+#
+
+import os
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+PORT = int(os.environ.get("PORT", "6969"))
+SERVER = "build/tftp_server"
+
+LOCAL = "127.0.0.1"
+
+RRQ, WRQ, DATA, ACK, ERROR, OACK = 1, 2, 3, 4, 5, 6
+
+BLKSIZE = 1428
+WINDOW = 16
+
+# the block of the window resent after the timeout which the client misses
+LOST = 6
+
+
+def fail(msg):
+    raise AssertionError(msg)
+
+
+def put(name, data):
+    """Uploads a file to the server under test, lock-step."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(2)
+    sock.sendto(struct.pack("!H", WRQ) + name.encode() + b"\0octet\0", (LOCAL, PORT))
+
+    block = 0
+    while True:
+        pkt, tid = sock.recvfrom(1024)
+        op, num = struct.unpack("!HH", pkt[:4])
+        if (op != ACK) or (num != (block & 0xFFFF)):
+            fail("unexpected answer to the upload of %s: %r" % (name, pkt))
+        if block and (len(chunk) < 512):
+            break
+        chunk = data[block * 512:(block + 1) * 512]
+        block += 1
+        sock.sendto(struct.pack("!HH", DATA, block & 0xFFFF) + chunk, tid)
+
+    sock.close()
+
+
+def receive(sock, timeout):
+    """Returns the number and the data of the next DATA packet, or None."""
+    sock.settimeout(timeout)
+    try:
+        pkt, _ = sock.recvfrom(2048)
+    except socket.timeout:
+        return None, None
+
+    op, num = struct.unpack("!HH", pkt[:4])
+    if op != DATA:
+        fail("expected a DATA packet, got %r" % pkt)
+    return num, pkt[4:]
+
+
+def test_late_ack(content):
+    """A delayed ACK of the old window moves the window on."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.sendto(struct.pack("!H", RRQ) + b"ack.bin\0octet\0blksize\0%d\0windowsize\0%d\0"
+                % (BLKSIZE, WINDOW), (LOCAL, PORT))
+
+    sock.settimeout(2)
+    pkt, tid = sock.recvfrom(1024)
+    if struct.unpack("!H", pkt[:2])[0] != OACK:
+        fail("expected an OACK, got %r" % pkt)
+    sock.sendto(struct.pack("!HH", ACK, 0), tid)
+
+    # the first window is received but not acknowledged
+    blocks = {}
+    while len(blocks) < WINDOW:
+        num, data = receive(sock, 2)
+        if num is None:
+            fail("only %d blocks of the first window are sent" % len(blocks))
+        blocks[num] = data
+
+    # the timeout sends the window again from its first block
+    num, _ = receive(sock, 3)
+    if num != 1:
+        fail("expected block 1 to be resent after the timeout, got %r" % num)
+
+    # a block of the resent window is lost, and the delayed ACK of the
+    # first window arrives right after the ACK of the block before it
+    sock.sendto(struct.pack("!HH", ACK, LOST - 1), tid)
+    sock.sendto(struct.pack("!HH", ACK, WINDOW), tid)
+
+    # the window after the acknowledged one follows well before the next timeout
+    start = time.time()
+    seen = []
+    while (time.time() - start) < 0.5:
+        num, data = receive(sock, 0.1)
+        if num is None:
+            continue
+        seen.append(num)
+        blocks.setdefault(num, data)
+
+    if not [num for num in seen if num >= LOST + WINDOW]:
+        fail("the delayed ACK is lost, only blocks %r are sent" % sorted(set(seen)))
+
+    # a repeated or late ACK is a duplicate, which is never answered
+    sock.sendto(struct.pack("!HH", ACK, WINDOW), tid)
+    sock.sendto(struct.pack("!HH", ACK, LOST - 2), tid)
+    num, _ = receive(sock, 0.3)
+    if num is not None:
+        fail("a duplicate ACK made the server send block %d" % num)
+
+    # the rest of the file is received window by window
+    last = (len(content) // BLKSIZE) + 1
+    acked = WINDOW
+    while acked < last:
+        done = acked
+        while (done + 1) in blocks:
+            done += 1
+
+        if (done == last) or ((done - acked) >= WINDOW):
+            acked = done
+            sock.sendto(struct.pack("!HH", ACK, acked), tid)
+            continue
+
+        num, data = receive(sock, 2)
+        if num is None:
+            # a block is missing, the blocks before it are acknowledged
+            acked = done
+            sock.sendto(struct.pack("!HH", ACK, acked), tid)
+        elif num > acked:
+            blocks.setdefault(num, data)
+
+    sock.close()
+
+    if b"".join(blocks[i] for i in range(1, last + 1)) != content:
+        fail("the downloaded file differs from the uploaded one")
+
+
+def main():
+    os.chdir(os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+    if not os.access(SERVER, os.X_OK):
+        sys.exit("Build the server first (make).")
+
+    work = tempfile.mkdtemp()
+    log = open(os.path.join(work, "server.log"), "w")
+    # the ACKs sent together are delivered together, after a short delay
+    server = subprocess.Popen([SERVER, "-i", os.path.join(work, "sd.img"), "-s", "64", "-a", LOCAL,
+                               "-n", "delay=5"],
+                              stdout=log, stderr=subprocess.STDOUT)
+
+    content = os.urandom(4 * WINDOW * BLKSIZE + 77)
+
+    failed = 0
+    try:
+        time.sleep(1)
+        put("ack.bin", content)
+        for test in (test_late_ack,):
+            try:
+                test(content)
+                print("%-16s ok" % test.__name__)
+            except (AssertionError, socket.timeout) as e:
+                print("%-16s FAILED: %s" % (test.__name__, e or "timeout"))
+                failed += 1
+    finally:
+        server.send_signal(signal.SIGINT)
+        server.wait()
+        log.close()
+
+    if failed:
+        print("server output: %s" % log.name)
+    else:
+        shutil.rmtree(work)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
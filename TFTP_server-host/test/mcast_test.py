@@ -0,0 +1,296 @@
+#!/usr/bin/env python3
+#
+# Tests the multicast client (RFC 2090) of the host build of the server.
+#
+# The test plays the remote TFTP server on a second loopback address.
+# An uploaded MCAST.REQ makes the server under test request a file from
+# it. The file is sent to a multicast group while the client is not the
+# master client, so it can only be received on the group; one block is
+# held back and sent after the client is made master and asks for it.
+# Another file is sent to the group with a block missing until the group
+# falls silent; the client fetches it by unicast and stops the unicast
+# transfer as soon as the file is complete. A last request announces a
+# file which needs more block numbers than there are, and the client
+# must refuse it.
+#
+#   test/mcast_test.py            (run from TFTP_server-host after make)
+#
+# Environment variables:
+#
+#   PORT        port of the server, as built (default: 6969)
+#
+
+import os
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+PORT = int(os.environ.get("PORT", "6969"))
+SERVER = "build/tftp_server"
+
+LOCAL = "127.0.0.1"
+REMOTE = "127.0.0.2"
+GROUP = "239.255.42.1"
+GROUP_PORT = 1758
+
+RRQ, WRQ, DATA, ACK, ERROR, OACK = 1, 2, 3, 4, 5, 6
+ERR_NOT_DEFINED, ERR_DISK_FULL = 0, 3
+
+# the block the client has to ask for as master
+HELD_BLOCK = 5
+
+
+def fail(msg):
+    raise AssertionError(msg)
+
+
+def options(payload):
+    """Returns the options of an RRQ or an OACK as a dictionary."""
+    fields = payload.split(b"\0")
+    return {fields[i].decode().lower(): fields[i + 1].decode()
+            for i in range(0, len(fields) - 1, 2)}
+
+
+def oack(opts):
+    return struct.pack("!H", OACK) + b"".join(
+        k.encode() + b"\0" + v.encode() + b"\0" for k, v in opts.items())
+
+
+def put(name, data):
+    """Uploads a small file to the server under test, lock-step."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(2)
+    sock.sendto(struct.pack("!H", WRQ) + name.encode() + b"\0octet\0", (LOCAL, PORT))
+
+    block = 0
+    while True:
+        pkt, tid = sock.recvfrom(1024)
+        op, num = struct.unpack("!HH", pkt[:4])
+        if (op != ACK) or (num != block):
+            fail("unexpected answer to the upload of %s: %r" % (name, pkt))
+        if block and (len(chunk) < 512):
+            break
+        chunk = data[block * 512:(block + 1) * 512]
+        block += 1
+        sock.sendto(struct.pack("!HH", DATA, block) + chunk, tid)
+
+    sock.close()
+
+
+def get(name):
+    """Downloads a file from the server under test, lock-step."""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(2)
+    sock.sendto(struct.pack("!H", RRQ) + name.encode() + b"\0octet\0", (LOCAL, PORT))
+
+    data = b""
+    block = 1
+    while True:
+        pkt, tid = sock.recvfrom(1024)
+        op, num = struct.unpack("!HH", pkt[:4])
+        if op != DATA:
+            fail("unexpected answer to the download of %s: %r" % (name, pkt))
+        if num == (block & 0xFFFF):
+            data += pkt[4:]
+            block += 1
+        sock.sendto(struct.pack("!HH", ACK, num), tid)
+        if (num == ((block - 1) & 0xFFFF)) and (len(pkt) - 4 < 512):
+            break
+
+    sock.close()
+    return data
+
+
+def request(listen, name, req="MCAST.REQ"):
+    """Makes the server under test request a file, returns its RRQ."""
+    put(req, ("%s %s\n" % (REMOTE, name)).encode())
+
+    pkt, client = listen.recvfrom(1024)
+    op, = struct.unpack("!H", pkt[:2])
+    if op != RRQ:
+        fail("expected an RRQ, got %r" % pkt)
+
+    fname, mode, rest = pkt[2:].split(b"\0", 2)
+    if fname.decode() != name:
+        fail("requested %s instead of %s" % (fname.decode(), name))
+
+    opts = options(rest)
+    if "multicast" not in opts:
+        fail("the multicast option is not asked for: %r" % opts)
+
+    return opts, client
+
+
+def transfer(sock):
+    """Opens the socket of a transfer, which also sends to the group."""
+    sock.bind((REMOTE, 0))
+    sock.settimeout(3)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(LOCAL))
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+
+
+def test_group(listen):
+    """The file is received from the group, as a client and as master."""
+    content = os.urandom(300 * 1024 + 77)
+    opts, client = request(listen, "mcast.bin")
+    blksize = int(opts.get("blksize", "512"))
+    blocks = [content[i:i + blksize] for i in range(0, len(content) + 1, blksize)]
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    transfer(sock)
+
+    sock.sendto(oack({"multicast": "%s,%d,0" % (GROUP, GROUP_PORT),
+                      "blksize": str(blksize), "tsize": str(len(content))}), client)
+
+    # the client joins the group when it takes the OACK
+    time.sleep(0.3)
+
+    for num, chunk in enumerate(blocks, 1):
+        if num != HELD_BLOCK:
+            sock.sendto(struct.pack("!HH", DATA, num) + chunk, (GROUP, GROUP_PORT))
+
+    # a client which is not master does not acknowledge anything
+    sock.settimeout(0.5)
+    try:
+        pkt, _ = sock.recvfrom(1024)
+        fail("a client which is not master answered: %r" % pkt)
+    except socket.timeout:
+        pass
+    sock.settimeout(3)
+
+    sock.sendto(oack({"multicast": ",,1"}), client)
+
+    # the master asks for the block after the last contiguous one it has
+    pkt, _ = sock.recvfrom(1024)
+    op, num = struct.unpack("!HH", pkt[:4])
+    if (op != ACK) or (num != HELD_BLOCK - 1):
+        fail("expected ACK %d from the master, got %r" % (HELD_BLOCK - 1, pkt))
+
+    sock.sendto(struct.pack("!HH", DATA, HELD_BLOCK) + blocks[HELD_BLOCK - 1],
+                (GROUP, GROUP_PORT))
+
+    pkt, _ = sock.recvfrom(1024)
+    op, num = struct.unpack("!HH", pkt[:4])
+    if (op != ACK) or (num != len(blocks)):
+        fail("expected the final ACK %d, got %r" % (len(blocks), pkt))
+    sock.close()
+
+    # the file is closed and its work is done by the main loop
+    time.sleep(0.3)
+    if get("mcast.bin") != content:
+        fail("the received file differs from the sent one")
+
+
+def test_fallback(listen):
+    """The missing blocks of a silent group are fetched by unicast."""
+    content = os.urandom(20 * 1024 + 5)
+    opts, client = request(listen, "fall.bin")
+    blksize = int(opts.get("blksize", "512"))
+    blocks = [content[i:i + blksize] for i in range(0, len(content) + 1, blksize)]
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    transfer(sock)
+
+    sock.sendto(oack({"multicast": "%s,%d,0" % (GROUP, GROUP_PORT),
+                      "blksize": str(blksize), "tsize": str(len(content))}), client)
+    time.sleep(0.3)
+
+    for num, chunk in enumerate(blocks, 1):
+        if num != HELD_BLOCK:
+            sock.sendto(struct.pack("!HH", DATA, num) + chunk, (GROUP, GROUP_PORT))
+    sock.close()
+
+    # the group is silent, so the file is requested again by unicast
+    listen.settimeout(10)
+    pkt, client = listen.recvfrom(1024)
+    listen.settimeout(3)
+    if struct.unpack("!H", pkt[:2])[0] != RRQ:
+        fail("expected the unicast RRQ, got %r" % pkt)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((REMOTE, 0))
+    sock.settimeout(3)
+    sock.sendto(oack({"blksize": str(blksize), "tsize": str(len(content))}), client)
+
+    # lock-step, each block is acknowledged until the file is complete
+    for num in range(HELD_BLOCK + 1):
+        pkt, _ = sock.recvfrom(1024)
+        op, ack = struct.unpack("!HH", pkt[:4])
+        if num == HELD_BLOCK:
+            break
+        if (op != ACK) or (ack != num):
+            fail("expected ACK %d, got %r" % (num, pkt))
+        sock.sendto(struct.pack("!HH", DATA, num + 1) + blocks[num], client)
+
+    # the blocks after the missing one are not sent again
+    if (op != ERROR) or (ack != ERR_NOT_DEFINED):
+        fail("expected the unicast transfer to be stopped, got %r" % pkt)
+    sock.close()
+
+    time.sleep(0.3)
+    if get("fall.bin") != content:
+        fail("the received file differs from the sent one")
+
+
+def test_too_large(listen):
+    """A file whose block numbers would roll over is refused."""
+    # the request file is found in any folder
+    opts, client = request(listen, "large.bin", "/logs/MCAST.REQ")
+    blksize = int(opts.get("blksize", "512"))
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    transfer(sock)
+
+    sock.sendto(oack({"multicast": "%s,%d,1" % (GROUP, GROUP_PORT),
+                      "blksize": str(blksize), "tsize": str(0xFFFF * blksize)}), client)
+
+    pkt, _ = sock.recvfrom(1024)
+    op, code = struct.unpack("!HH", pkt[:4])
+    if (op != ERROR) or (code != ERR_DISK_FULL):
+        fail("expected the file to be refused, got %r" % pkt)
+    sock.close()
+
+
+def main():
+    os.chdir(os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+    if not os.access(SERVER, os.X_OK):
+        sys.exit("Build the server first (make).")
+
+    work = tempfile.mkdtemp()
+    log = open(os.path.join(work, "server.log"), "w")
+    server = subprocess.Popen([SERVER, "-i", os.path.join(work, "sd.img"), "-s", "64", "-a", LOCAL],
+                              stdout=log, stderr=subprocess.STDOUT)
+
+    listen = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    listen.bind((REMOTE, PORT))
+    listen.settimeout(3)
+
+    failed = 0
+    try:
+        time.sleep(1)
+        for test in (test_group, test_fallback, test_too_large):
+            try:
+                test(listen)
+                print("%-16s ok" % test.__name__)
+            except (AssertionError, socket.timeout) as e:
+                print("%-16s FAILED: %s" % (test.__name__, e or "timeout"))
+                failed += 1
+    finally:
+        server.send_signal(signal.SIGINT)
+        server.wait()
+        log.close()
+
+    if failed:
+        print("server output: %s" % log.name)
+    else:
+        shutil.rmtree(work)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
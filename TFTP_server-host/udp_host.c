@@ -0,0 +1,285 @@
+/*
+ * udp_host.c
+ *
+ * The raw UDP API of lwIP on top of BSD sockets. Every PCB is a
+ * non-blocking socket, sent pbuf chains are copied into a single
+ * datagram and received datagrams are handed to the receive callback
+ * as chains of pool pbufs, the way the GEM driver hands them over.
+ * A PCB bound to a multicast group receives the packets of the group
+ * once it is joined, over the interface of the local address.
+ */
+
+#include "host.h"
+#include "tftp_hal.h"
+#include "tftp_stats.h"
+
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+#include "lwip/igmp.h"
+
+/* the byte order macros of lwIP give way to the ones of the C library */
+#undef htons
+#undef ntohs
+#undef htonl
+#undef ntohl
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define HOST_MAX_PCBS		MEMP_NUM_UDP_PCB
+#define HOST_MAX_DATAGRAM	65536
+
+/* windows of large blocks arrive in bursts */
+#define HOST_SOCKET_BUFFER	(4 * 1024 * 1024)
+
+static struct udp_pcb pcbs[HOST_MAX_PCBS];
+static int fds[HOST_MAX_PCBS];
+static u8 used[HOST_MAX_PCBS];
+
+static u8 datagram[HOST_MAX_DATAGRAM];
+
+/* local address of the sockets, in network byte order */
+static u32 localAddr = INADDR_ANY;
+
+/* the groups are joined on a socket of their own */
+static int groupFd = -1;
+
+void hostUdpSetAddress(u32 addr)
+{
+	localAddr = addr;
+}
+
+struct udp_pcb *udp_new(void)
+{
+	int i, fd, size = HOST_SOCKET_BUFFER;
+
+	for (i = 0; i < HOST_MAX_PCBS; i++) {
+		if (used[i])
+			continue;
+
+		fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fd < 0)
+			return NULL;
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+
+		memset(&pcbs[i], 0, sizeof pcbs[i]);
+		fds[i] = fd;
+		used[i] = 1;
+
+		return &pcbs[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * The socket of a PCB is bound on the first send, unless it is bound
+ * before. It is bound to the local address, or to the address of a
+ * group, addr in network byte order.
+ */
+static err_t hostUdpBindSocket(struct udp_pcb *pcb, u32 addr, u16_t port)
+{
+	struct sockaddr_in sa;
+	socklen_t saLen = sizeof sa;
+
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = addr;
+	sa.sin_port = htons(port);
+
+	if (bind(fds[pcb - pcbs], (struct sockaddr *)&sa, sizeof sa) ||
+		getsockname(fds[pcb - pcbs], (struct sockaddr *)&sa, &saLen))
+		return ERR_USE;
+
+	/* port 0 picks a free port, as in lwIP */
+	pcb->local_port = ntohs(sa.sin_port);
+
+	return ERR_OK;
+}
+
+err_t udp_bind(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port)
+{
+	if (ipaddr && ip4_addr_ismulticast(ip_2_ip4(ipaddr)))
+		return hostUdpBindSocket(pcb, ip4_addr_get_u32(ip_2_ip4(ipaddr)), port);
+
+	return hostUdpBindSocket(pcb, localAddr, port);
+}
+
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg)
+{
+	pcb->recv = recv;
+	pcb->recv_arg = recv_arg;
+}
+
+/* Sends a datagram on the socket of a PCB, addr and port in network byte order */
+void hostUdpTransmit(int fd, const u8 *data, int len, u32 addr, u16 port)
+{
+	struct sockaddr_in sa;
+
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = addr;
+	sa.sin_port = port;
+
+	sendto(fd, data, len, 0, (struct sockaddr *)&sa, sizeof sa);
+}
+
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port)
+{
+	struct sockaddr_in sa;
+	u16_t len;
+
+	if (!pcb->local_port && hostUdpBindSocket(pcb, localAddr, 0))
+		return ERR_USE;
+
+	len = pbuf_copy_partial(p, datagram, p->tot_len, 0);
+
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = ip4_addr_get_u32(ip_2_ip4(dst_ip));
+	sa.sin_port = htons(dst_port);
+
+	/* an impaired datagram is sent later, or never */
+	if (hostImpairOutput(fds[pcb - pcbs], datagram, len, sa.sin_addr.s_addr, sa.sin_port))
+		return ERR_OK;
+
+	if (sendto(fds[pcb - pcbs], datagram, len, 0, (struct sockaddr *)&sa, sizeof sa) < 0)
+		return ((errno == EAGAIN) || (errno == ENOBUFS)) ? ERR_MEM : ERR_RTE;
+
+	return ERR_OK;
+}
+
+void udp_remove(struct udp_pcb *pcb)
+{
+	int i = pcb - pcbs;
+
+	if (!hostImpairClose(fds[i]))
+		close(fds[i]);
+	used[i] = 0;
+}
+
+/* Joins or leaves a group on the interface of the local address */
+static err_t hostUdpMembership(const ip4_addr_t *groupaddr, int option)
+{
+	struct ip_mreq mreq;
+
+	if ((groupFd < 0) && ((groupFd = socket(AF_INET, SOCK_DGRAM, 0)) < 0))
+		return ERR_MEM;
+
+	mreq.imr_multiaddr.s_addr = ip4_addr_get_u32(groupaddr);
+	mreq.imr_interface.s_addr = localAddr;
+
+	if (setsockopt(groupFd, IPPROTO_IP, option, &mreq, sizeof mreq))
+		return ERR_VAL;
+
+	return ERR_OK;
+}
+
+err_t igmp_joingroup_netif(struct netif *netif, const ip4_addr_t *groupaddr)
+{
+	LWIP_UNUSED_ARG(netif);
+
+	return hostUdpMembership(groupaddr, IP_ADD_MEMBERSHIP);
+}
+
+err_t igmp_leavegroup_netif(struct netif *netif, const ip4_addr_t *groupaddr)
+{
+	LWIP_UNUSED_ARG(netif);
+
+	return hostUdpMembership(groupaddr, IP_DROP_MEMBERSHIP);
+}
+
+/*
+ * This function passes a received datagram to the receive callback of
+ * its PCB as a chain of pool pbufs. Returns 1 if it is delivered, or 0
+ * if the PCB is closed meanwhile or there is no free pbuf.
+ */
+int hostUdpDeliver(int pcb, int fd, const u8 *data, int len, u32 addr, u16 port)
+{
+	struct pbuf *p;
+	ip_addr_t ip;
+
+	if (!used[pcb] || (fds[pcb] != fd) || !pcbs[pcb].recv)
+		return 0;
+
+	p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_POOL);
+	if (!p)
+		return 0;
+	pbuf_take(p, data, len);
+
+	ip_addr_set_zero(&ip);
+	ip4_addr_set_u32(ip_2_ip4(&ip), addr);
+
+	pcbs[pcb].recv(pcbs[pcb].recv_arg, &pcbs[pcb], p, &ip, ntohs(port));
+
+	return 1;
+}
+
+/*
+ * This function waits up to timeoutMs for datagrams and passes at most
+ * one datagram per PCB to its receive callback. The datagrams held by
+ * the impairment layer are passed on when their time comes. It returns
+ * the number of datagrams received.
+ */
+int hostUdpPoll(int timeoutMs)
+{
+	struct pollfd pfds[HOST_MAX_PCBS];
+	int index[HOST_MAX_PCBS];
+	struct sockaddr_in sa;
+	socklen_t saLen;
+	ssize_t len;
+	int i, n = 0, next, received, ready;
+	u32 start;
+
+	received = hostImpairRun();
+	if (received)
+		timeoutMs = 0;
+
+	next = hostImpairNextMs();
+	if ((next >= 0) && (next < timeoutMs))
+		timeoutMs = next;
+
+	for (i = 0; i < HOST_MAX_PCBS; i++) {
+		if (!used[i] || !pcbs[i].recv)
+			continue;
+		pfds[n].fd = fds[i];
+		pfds[n].events = POLLIN;
+		pfds[n].revents = 0;
+		index[n++] = i;
+	}
+
+	/* the time spent waiting counts as the idle time of the server */
+	start = TFTP_getTimeUs();
+	ready = poll(pfds, n, timeoutMs);
+	if (timeoutMs)
+		TFTP_statsIdle(TFTP_getTimeUs() - start);
+	if (ready <= 0)
+		return received;
+
+	for (i = 0; i < n; i++) {
+		/* a callback may have closed the PCB meanwhile */
+		if (!(pfds[i].revents & POLLIN) || !used[index[i]] || (fds[index[i]] != pfds[i].fd))
+			continue;
+
+		saLen = sizeof sa;
+		len = recvfrom(pfds[i].fd, datagram, sizeof datagram, 0, (struct sockaddr *)&sa, &saLen);
+		if (len < 0)
+			continue;
+
+		if (hostImpairInput(index[i], pfds[i].fd, datagram, len, sa.sin_addr.s_addr, sa.sin_port))
+			continue;
+
+		received += hostUdpDeliver(index[i], pfds[i].fd, datagram, len,
+				sa.sin_addr.s_addr, sa.sin_port);
+	}
+
+	return received;
+}
@@ -51,7 +51,7 @@
 #define MEM_ALIGNMENT 64
 #define MEM_SIZE 131072
 #define MEMP_NUM_PBUF 16
-#define MEMP_NUM_UDP_PCB 4
+#define MEMP_NUM_UDP_PCB 40
 #define MEMP_NUM_TCP_PCB 32
 #define MEMP_NUM_TCP_PCB_LISTEN 8
 #define MEMP_NUM_TCP_SEG 256
@@ -71,6 +71,8 @@
 
 #define ICMP_TTL 255
 
+#define LWIP_IGMP 1
+
 #define IP_OPTIONS 0
 #define IP_FORWARD 0
 #define IP_REASSEMBLY 1